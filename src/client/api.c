@@ -1,25 +1,381 @@
 #include "api.h"
 #include "../common/constants.h"
 #include "../common/protocol.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include "../common/io.h"
+#include "../common/ring.h"
 
 
 static char s_req_pipe_path[MAX_PIPE_PATH_LENGTH];
 static char s_resp_pipe_path[MAX_PIPE_PATH_LENGTH];
 static char s_notif_pipe_path[MAX_PIPE_PATH_LENGTH];
 
+// The session's FIFOs, open from kvs_connect to kvs_disconnect.
+static int s_req_fd = -1;
+static int s_resp_fd = -1;
+static int s_notif_fd = -1;
+
+// Rings of a session in shared memory, NULL otherwise, and their doorbells:
+// the server's, rung for requests and room for responses, and the client's,
+// rung for responses and room for requests. The socket then only tells when
+// the server is gone.
+static struct RingPair *s_shm = NULL;
+static int s_server_bell = -1;
+static int s_client_bell = -1;
+
+// The same memory, mapped again for the thread reading notifications, and
+// the doorbells of the notifications ring. The reader lets them go once the
+// server closed the notification pipe, which may be after kvs_disconnect.
+static struct RingPair *s_notif_shm = NULL;
+static int s_notify_bell = -1;
+static int s_room_bell = -1;
+
+// Lets the notifications ring go.
+static void close_notifications(void) {
+  if (s_notif_shm != NULL) {
+    munmap(s_notif_shm, sizeof(*s_notif_shm));
+    s_notif_shm = NULL;
+    close(s_notify_bell);
+    close(s_room_bell);
+    s_notify_bell = -1;
+    s_room_bell = -1;
+  }
+}
+
+static void close_pipes(void) {
+  if (s_req_fd != -1) {
+    close(s_req_fd);
+  }
+  // Over a socket, requests and responses share the descriptor.
+  if (s_resp_fd != -1 && s_resp_fd != s_req_fd) {
+    close(s_resp_fd);
+  }
+  if (s_notif_fd != -1) {
+    close(s_notif_fd);
+  }
+  s_req_fd = -1;
+  s_resp_fd = -1;
+  s_notif_fd = -1;
+
+  if (s_shm != NULL) {
+    munmap(s_shm, sizeof(*s_shm));
+    s_shm = NULL;
+    close(s_server_bell);
+    close(s_client_bell);
+    s_server_bell = -1;
+    s_client_bell = -1;
+  }
+
+  // Socket sessions have no FIFOs to remove.
+  if (s_req_pipe_path[0] != '\0') {
+    unlink(s_req_pipe_path);
+    unlink(s_resp_pipe_path);
+    unlink(s_notif_pipe_path);
+  }
+}
+
+// Protocol version negotiated with the server, and the id of the next
+// request sent in version 2.
+static int s_version = PROTOCOL_VERSION_1;
+static uint32_t s_next_id = 0;
+
+// Notifications come as frames, in version 3. Bytes read from the
+// notification pipe that do not make a whole notification yet wait in the
+// buffer. Only the thread reading notifications touches it.
+static int s_notif_framed = 0;
+static char s_notif_buf[PIPE_BUF];
+static size_t s_notif_len = 0;
+
+// Settles on the version the server replied with.
+static void set_version(int version) {
+  if (version > PROTOCOL_VERSION_MAX) {
+    version = PROTOCOL_VERSION_MAX;
+  } else if (version < PROTOCOL_VERSION_1) {
+    version = PROTOCOL_VERSION_1;
+  }
+  s_version = version;
+  s_next_id = 0;
+  s_notif_framed = version >= PROTOCOL_VERSION_3;
+  s_notif_len = 0;
+}
+
+// Reads exactly the given number of bytes of responses.
+// @return 1 on success, 0 if the server is gone, -1 on error.
+static int session_read(void *data, size_t len) {
+  if (s_shm != NULL) {
+    return ring_read_all(&s_shm->responses, s_server_bell, s_client_bell,
+                         s_resp_fd, data, len);
+  }
+  return read_all(s_resp_fd, data, len, NULL);
+}
+
+// Writes the given bytes of requests.
+// @return 1 on success, -1 on error.
+static int session_write(const void *data, size_t len) {
+  if (s_shm != NULL) {
+    return ring_write_all(&s_shm->requests, s_server_bell, s_client_bell,
+                          s_req_fd, data, len);
+  }
+  return write_all(s_req_fd, data, len);
+}
+
+// Reads the response to a request.
+// @param request_id Set to the id the response echoes, in version 2.
+// @param op_code Set to the opcode of the request answered, if not NULL.
+// @param payload If not NULL, set to the payload of the response, allocated
+// with malloc and terminated with '\0', or NULL if it has none. Otherwise
+// the payload is skipped.
+// @return The result sent by the server, or -1 if it is gone.
+static int read_response(uint32_t *request_id, int *op_code, char **payload) {
+  if (payload != NULL) {
+    *payload = NULL;
+  }
+  if (s_version >= PROTOCOL_VERSION_2) {
+    struct FrameHeader header;
+    if (session_read(&header, sizeof(header)) != 1) {
+      fprintf(stderr, "Server closed the connection\n");
+      return -1;
+    }
+    *request_id = header.request_id;
+    if (op_code != NULL) {
+      *op_code = header.opcode;
+    }
+    if (header.length > 0) {
+      char *data = malloc(header.length + 1);
+      if (data == NULL ||
+          session_read(data, header.length) != 1) {
+        fprintf(stderr, "Failed to read a response\n");
+        free(data);
+        return -1;
+      }
+      data[header.length] = '\0';
+      if (payload != NULL) {
+        *payload = data;
+      } else {
+        free(data);
+      }
+    }
+    return header.status;
+  }
+
+  char resp_buf[3] = {0};
+  if (session_read(resp_buf, sizeof(resp_buf)) != 1) {
+    fprintf(stderr, "Server closed the connection\n");
+    return -1;
+  }
+  *request_id = 0;
+  if (op_code != NULL) {
+    *op_code = resp_buf[0];
+  }
+  return resp_buf[1] - '0';
+}
+
+// Writes the payload of a version 2 request for a key: the key, then a
+// '\0' and the options of a subscription if there are any.
+// @return Length of the payload.
+static size_t encode_key(char *payload, const char *key,
+                         const struct SubscribeOptions *options) {
+  size_t len = key == NULL ? 0 : strnlen(key, MAX_STRING_SIZE);
+  if (len > 0) {
+    memcpy(payload, key, len);
+  }
+  if (options != NULL) {
+    payload[len] = '\0';
+    memcpy(payload + len + 1, options, sizeof(*options));
+    len += 1 + sizeof(*options);
+  }
+  return len;
+}
+
+// Sends a request, framed as the negotiated version wants it.
+// @param options Options of a subscription, version 2 only, or NULL.
+// @param request_id Set to the id of the request, in version 2.
+// @return 0 if it was sent, 1 if the server is gone.
+static int send_request(char op_code, const char *key,
+                        const struct SubscribeOptions *options,
+                        uint32_t *request_id) {
+  char request[FRAME_HEADER_SIZE + MAX_STRING_SIZE + 1 +
+               sizeof(struct SubscribeOptions)] = {0};
+  size_t size;
+
+  if (s_version >= PROTOCOL_VERSION_2) {
+    size_t len = encode_key(request + sizeof(struct FrameHeader), key,
+                            options);
+    struct FrameHeader header = {
+        .length = (uint32_t)len,
+        .request_id = s_next_id++,
+        .opcode = (uint8_t)op_code,
+    };
+    memcpy(request, &header, sizeof(header));
+    size = sizeof(header) + len;
+    *request_id = header.request_id;
+  } else {
+    // OP_CODE + 41-char buffer, or just the opcode without a key.
+    request[0] = op_code;
+    if (key != NULL) {
+      strncpy(request + 1, key, MAX_STRING_SIZE);
+      size = 1 + MAX_STRING_SIZE + 1;
+    } else {
+      size = 1;
+    }
+    *request_id = 0;
+  }
+
+  if (session_write(request, size) != 1) {
+    fprintf(stderr, "Server closed the connection\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Sends a request and waits for its response. No other request may be
+// outstanding, so the next response is the one.
+// @return The result sent by the server, or -1 if it is gone.
+static int sync_request(char op_code, const char *key,
+                        const struct SubscribeOptions *options) {
+  uint32_t sent_id;
+  uint32_t answered_id;
+  if (send_request(op_code, key, options, &sent_id) != 0) {
+    return -1;
+  }
+  int result = read_response(&answered_id, NULL, NULL);
+  if (result != -1 && answered_id != sent_id) {
+    fprintf(stderr, "Response to request %u while waiting for %u\n",
+            answered_id, sent_id);
+    return -1;
+  }
+  return result;
+}
+
+// Connects over the server's Unix socket. The reply carries the read end
+// of the notification pipe.
+// @return 0 if the connection was established successfully, 1 otherwise.
+static int connect_socket(const char *socket_path, int *notif_pipe) {
+  s_req_pipe_path[0] = '\0';
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  s_req_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s_req_fd == -1 ||
+      connect(s_req_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Error connecting to server socket");
+    close_pipes();
+    return 1;
+  }
+  s_resp_fd = s_req_fd;
+
+  // Ask for shared memory: the server may not offer it.
+  char request[SOCKET_CONNECT_SIZE] = {
+      OP_CODE_CONNECT, (char)(PROTOCOL_VERSION_MAX | CONNECT_FLAG_SHM)};
+  if (write_all(s_req_fd, request, sizeof(request)) != 1) {
+    perror("Error writing to server socket");
+    close_pipes();
+    return 1;
+  }
+
+  char reply[3] = {0};
+  struct iovec iov = {.iov_base = reply, .iov_len = sizeof(reply)};
+  int fds[CONNECT_FDS] = {-1, -1, -1, -1, -1, -1};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(s_req_fd, &msg, 0);
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len <= CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+  }
+  // The pipe comes first, then the shared memory and its doorbells if the
+  // server agreed.
+  s_notif_fd = fds[CONNECT_FD_NOTIFICATIONS];
+
+  // The descriptors come with the first byte: the rest may trail behind.
+  if (n <= 0 || (n < (ssize_t)sizeof(reply) &&
+                 read_all(s_req_fd, reply + n, sizeof(reply) - (size_t)n,
+                          NULL) != 1)) {
+    fprintf(stderr, "Server closed the connection\n");
+    reply[1] = '1';
+  } else if (fds[CONNECT_FDS - 1] != -1 && (reply[2] & CONNECT_FLAG_SHM)) {
+    s_shm = mmap(NULL, sizeof(*s_shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fds[CONNECT_FD_SHM], 0);
+    s_notif_shm = mmap(NULL, sizeof(*s_notif_shm), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fds[CONNECT_FD_SHM], 0);
+    if (s_shm == MAP_FAILED || s_notif_shm == MAP_FAILED) {
+      perror("Error mapping shared memory");
+      if (s_shm != MAP_FAILED) {
+        munmap(s_shm, sizeof(*s_shm));
+      }
+      if (s_notif_shm != MAP_FAILED) {
+        munmap(s_notif_shm, sizeof(*s_notif_shm));
+      }
+      s_shm = NULL;
+      s_notif_shm = NULL;
+      reply[1] = '1';
+    } else {
+      s_server_bell = fds[CONNECT_FD_SERVER_BELL];
+      s_client_bell = fds[CONNECT_FD_CLIENT_BELL];
+      s_notify_bell = fds[CONNECT_FD_NOTIFY_BELL];
+      s_room_bell = fds[CONNECT_FD_ROOM_BELL];
+      fds[CONNECT_FD_SERVER_BELL] = fds[CONNECT_FD_CLIENT_BELL] = -1;
+      fds[CONNECT_FD_NOTIFY_BELL] = fds[CONNECT_FD_ROOM_BELL] = -1;
+    }
+  }
+  // Whatever is left was not taken.
+  for (int i = CONNECT_FD_SHM; i < CONNECT_FDS; i++) {
+    if (fds[i] != -1) {
+      close(fds[i]);
+    }
+  }
+
+  // Print response code
+  printf("Server returned %c for operation: connect\n", reply[1]);
+  if (reply[1] != '0' || s_notif_fd == -1) {
+    close_notifications();
+    close_pipes();
+    return 1;
+  }
+  set_version((unsigned char)reply[2] & ~CONNECT_FLAG_SHM);
+  *notif_pipe = s_notif_fd;
+  return 0;
+}
 
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
-                char const *server_pipe_path, char const *notif_pipe_path) {
-  
+                char const *server_pipe_path, char const *notif_pipe_path,
+                int *notif_pipe) {
+  struct stat server_stat;
+  if (stat(server_pipe_path, &server_stat) == 0 &&
+      S_ISSOCK(server_stat.st_mode)) {
+    return connect_socket(server_pipe_path, notif_pipe);
+  }
+
   strncpy(s_req_pipe_path, req_pipe_path, sizeof(s_req_pipe_path)-1);
-  strncpy(s_resp_pipe_path, resp_pipe_path, sizeof(s_resp_pipe_path)-1); 
+  strncpy(s_resp_pipe_path, resp_pipe_path, sizeof(s_resp_pipe_path)-1);
   strncpy(s_notif_pipe_path, notif_pipe_path, sizeof(s_notif_pipe_path)-1);
 
   unlink(req_pipe_path);
@@ -44,194 +400,1089 @@ int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
     return 1;
   }
 
-/*
-
-  *notif_pipe = open(notif_pipe_path, O_RDONLY | O_NONBLOCK);
-  if (*notif_pipe < 0) {
-      perror("Error opening notification FIFO");
-      unlink(req_pipe_path);
-      unlink(resp_pipe_path);
-      unlink(notif_pipe_path);
-      return 1;
+  // The read ends are open before the server hears of the client, so it
+  // can open the write ends without waiting. Opening them non-blocking does
+  // not wait for the server either.
+  s_resp_fd = open(resp_pipe_path, O_RDONLY | O_NONBLOCK);
+  s_notif_fd = open(notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  if (s_resp_fd < 0 || s_notif_fd < 0) {
+    perror("Error opening response or notification FIFO");
+    close_pipes();
+    return 1;
   }
 
-*/
-
-
   // Open the server pipe
   int fd_server = open(server_pipe_path, O_WRONLY);
   if (fd_server == -1) {
     perror("Error opening server pipe from client");
-    unlink(req_pipe_path);
-    unlink(resp_pipe_path);
-    unlink(notif_pipe_path);
+    close_pipes();
     return 1;
   }
-  // preparar mensagem de pedido
-  char message[1 + 40 + 40 + 40];
+  // preparar mensagem de pedido: opcode, versao e os tres caminhos
+  char message[1 + 1 + 40 + 40 + 40];
   memset(message, 0, sizeof(message));
   message[0] = OP_CODE_CONNECT; // OP_CODE=1
-  strncpy(message + 1, req_pipe_path, 40);
-  strncpy(message + 1 + 40, resp_pipe_path, 40);
-  strncpy(message + 1 + 80, notif_pipe_path, 40);
+  message[1] = PROTOCOL_VERSION_MAX;
+  strncpy(message + 2, req_pipe_path, 40);
+  strncpy(message + 2 + 40, resp_pipe_path, 40);
+  strncpy(message + 2 + 80, notif_pipe_path, 40);
 
   // mandar mensagem ao serivor
 
-  
-  if (write(fd_server, message, sizeof(message)) < 0) {
+
+  if (write_all(fd_server, message, sizeof(message)) != 1) {
       perror("Error writing to server FIFO");
       close(fd_server);
+      close_pipes();
       return 1;
   }
   close(fd_server);
 
-  // Open and read the response FIFO
-  int resp_fd = open(resp_pipe_path, O_RDONLY);
-  if (resp_fd < 0) {
-      perror("Error opening response FIFO");
+  // Until the server opens the response FIFO, reading it would return EOF
+  // right away: wait for the reply to arrive instead.
+  struct pollfd pfd = {.fd = s_resp_fd, .events = POLLIN};
+  while (poll(&pfd, 1, -1) == -1) {
+    if (errno != EINTR) {
+      perror("Error waiting for the server");
+      close_pipes();
       return 1;
+    }
+  }
+  if (fcntl(s_resp_fd, F_SETFL, 0) == -1 ||
+      fcntl(s_notif_fd, F_SETFL, 0) == -1) {
+    perror("Error setting FIFOs blocking");
+    close_pipes();
+    return 1;
   }
 
-  // Read server response: OP_CODE(1) + result
-  char resp_buf[3] = {0};
-  if (read(resp_fd, resp_buf, sizeof(resp_buf)) < 0) {
-      perror("read resp_pipe_path");
-      close(resp_fd);
+  // The reply is always in the version 1 format, with the version the
+  // session speaks in its last byte.
+  char reply[3] = {0};
+  if (read_all(s_resp_fd, reply, sizeof(reply), NULL) != 1) {
+    fprintf(stderr, "Server closed the connection\n");
+    close_pipes();
+    return 1;
+  }
+  // Print response code
+  printf("Server returned %c for operation: connect\n", reply[1]);
+  if (reply[1] != '0') {
+    close_pipes();
+    return 1;
+  }
+  set_version((unsigned char)reply[2]);
+
+  // The server opened the read end before replying.
+  s_req_fd = open(req_pipe_path, O_WRONLY);
+  if (s_req_fd < 0) {
+      perror("Error opening request FIFO");
+      close_pipes();
       return 1;
   }
-  close(resp_fd);
 
-  // Print response code
-  printf("Server returned %c for operation: connect\n", resp_buf[1]);
+  *notif_pipe = s_notif_fd;
+  return 0;
+}
+
+int kvs_disconnect(void) {
+  kvs_async_stop();
+  int result = sync_request(OP_CODE_DISCONNECT, NULL, NULL);
 
-  // Success if server returned 0
-  return (resp_buf[1] == '0') ? 0 : 1;
+  // The notification pipe belongs to the caller now.
+  s_notif_fd = -1;
+  close_pipes();
 
+  if (result == -1) {
+    return 1;
+  }
+  printf("Server returned %d for operation: disconnect\n", result);
+  return (result == 0) ? 0 : 1;
+}
+
+int kvs_subscribe(const char *key) {
+  int result = sync_request(OP_CODE_SUBSCRIBE, key, NULL);
+  if (result == -1) {
+    return 0;
+  }
+  printf("Server returned %d for operation: subscribe\n", result);
+  return (result == 0) ? 0 : 1;
+}
+
+int kvs_subscribe_mode(const char *key, int mode, uint32_t window_ms) {
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not take delivery modes\n");
+    return 0;
+  }
+  struct SubscribeOptions options = {.window_ms = window_ms,
+                                     .mode = (uint8_t)mode};
+  int result = sync_request(OP_CODE_SUBSCRIBE, key, &options);
+  if (result == -1) {
+    return 0;
+  }
+  printf("Server returned %d for operation: subscribe\n", result);
+  return (result == 1) ? 1 : 0;
 }
 
-int kvs_disconnect(char const *req_pipe_path, char const *resp_pipe_path) {
-  // close pipes and unlink pipe files
-  // Prepare message
-  char request[1] = {OP_CODE_DISCONNECT};
-  // Send to request pipe
-  int req_fd = open(req_pipe_path, O_WRONLY);
-  if (req_fd < 0) {
-    perror("Error opening request FIFO for disconnect");
+int kvs_unsubscribe(const char *key) {
+  int result = sync_request(OP_CODE_UNSUBSCRIBE, key, NULL);
+  if (result == -1) {
     return 1;
   }
-  if (write(req_fd, request, sizeof(request)) < 0) {
-    perror("Error writing disconnect request");
-    close(req_fd);
+  printf("Server returned %d for operation: unsubscribe\n", result);
+  return (result == 0) ? 0 : 1;
+}
+
+int kvs_psubscribe(const char *pattern, int mode, uint32_t window_ms) {
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not take patterns\n");
+    return 0;
+  }
+  struct SubscribeOptions options = {.window_ms = window_ms,
+                                     .mode = (uint8_t)mode};
+  int result = sync_request(OP_CODE_PSUBSCRIBE, pattern, &options);
+  if (result == -1) {
+    return 0;
+  }
+  printf("Server returned %d for operation: psubscribe\n", result);
+  return (result == 1) ? 1 : 0;
+}
+
+int kvs_punsubscribe(const char *pattern) {
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not take patterns\n");
+    return 1;
+  }
+  int result = sync_request(OP_CODE_PUNSUBSCRIBE, pattern, NULL);
+  if (result == -1) {
+    return 1;
+  }
+  printf("Server returned %d for operation: punsubscribe\n", result);
+  return (result == 0) ? 0 : 1;
+}
+
+// Sends a request without waiting for its response.
+// @return 0 if it was sent, 1 otherwise.
+static int async_request(char op_code, const char *key,
+                         uint32_t *request_id) {
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not pipeline requests\n");
+    return 1;
+  }
+  return send_request(op_code, key, NULL, request_id);
+}
+
+int kvs_subscribe_async(const char *key, uint32_t *request_id) {
+  return async_request(OP_CODE_SUBSCRIBE, key, request_id);
+}
+
+int kvs_unsubscribe_async(const char *key, uint32_t *request_id) {
+  return async_request(OP_CODE_UNSUBSCRIBE, key, request_id);
+}
+
+int kvs_wait_response(uint32_t *request_id, int *op_code, int *result) {
+  *result = read_response(request_id, op_code, NULL);
+  return *result == -1 ? 1 : 0;
+}
+
+// Sends a frame whose payload is already in place and waits for its
+// response. No other request may be outstanding.
+// @param request Frame, with room for its header before the payload.
+// @param len Length of the payload.
+// @param payload Set to the payload of the response, as read_response does.
+// @return The result sent by the server, or -1 if the request could not be
+// sent or answered.
+static int frame_request(char op_code, char *request, size_t len,
+                         char **payload) {
+  struct FrameHeader header = {
+      .length = (uint32_t)len,
+      .request_id = s_next_id++,
+      .opcode = (uint8_t)op_code,
+  };
+  memcpy(request, &header, sizeof(header));
+  if (session_write(request, sizeof(header) + len) != 1) {
+    fprintf(stderr, "Server closed the connection\n");
+    return -1;
+  }
+
+  uint32_t answered_id;
+  int result = read_response(&answered_id, NULL, payload);
+  if (result != -1 && answered_id != header.request_id) {
+    fprintf(stderr, "Response to request %u while waiting for %u\n",
+            answered_id, header.request_id);
+    free(*payload);
+    *payload = NULL;
+    return -1;
+  }
+  return result;
+}
+
+// Writes the payload of a data request: each key, followed by its value
+// for PUT, as a length byte and its characters.
+// @param payload Room for FRAME_MAX_PAYLOAD bytes.
+// @param len Set to the length of the payload.
+// @return 0 on success, 1 if the keys do not fit a request.
+static int encode_data(size_t num_keys, const char *const keys[],
+                       const char *const values[], char *payload,
+                       size_t *len) {
+  if (num_keys == 0 || num_keys > DATA_MAX_KEYS) {
+    fprintf(stderr, "A data request takes 1 to %d keys\n", DATA_MAX_KEYS);
     return 1;
   }
+  *len = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    for (int is_value = 0; is_value <= (values != NULL); is_value++) {
+      const char *str = is_value ? values[i] : keys[i];
+      size_t str_len = strlen(str);
+      if (str_len == 0 || str_len > DATA_STRING_MAX ||
+          *len + 1 + str_len > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Data request too large\n");
+        return 1;
+      }
+      payload[*len] = (char)str_len;
+      memcpy(payload + *len + 1, str, str_len);
+      *len += 1 + str_len;
+    }
+  }
+  return 0;
+}
 
-  close(req_fd);
+// Sends a data request and waits for its response. No other request may be
+// outstanding.
+// @param values Values of the keys for PUT, NULL otherwise.
+// @param payload Set to the payload of the response, as read_response does.
+// @return The result sent by the server, or -1 if the request could not be
+// sent or answered.
+static int data_request(char op_code, size_t num_keys,
+                        const char *const keys[], const char *const values[],
+                        char **payload) {
+  *payload = NULL;
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not serve data requests\n");
+    return -1;
+  }
+  char request[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  size_t len;
+  if (encode_data(num_keys, keys, values, request + FRAME_HEADER_SIZE,
+                  &len) != 0) {
+    return -1;
+  }
+  return frame_request(op_code, request, len, payload);
+}
 
-  // Read response
-  int resp_fd = open(resp_pipe_path, O_RDONLY);
-  if (resp_fd < 0) {
-    perror("Error opening response FIFO for disconnect");
+int kvs_mget(size_t num_keys, const char *const keys[],
+             char values[][MAX_STRING_SIZE], int found[]) {
+  char *payload;
+  int result = data_request(OP_CODE_MGET, num_keys, keys, NULL, &payload);
+  if (result != 0 || payload == NULL) {
+    free(payload);
     return 1;
   }
-  // Read server response: OP_CODE(2) + result
-  char resp_buf[3] = {0};
+  result = kvs_parse_values(payload, num_keys, keys, values, found);
+  free(payload);
+  return result;
+}
 
-  if (read(resp_fd, resp_buf, sizeof(resp_buf)) < 0) {
-      perror("read resp_pipe_path");
-      close(resp_fd);
+int kvs_parse_values(const char *payload, size_t num_keys,
+                     const char *const keys[],
+                     char values[][MAX_STRING_SIZE], int found[]) {
+  // The line is "[(key,value)...]": pairs come in the order of the keys.
+  const char *pos = payload[0] == '[' ? payload + 1 : "";
+  for (size_t i = 0; i < num_keys; i++) {
+    size_t key_len = strlen(keys[i]);
+    const char *end = NULL;
+    if (pos[0] == '(' && strncmp(pos + 1, keys[i], key_len) == 0 &&
+        pos[1 + key_len] == ',') {
+      pos += 2 + key_len;
+      end = strchr(pos, ')');
+    }
+    if (end == NULL || (size_t)(end - pos) > DATA_STRING_MAX) {
+      fprintf(stderr, "Malformed response to a read\n");
       return 1;
+    }
+    memcpy(values[i], pos, (size_t)(end - pos));
+    values[i][end - pos] = '\0';
+    found[i] = strcmp(values[i], "KVSERROR") != 0;
+    if (!found[i]) {
+      values[i][0] = '\0';
+    }
+    pos = end + 1;
   }
+  return 0;
+}
+
+int kvs_get(const char *key, char value[MAX_STRING_SIZE], int *found) {
+  const char *keys[1] = {key};
+  return kvs_mget(1, keys, (char(*)[MAX_STRING_SIZE])value, found);
+}
 
-  close(resp_fd);
+int kvs_put(size_t num_pairs, const char *const keys[],
+            const char *const values[]) {
+  char *payload;
+  int result = data_request(OP_CODE_PUT, num_pairs, keys, values, &payload);
+  free(payload);
+  return result == 0 ? 0 : 1;
+}
 
-  // clean pipes
+int kvs_del(size_t num_keys, const char *const keys[], size_t *num_missing) {
+  char *payload;
+  int result = data_request(OP_CODE_DEL, num_keys, keys, NULL, &payload);
+  if (result != 0) {
+    free(payload);
+    return 1;
+  }
+  // Every missing key is listed as "(key,KVSMISSING)".
+  *num_missing = 0;
+  for (const char *pos = payload; pos != NULL && *pos != '\0'; pos++) {
+    if (*pos == '(') {
+      (*num_missing)++;
+    }
+  }
+  free(payload);
+  return 0;
+}
 
-  unlink(s_req_pipe_path);
-  unlink(s_resp_pipe_path); 
-  unlink(s_notif_pipe_path);
+// Sends MSUBSCRIBE or MUNSUBSCRIBE requests for keys, as many keys to a
+// frame as fit.
+// @param options Options of the subscriptions, or NULL.
+// @return 0 if every request was answered, 1 otherwise.
+static int batch_request(char op_code, size_t num_keys,
+                         const char *const keys[],
+                         const struct SubscribeOptions *options,
+                         int results[]) {
+  size_t trailer = options != NULL ? 1 + sizeof(*options) : 0;
+  size_t next = 0;
+  while (next < num_keys) {
+    char request[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    size_t len = 0;
+    size_t first = next;
+    while (next < num_keys && next - first < DATA_MAX_KEYS) {
+      size_t key_len = strlen(keys[next]);
+      if (key_len == 0 || key_len > DATA_STRING_MAX) {
+        fprintf(stderr, "Invalid key: %s\n", keys[next]);
+        return 1;
+      }
+      if (len + 1 + key_len + trailer > FRAME_MAX_PAYLOAD) {
+        break;
+      }
+      request[FRAME_HEADER_SIZE + len] = (char)key_len;
+      memcpy(request + FRAME_HEADER_SIZE + len + 1, keys[next], key_len);
+      len += 1 + key_len;
+      next++;
+    }
+    if (options != NULL) {
+      request[FRAME_HEADER_SIZE + len] = '\0';
+      memcpy(request + FRAME_HEADER_SIZE + len + 1, options,
+             sizeof(*options));
+      len += trailer;
+    }
 
-  printf("Server returned %c for operation: disconnect\n", resp_buf[1]);
-  return (resp_buf[1] == '0') ? 0 : 1;  
+    char *payload;
+    int result = frame_request(op_code, request, len, &payload);
+    if (result == -1 || result == FRAME_STATUS_BAD_REQUEST ||
+        payload == NULL) {
+      free(payload);
+      return 1;
+    }
+    for (size_t i = first; i < next; i++) {
+      unsigned char bits = (unsigned char)payload[(i - first) / 8];
+      results[i] = (bits >> ((i - first) % 8)) & 1;
+    }
+    free(payload);
+  }
+  return 0;
+}
+
+int kvs_subscribe_many(size_t num_keys, const char *const keys[], int mode,
+                       uint32_t window_ms, int results[]) {
+  if (s_version >= PROTOCOL_VERSION_2) {
+    struct SubscribeOptions options = {.window_ms = window_ms,
+                                       .mode = (uint8_t)mode};
+    return batch_request(OP_CODE_MSUBSCRIBE, num_keys, keys, &options,
+                         results);
+  }
+  if (mode != DELIVERY_EVERY) {
+    fprintf(stderr, "The server does not take delivery modes\n");
+    return 1;
+  }
+  // Version 1 takes one key per request.
+  for (size_t i = 0; i < num_keys; i++) {
+    int result = sync_request(OP_CODE_SUBSCRIBE, keys[i], NULL);
+    if (result == -1) {
+      return 1;
+    }
+    results[i] = result == 1;
+  }
+  return 0;
 }
 
-int kvs_subscribe(char const *req_pipe_path, char const *resp_pipe_path, const char *key) {
-  // send subscribe message to request pipe and wait for response in response
-  // pipe
-  // Prepare message: OP_CODE=3 + 41-char buffer
-  char request[1 + 41] = {0};
-  request[0] = OP_CODE_SUBSCRIBE;
-  strncpy(request + 1, key, 40);
+int kvs_unsubscribe_many(size_t num_keys, const char *const keys[],
+                         int results[]) {
+  if (s_version >= PROTOCOL_VERSION_2) {
+    return batch_request(OP_CODE_MUNSUBSCRIBE, num_keys, keys, NULL,
+                         results);
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    int result = sync_request(OP_CODE_UNSUBSCRIBE, keys[i], NULL);
+    if (result == -1) {
+      return 1;
+    }
+    results[i] = result == 0;
+  }
+  return 0;
+}
 
-  int req_fd = open(req_pipe_path, O_WRONLY);
-  if (req_fd < 0) {
-    perror("Error opening request FIFO for subscribe");
+int kvs_cdc(uint64_t from_seq, uint64_t *last_seq) {
+  if (s_version < PROTOCOL_VERSION_3) {
+    fprintf(stderr, "The server does not stream its change log\n");
     return 1;
   }
-  if (write(req_fd, request, sizeof(request)) < 0) {
-    perror("Error writing subscribe request");
-    close(req_fd);
+  char request[FRAME_HEADER_SIZE + sizeof(from_seq)];
+  memcpy(request + FRAME_HEADER_SIZE, &from_seq, sizeof(from_seq));
+  char *payload = NULL;
+  int result = frame_request(OP_CODE_CDC, request, sizeof(from_seq), &payload);
+  if (result == 0 && payload != NULL && last_seq != NULL) {
+    memcpy(last_seq, payload, sizeof(*last_seq));
+  }
+  free(payload);
+  if (result == -1) {
     return 1;
   }
-  close(req_fd);
+  printf("Server returned %d for operation: cdc\n", result);
+  return (result == 0) ? 0 : 1;
+}
+
+// Requests made with the kvs_async_ calls, from kvs_async_start to
+// kvs_async_stop. Callers queue frames in s_out, and the I/O thread writes
+// them and reads the responses, with the session's descriptors made
+// non-blocking. A request holds the slot of its id until its callback ran.
+struct AsyncSlot {
+  int busy; // Sent or queued, callback not run yet.
+  int done; // Answered, or failed: queued in s_done.
+  uint32_t request_id;
+  int op_code;
+  KvsCallback callback;
+  void *arg;
+  int status;
+  char *payload;
+  size_t len;
+};
+
+static pthread_mutex_t s_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t s_io_thread;
+static int s_async_running = 0;
+static int s_async_stopping = 0;
+static int s_async_dead = 0; // The server is gone.
+static struct AsyncSlot s_slots[KVS_ASYNC_MAX_IN_FLIGHT];
+static size_t s_in_flight = 0;
+
+// Slots answered, in the order of their answers, for kvs_async_poll.
+static size_t s_done[KVS_ASYNC_MAX_IN_FLIGHT];
+static size_t s_done_first = 0;
+static size_t s_done_len = 0;
+
+// Frames queued for the I/O thread.
+static char *s_out = NULL;
+static size_t s_out_len = 0;
+static size_t s_out_cap = 0;
+
+// Readable while completions wait, for the caller. The I/O thread waits on
+// the other one for frames to be queued.
+static int s_event_fd = -1;
+static int s_wake_fd = -1;
+
+// Flags of the descriptors before they were made non-blocking.
+static int s_req_flags = 0;
+static int s_resp_flags = 0;
+
+// Responses read by the I/O thread, up to the last whole one.
+static char s_in[RING_SIZE];
+static size_t s_in_len = 0;
+
+// Adds to an eventfd's counter.
+static void signal_fd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("Failed to signal an eventfd");
+  }
+}
+
+// Queues a slot for kvs_async_poll. Called with the lock held.
+// @return 1 if the caller must be signaled, as nothing waited before.
+static int complete_slot(size_t slot, int status, char *payload,
+                         size_t len) {
+  s_slots[slot].done = 1;
+  s_slots[slot].status = status;
+  s_slots[slot].payload = payload;
+  s_slots[slot].len = len;
+  s_done[(s_done_first + s_done_len) % KVS_ASYNC_MAX_IN_FLIGHT] = slot;
+  return s_done_len++ == 0;
+}
 
-  // Read response
-  int resp_fd = open(resp_pipe_path, O_RDONLY);
-  if (resp_fd < 0) {
-    perror("Error opening response FIFO for subscribe");
+// Hands a response to the slot of its request.
+static void complete_response(const struct FrameHeader *header,
+                              const char *data) {
+  char *payload = NULL;
+  if (header->length > 0) {
+    payload = malloc(header->length + 1);
+    if (payload != NULL) {
+      memcpy(payload, data, header->length);
+      payload[header->length] = '\0';
+    }
+  }
+  size_t slot = header->request_id % KVS_ASYNC_MAX_IN_FLIGHT;
+  pthread_mutex_lock(&s_async_lock);
+  struct AsyncSlot *pending = &s_slots[slot];
+  if (!pending->busy || pending->done ||
+      pending->request_id != header->request_id) {
+    pthread_mutex_unlock(&s_async_lock);
+    fprintf(stderr, "Response to unknown request %u\n", header->request_id);
+    free(payload);
+    return;
+  }
+  int status = header->status;
+  if (header->length > 0 && payload == NULL) {
+    fprintf(stderr, "Failed to read a response\n");
+    status = -1;
+  }
+  int wake = complete_slot(slot, status, payload,
+                           payload != NULL ? header->length : 0);
+  pthread_mutex_unlock(&s_async_lock);
+  if (wake) {
+    signal_fd(s_event_fd);
+  }
+}
+
+// Fails every request not answered yet, once the server is gone.
+static void fail_requests(void) {
+  pthread_mutex_lock(&s_async_lock);
+  s_async_dead = 1;
+  int wake = 0;
+  for (size_t slot = 0; slot < KVS_ASYNC_MAX_IN_FLIGHT; slot++) {
+    if (s_slots[slot].busy && !s_slots[slot].done) {
+      wake |= complete_slot(slot, -1, NULL, 0);
+    }
+  }
+  pthread_mutex_unlock(&s_async_lock);
+  if (wake) {
+    signal_fd(s_event_fd);
+  }
+}
+
+// Writes queued frames, as many as the session takes without waiting.
+// @return Number of bytes written, or -1 if the server is gone.
+static ssize_t async_write(const char *data, size_t len) {
+  if (s_shm != NULL) {
+    size_t written = ring_write(&s_shm->requests, data, len);
+    if (ring_wake(&s_shm->requests)) {
+      ring_bell(s_server_bell);
+    }
+    return (ssize_t)written;
+  }
+  ssize_t written = write(s_req_fd, data, len);
+  if (written == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
+  return written;
+}
+
+// Reads responses, as many as there are without waiting, and completes
+// the requests they answer.
+// @return Number of bytes read, or -1 if the server is gone.
+static ssize_t async_read(void) {
+  ssize_t got;
+  if (s_shm != NULL) {
+    got = (ssize_t)ring_read(&s_shm->responses, s_in + s_in_len,
+                             sizeof(s_in) - s_in_len);
+    if (got > 0 && ring_made_room(&s_shm->responses)) {
+      ring_bell(s_server_bell);
+    }
+  } else {
+    got = read(s_resp_fd, s_in + s_in_len, sizeof(s_in) - s_in_len);
+    if (got == 0) {
+      return -1;
+    }
+    if (got == -1) {
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+  }
+  s_in_len += (size_t)got;
+
+  size_t pos = 0;
+  struct FrameHeader header;
+  while (s_in_len - pos >= sizeof(header)) {
+    memcpy(&header, s_in + pos, sizeof(header));
+    if (header.length > FRAME_MAX_PAYLOAD) {
+      fprintf(stderr, "Malformed response\n");
+      return -1;
+    }
+    if (s_in_len - pos < sizeof(header) + header.length) {
+      break;
+    }
+    complete_response(&header, s_in + pos + sizeof(header));
+    pos += sizeof(header) + header.length;
+  }
+  memmove(s_in, s_in + pos, s_in_len - pos);
+  s_in_len -= pos;
+  return got;
+}
+
+// Waits for responses, for room for the frames still to write, or for
+// more frames to be queued.
+// @param pending There are frames still to write.
+// @return 0 to go on, 1 if the server is gone.
+static int async_wait(int pending) {
+  struct pollfd pfds[3] = {{.fd = s_wake_fd, .events = POLLIN}};
+  nfds_t count = 1;
+  if (s_shm != NULL) {
+    // The doorbell is rung for responses while their ring sleeps, and for
+    // room while the requests ring waits for some. The socket only hangs
+    // up.
+    if (!ring_sleep(&s_shm->responses) ||
+        (pending && !ring_wait_room(&s_shm->requests, 1))) {
+      return 0;
+    }
+    pfds[count++] = (struct pollfd){.fd = s_client_bell, .events = POLLIN};
+    pfds[count++] = (struct pollfd){.fd = s_req_fd, .events = 0};
+  } else {
+    pfds[count++] = (struct pollfd){.fd = s_resp_fd, .events = POLLIN};
+    if (pending && s_req_fd == s_resp_fd) {
+      pfds[1].events |= POLLOUT;
+    } else if (pending) {
+      pfds[count++] = (struct pollfd){.fd = s_req_fd, .events = POLLOUT};
+    }
+  }
+
+  if (poll(pfds, count, -1) == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    perror("Failed to wait for the server");
     return 1;
   }
-  char resp_buf[3] = {0};
-  if (read(resp_fd, resp_buf, sizeof(resp_buf)) < 0) {
-      perror("read resp_pipe_path");
-      close(resp_fd);
-      return 1;
+  if (pfds[0].revents & POLLIN) {
+    uint64_t wakes;
+    if (read(s_wake_fd, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN) {
+      perror("Failed to read an eventfd");
+    }
+  }
+  if (s_shm != NULL) {
+    // A doorbell left over from an earlier wake only costs a lap.
+    if (pfds[1].revents != 0) {
+      ring_clear_bell(s_client_bell);
+    }
+    // Responses written before the server left are still read.
+    if (pfds[2].revents != 0) {
+      return ring_sleep(&s_shm->responses) ? 1 : 0;
+    }
   }
-  
-  close(resp_fd);
+  return 0;
+}
 
+// Writes the frames queued and reads the responses, until kvs_async_stop
+// or until the server is gone.
+static void *io_thread(void *arg) {
+  (void)arg;
+  char *out = NULL;
+  size_t out_len = 0;
+  size_t out_pos = 0;
+  size_t out_cap = 0;
+  while (1) {
+    pthread_mutex_lock(&s_async_lock);
+    if (s_async_stopping) {
+      pthread_mutex_unlock(&s_async_lock);
+      break;
+    }
+    // Frames queued meanwhile are taken all at once, once the last ones
+    // are written.
+    if (out_pos == out_len && s_out_len > 0) {
+      char *taken = s_out;
+      size_t taken_cap = s_out_cap;
+      s_out = out;
+      s_out_cap = out_cap;
+      out = taken;
+      out_cap = taken_cap;
+      out_len = s_out_len;
+      out_pos = 0;
+      s_out_len = 0;
+    }
+    pthread_mutex_unlock(&s_async_lock);
 
+    ssize_t written = 0;
+    if (out_pos < out_len) {
+      written = async_write(out + out_pos, out_len - out_pos);
+      if (written == -1) {
+        fprintf(stderr, "Server closed the connection\n");
+        break;
+      }
+      out_pos += (size_t)written;
+    }
+    ssize_t got = async_read();
+    if (got == -1) {
+      fprintf(stderr, "Server closed the connection\n");
+      break;
+    }
+    if (written == 0 && got == 0 && async_wait(out_pos < out_len) != 0) {
+      fprintf(stderr, "Server closed the connection\n");
+      break;
+    }
+  }
+  free(out);
+  fail_requests();
+  return NULL;
+}
 
-  printf("Server returned %c for operation: subscribe\n", resp_buf[1]);
-  return (resp_buf[1] == '0') ? 0 : 1;
+// Queues a frame whose payload is already in place for the I/O thread.
+// @param request Frame, with room for its header before the payload.
+// @param len Length of the payload.
+// @return 0 if it was queued, 1 otherwise.
+static int async_submit(char op_code, char *request, size_t len,
+                        KvsCallback callback, void *arg) {
+  pthread_mutex_lock(&s_async_lock);
+  size_t slot = s_next_id % KVS_ASYNC_MAX_IN_FLIGHT;
+  if (!s_async_running || s_async_dead || s_slots[slot].busy) {
+    pthread_mutex_unlock(&s_async_lock);
+    return 1;
+  }
+  size_t size = FRAME_HEADER_SIZE + len;
+  if (s_out_len + size > s_out_cap) {
+    size_t cap = s_out_cap > 0 ? 2 * s_out_cap : RING_SIZE;
+    while (cap < s_out_len + size) {
+      cap *= 2;
+    }
+    char *grown = realloc(s_out, cap);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&s_async_lock);
+      return 1;
+    }
+    s_out = grown;
+    s_out_cap = cap;
+  }
 
+  struct FrameHeader header = {
+      .length = (uint32_t)len,
+      .request_id = s_next_id++,
+      .opcode = (uint8_t)op_code,
+  };
+  memcpy(request, &header, sizeof(header));
+  memcpy(s_out + s_out_len, request, size);
+  int wake = s_out_len == 0;
+  s_out_len += size;
+  s_slots[slot] = (struct AsyncSlot){
+      .busy = 1,
+      .request_id = header.request_id,
+      .op_code = op_code,
+      .callback = callback,
+      .arg = arg,
+  };
+  s_in_flight++;
+  pthread_mutex_unlock(&s_async_lock);
+  if (wake) {
+    signal_fd(s_wake_fd);
+  }
+  return 0;
 }
 
-int kvs_unsubscribe(char const *req_pipe_path, char const *resp_pipe_path, const char *key) {
-  // send unsubscribe message to request pipe and wait for response in response
-  // pipe
-  // Prepare message: OP_CODE=4 + 41-char buffer
-  char request[1 + 41] = {0};
-  request[0] = OP_CODE_UNSUBSCRIBE;
-  strncpy(request + 1, key, 40);
+// Makes a descriptor non-blocking.
+// @param flags Set to its flags before.
+// @return 0 on success, 1 otherwise.
+static int set_nonblocking(int fd, int *flags) {
+  *flags = fcntl(fd, F_GETFL);
+  return *flags == -1 || fcntl(fd, F_SETFL, *flags | O_NONBLOCK) == -1;
+}
 
-  int req_fd = open(req_pipe_path, O_WRONLY);
-  if (req_fd < 0) {
-    perror("Error opening request FIFO for unsubscribe");
+int kvs_async_start(int *event_fd) {
+  if (s_version < PROTOCOL_VERSION_2) {
+    fprintf(stderr, "The server does not pipeline requests\n");
     return 1;
   }
-  if (write(req_fd, request, sizeof(request)) < 0) {
-    perror("Error writing unsubscribe request");
-    close(req_fd);
+  if (s_async_running) {
+    *event_fd = s_event_fd;
+    return 0;
+  }
+  s_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  s_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (s_event_fd == -1 || s_wake_fd == -1) {
+    perror("Failed to create eventfd");
+    close(s_event_fd);
+    close(s_wake_fd);
+    s_event_fd = s_wake_fd = -1;
+    return 1;
+  }
+  // A shared-memory session only waits on its doorbells, which never
+  // block.
+  if (s_shm == NULL &&
+      (set_nonblocking(s_resp_fd, &s_resp_flags) ||
+       (s_req_fd != s_resp_fd && set_nonblocking(s_req_fd, &s_req_flags)))) {
+    perror("Error setting the session non-blocking");
+    fcntl(s_resp_fd, F_SETFL, s_resp_flags);
+    close(s_event_fd);
+    close(s_wake_fd);
+    s_event_fd = s_wake_fd = -1;
     return 1;
   }
-  close(req_fd);
 
-  // Read response
-  int resp_fd = open(resp_pipe_path, O_RDONLY);
-  if (resp_fd < 0) {
-    perror("Error opening response FIFO for unsubscribe");
+  s_async_stopping = 0;
+  s_async_dead = 0;
+  s_async_running = 1;
+  s_in_len = 0;
+  if (pthread_create(&s_io_thread, NULL, io_thread, NULL) != 0) {
+    perror("Failed to create the I/O thread");
+    s_async_running = 0;
+    kvs_async_stop();
     return 1;
   }
-  char resp_buf[3] = {0};
-  if (read(resp_fd, resp_buf, sizeof(resp_buf)) < 0) {
-      perror("read resp_pipe_path");
-      close(resp_fd);
-      return 1;
+  *event_fd = s_event_fd;
+  return 0;
+}
+
+int kvs_async_poll(int timeout_ms) {
+  if (!s_async_running) {
+    return -1;
+  }
+  if (timeout_ms != 0) {
+    struct pollfd pfd = {.fd = s_event_fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR) {
+      perror("Failed to wait for completions");
+      return -1;
+    }
+  }
+  // Read before the queue is looked at: completions queued after are
+  // signaled again.
+  uint64_t signals;
+  if (read(s_event_fd, &signals, sizeof(signals)) == -1 && errno != EAGAIN) {
+    perror("Failed to read an eventfd");
+    return -1;
   }
 
-  close(resp_fd);
+  int count = 0;
+  pthread_mutex_lock(&s_async_lock);
+  while (s_done_len > 0) {
+    struct AsyncSlot *slot = &s_slots[s_done[s_done_first]];
+    s_done_first = (s_done_first + 1) % KVS_ASYNC_MAX_IN_FLIGHT;
+    s_done_len--;
+    struct KvsCompletion completion = {
+        .request_id = slot->request_id,
+        .op_code = slot->op_code,
+        .status = slot->status,
+        .payload = slot->payload,
+        .len = slot->len,
+    };
+    KvsCallback callback = slot->callback;
+    void *arg = slot->arg;
+    slot->busy = 0;
+    slot->done = 0;
+    slot->payload = NULL;
+    s_in_flight--;
+    // The callback may make more requests.
+    pthread_mutex_unlock(&s_async_lock);
+    if (callback != NULL) {
+      callback(&completion, arg);
+    }
+    free((char *)completion.payload);
+    count++;
+    pthread_mutex_lock(&s_async_lock);
+  }
+  pthread_mutex_unlock(&s_async_lock);
+  return count;
+}
+
+int kvs_async_stop(void) {
+  if (s_event_fd == -1) {
+    return 0;
+  }
+  pthread_mutex_lock(&s_async_lock);
+  while (s_async_running && s_in_flight > 0) {
+    pthread_mutex_unlock(&s_async_lock);
+    if (kvs_async_poll(-1) == -1) {
+      pthread_mutex_lock(&s_async_lock);
+      break;
+    }
+    pthread_mutex_lock(&s_async_lock);
+  }
+  int joined = s_async_running;
+  s_async_stopping = 1;
+  int dead = s_async_dead;
+  pthread_mutex_unlock(&s_async_lock);
+  if (joined) {
+    signal_fd(s_wake_fd);
+    pthread_join(s_io_thread, NULL);
+  }
 
-  printf("Server returned %c for operation: unsubscribe\n", resp_buf[1]);
-  return (resp_buf[1] == '0') ? 0 : 1;
+  if (s_shm == NULL) {
+    fcntl(s_resp_fd, F_SETFL, s_resp_flags);
+    if (s_req_fd != s_resp_fd) {
+      fcntl(s_req_fd, F_SETFL, s_req_flags);
+    }
+  }
+  close(s_event_fd);
+  close(s_wake_fd);
+  s_event_fd = s_wake_fd = -1;
+  free(s_out);
+  s_out = NULL;
+  s_out_len = s_out_cap = 0;
+  s_done_first = s_done_len = 0;
+  s_in_flight = 0;
+  s_async_running = 0;
+  return dead ? 1 : 0;
+}
 
-}
\ No newline at end of file
+int kvs_async_mget(size_t num_keys, const char *const keys[],
+                   KvsCallback callback, void *arg) {
+  char request[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  size_t len;
+  if (encode_data(num_keys, keys, NULL, request + FRAME_HEADER_SIZE,
+                  &len) != 0) {
+    return 1;
+  }
+  return async_submit(OP_CODE_MGET, request, len, callback, arg);
+}
+
+int kvs_async_put(size_t num_pairs, const char *const keys[],
+                  const char *const values[], KvsCallback callback,
+                  void *arg) {
+  char request[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  size_t len;
+  if (encode_data(num_pairs, keys, values, request + FRAME_HEADER_SIZE,
+                  &len) != 0) {
+    return 1;
+  }
+  return async_submit(OP_CODE_PUT, request, len, callback, arg);
+}
+
+int kvs_async_del(size_t num_keys, const char *const keys[],
+                  KvsCallback callback, void *arg) {
+  char request[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  size_t len;
+  if (encode_data(num_keys, keys, NULL, request + FRAME_HEADER_SIZE,
+                  &len) != 0) {
+    return 1;
+  }
+  return async_submit(OP_CODE_DEL, request, len, callback, arg);
+}
+
+int kvs_async_subscribe(const char *key, int mode, uint32_t window_ms,
+                        KvsCallback callback, void *arg) {
+  char request[FRAME_HEADER_SIZE + MAX_STRING_SIZE + 1 +
+               sizeof(struct SubscribeOptions)];
+  struct SubscribeOptions options = {.window_ms = window_ms,
+                                     .mode = (uint8_t)mode};
+  size_t len = encode_key(request + FRAME_HEADER_SIZE, key, &options);
+  return async_submit(OP_CODE_SUBSCRIBE, request, len, callback, arg);
+}
+
+int kvs_async_unsubscribe(const char *key, KvsCallback callback,
+                          void *arg) {
+  char request[FRAME_HEADER_SIZE + MAX_STRING_SIZE];
+  size_t len = encode_key(request + FRAME_HEADER_SIZE, key, NULL);
+  return async_submit(OP_CODE_UNSUBSCRIBE, request, len, callback, arg);
+}
+
+// Takes the whole notifications at the start of the buffer.
+// @return Number of notifications taken, or -1 if the buffer holds
+// something else.
+static int take_notifications(struct KvsNotification notifications[],
+                              size_t max) {
+  size_t pos = 0;
+  size_t count = 0;
+  while (count < max) {
+    struct KvsNotification *notification = &notifications[count];
+    if (!s_notif_framed) {
+      if (s_notif_len - pos < 2 * (MAX_STRING_SIZE + 1)) {
+        break;
+      }
+      // Key and value, each space-padded and NUL-terminated.
+      memcpy(notification->key, s_notif_buf + pos, MAX_STRING_SIZE + 1);
+      memcpy(notification->value, s_notif_buf + pos + MAX_STRING_SIZE + 1,
+             MAX_STRING_SIZE + 1);
+      notification->key[MAX_STRING_SIZE] = '\0';
+      notification->value[MAX_STRING_SIZE] = '\0';
+      char *space = strchr(notification->key, ' ');
+      if (space != NULL) {
+        *space = '\0';
+      }
+      space = strchr(notification->value, ' ');
+      if (space != NULL) {
+        *space = '\0';
+      }
+      notification->seq = 0;
+      notification->streamed = 0;
+      pos += 2 * (MAX_STRING_SIZE + 1);
+    } else {
+      struct NotificationHeader header;
+      if (s_notif_len - pos < sizeof(header)) {
+        break;
+      }
+      memcpy(&header, s_notif_buf + pos, sizeof(header));
+      if (header.key_len > MAX_STRING_SIZE ||
+          header.value_len > MAX_STRING_SIZE) {
+        fprintf(stderr, "Malformed notification\n");
+        return -1;
+      }
+      size_t size = sizeof(header) + header.key_len + header.value_len;
+      if (s_notif_len - pos < size) {
+        break;
+      }
+      memcpy(notification->key, s_notif_buf + pos + sizeof(header),
+             header.key_len);
+      notification->key[header.key_len] = '\0';
+      memcpy(notification->value,
+             s_notif_buf + pos + sizeof(header) + header.key_len,
+             header.value_len);
+      notification->value[header.value_len] = '\0';
+      notification->seq = header.seq;
+      notification->streamed = (header.flags & NOTIFICATION_FLAG_STREAM) != 0;
+      pos += size;
+    }
+    count++;
+  }
+  memmove(s_notif_buf, s_notif_buf + pos, s_notif_len - pos);
+  s_notif_len -= pos;
+  return (int)count;
+}
+
+int kvs_read_notifications(int notif_pipe,
+                           struct KvsNotification notifications[],
+                           size_t max) {
+  // Once the server closed the pipe, what it wrote before is still read.
+  int gone = 0;
+  while (1) {
+    int count = take_notifications(notifications, max);
+    if (count != 0) {
+      return count;
+    }
+    if (s_notif_shm != NULL) {
+      struct Ring *ring = &s_notif_shm->notifications;
+      size_t got = ring_read(ring, s_notif_buf + s_notif_len,
+                             sizeof(s_notif_buf) - s_notif_len);
+      s_notif_len += got;
+      if (got > 0 && ring_made_room(ring)) {
+        ring_bell(s_room_bell);
+      }
+      if (got > 0 || !ring_sleep(ring)) {
+        continue;
+      }
+      if (gone) {
+        close_notifications();
+        return 0;
+      }
+      int rung = ring_wait_bell(s_notify_bell, notif_pipe);
+      if (rung == -1) {
+        return -1;
+      }
+      gone = rung == 0;
+      continue;
+    }
+    ssize_t got = read(notif_pipe, s_notif_buf + s_notif_len,
+                       sizeof(s_notif_buf) - s_notif_len);
+    if (got == 0) {
+      return 0;
+    }
+    if (got == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to read notifications");
+      return -1;
+    }
+    s_notif_len += (size_t)got;
+  }
+}
@@ -2,32 +2,306 @@
 #define CLIENT_API_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "../common/constants.h"
+#include "../common/protocol.h"
 
-/// Connects to a kvs server.
+/// Connects to a kvs server. The session's FIFOs are opened here and stay
+/// open until kvs_disconnect, so requests do not reopen them. The session
+/// speaks the highest protocol version both ends know. If the server path
+/// is a Unix socket the session runs over a connection to it instead, and
+/// the three FIFO paths are not used.
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
-/// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @param server_pipe_path Path to the name pipe, or Unix socket, where the
+/// server is listening.
+/// @param notif_pipe_path Path to the name pipe to be created for
+/// notifications.
+/// @param notif_pipe Set to the notification pipe, open for reading. It is
+/// owned by the caller, who closes it once done reading: the server closes
+/// its end when the session ends.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
-                char const *server_pipe_path, char const *notif_pipe_path);//, int *notif_pipe);
+                char const *server_pipe_path, char const *notif_pipe_path,
+                int *notif_pipe);
+
+/// A notification, as kvs_read_notifications hands it out.
+struct KvsNotification {
+  uint64_t seq; // Number of the change among all the server made, in
+                // version 3. 0 for older servers.
+  char key[MAX_STRING_SIZE + 1];
+  char value[MAX_STRING_SIZE + 1]; // "DELETED" once the key is deleted.
+  int streamed; // 1 if it comes from the change log kvs_cdc streams, 0 if
+                // from a subscription.
+};
+
+/// Reads the notifications on a session's notification pipe, as many as
+/// are whole after one read of it, whichever format the session gets
+/// them in. A session in shared memory gets them in a ring instead, and
+/// its pipe only tells once the server is done. Only one thread may call
+/// it.
+/// @param notif_pipe Notification pipe kvs_connect handed out.
+/// @param notifications Set to the notifications read.
+/// @param max Most notifications to hand out. The rest wait for the next
+/// call, which then does not block.
+/// @return Number of notifications read, 0 once the server closed the
+/// pipe, or -1 on error.
+int kvs_read_notifications(int notif_pipe,
+                           struct KvsNotification notifications[],
+                           size_t max);
+
 /// Disconnects from an KVS server.
 /// @return 0 in case of success, 1 otherwise.
-int kvs_disconnect(char const *req_pipe_path, char const *resp_pipe_path);
+int kvs_disconnect(void);
 
 /// Requests a subscription for a key
 /// @param key Key to be subscribed
 /// @return 1 if the key was subscribed successfully (key existing), 0
 /// otherwise.
+int kvs_subscribe(const char *key);
 
-int kvs_subscribe(const char *req_pipe_path, const char *resp_pipe_path, const char *key);
+/// Requests a subscription for a key, with a delivery mode. Needs protocol
+/// version 2.
+/// @param key Key to be subscribed.
+/// @param mode DELIVERY_EVERY for every change, DELIVERY_LATEST for the
+/// latest value only, or DELIVERY_DEBOUNCE for the latest value once
+/// window_ms went by since the first change not sent yet.
+/// @param window_ms Debounce window, 1 to DELIVERY_MAX_WINDOW_MS for
+/// DELIVERY_DEBOUNCE, 0 otherwise.
+/// @return 1 if the key was subscribed successfully (key existing), 0
+/// otherwise.
+int kvs_subscribe_mode(const char *key, int mode, uint32_t window_ms);
 
 /// Remove a subscription for a key
 /// @param key Key to be unsubscribed
 /// @return 0 if the key was unsubscribed successfully  (subscription existed
 /// and was removed), 1 otherwise.
+int kvs_unsubscribe(const char *key);
+
+/// Requests a subscription for a pattern: '*' in it stands for any run of
+/// characters, and '?' for any one character. Keys created later are
+/// covered too, and notifications name the key that changed. Needs
+/// protocol version 2.
+/// @param pattern Pattern to be subscribed, such as "user:*".
+/// @param mode Delivery mode, as kvs_subscribe_mode takes it.
+/// @param window_ms Debounce window, as kvs_subscribe_mode takes it.
+/// @return 1 if the pattern was subscribed successfully (not subscribed
+/// yet), 0 otherwise.
+int kvs_psubscribe(const char *pattern, int mode, uint32_t window_ms);
+
+/// Remove a subscription for a pattern. Needs protocol version 2.
+/// @param pattern Pattern to be unsubscribed.
+/// @return 0 if the pattern was unsubscribed successfully (subscription
+/// existed and was removed), 1 otherwise.
+int kvs_punsubscribe(const char *pattern);
+
+/// Streams the server's change log to the notification pipe, from a change
+/// on: every change the server made since, subscribed to or not, then every
+/// change it makes after, each with its sequence number. Changes the server
+/// no longer keeps are skipped, which shows as a gap in the numbers. After
+/// reconnecting, passing the number after the last one read resumes the
+/// stream. Its notifications are marked streamed: a key also subscribed to
+/// is notified of twice, once by each. Needs protocol version 3.
+/// @param from_seq Sequence number of the first change, 0 for the oldest
+/// one kept.
+/// @param last_seq If not NULL, set to the sequence number of the latest
+/// change the server made so far.
+/// @return 0 if the change log is streamed, 1 otherwise.
+int kvs_cdc(uint64_t from_seq, uint64_t *last_seq);
+
+/// Subscribes to keys with as few requests as possible: in version 2, up to
+/// DATA_MAX_KEYS keys go in each, and the server subscribes to all of them
+/// at once. Version 1 sends a request per key, and only takes
+/// DELIVERY_EVERY. Keys are as kvs_mget takes them.
+/// @param num_keys Number of keys.
+/// @param keys Keys to be subscribed.
+/// @param mode Delivery mode, as kvs_subscribe_mode takes it.
+/// @param window_ms Debounce window, as kvs_subscribe_mode takes it.
+/// @param results Set to 1 for each key subscribed (key existing, and not
+/// subscribed yet), 0 otherwise.
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_subscribe_many(size_t num_keys, const char *const keys[], int mode,
+                       uint32_t window_ms, int results[]);
+
+/// Removes subscriptions for keys with as few requests as possible. See
+/// kvs_subscribe_many.
+/// @param num_keys Number of keys.
+/// @param keys Keys to be unsubscribed.
+/// @param results Set to 1 for each subscription that existed and was
+/// removed, 0 otherwise.
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_unsubscribe_many(size_t num_keys, const char *const keys[],
+                         int results[]);
+
+/// Sends a subscription request without waiting for its response, which
+/// kvs_wait_response collects. Requests sent this way may be served, and
+/// answered, in any order. The synchronous calls above must not be made
+/// while responses are still outstanding. Needs protocol version 2.
+/// @param key Key to be subscribed.
+/// @param request_id Set to the id the response will carry.
+/// @return 0 if the request was sent, 1 otherwise.
+int kvs_subscribe_async(const char *key, uint32_t *request_id);
+
+/// Sends an unsubscription request without waiting for its response. See
+/// kvs_subscribe_async.
+/// @param key Key to be unsubscribed.
+/// @param request_id Set to the id the response will carry.
+/// @return 0 if the request was sent, 1 otherwise.
+int kvs_unsubscribe_async(const char *key, uint32_t *request_id);
+
+/// Waits for the next response to a request sent with one of the _async
+/// calls.
+/// @param request_id Set to the id of the request answered.
+/// @param op_code Set to the opcode of the request answered.
+/// @param result Set to the result, as the synchronous call would get it:
+/// 1 for a subscribed key, 0 for a removed subscription.
+/// @return 0 if a response was read, 1 if the server is gone.
+int kvs_wait_response(uint32_t *request_id, int *op_code, int *result);
+
+/// Reads keys in one round trip. The data calls need protocol version 2,
+/// and must not be made while responses to _async calls are outstanding.
+/// Keys and values are 1 to DATA_STRING_MAX characters, none of " ,()[]",
+/// and keys start with a letter or a digit.
+/// @param num_keys Number of keys, at most DATA_MAX_KEYS.
+/// @param keys Keys to read.
+/// @param values Set to the value of each key, or "" if it does not exist.
+/// @param found Set to 1 for each key that exists, 0 otherwise.
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_mget(size_t num_keys, const char *const keys[],
+             char values[][MAX_STRING_SIZE], int found[]);
+
+/// Reads a key. See kvs_mget.
+/// @param key Key to read.
+/// @param value Set to the value of the key, or "" if it does not exist.
+/// @param found Set to 1 if the key exists, 0 otherwise.
+/// @return 0 if the key was read, 1 otherwise.
+int kvs_get(const char *key, char value[MAX_STRING_SIZE], int *found);
+
+/// Parses the payload of a response to MGET or GET, as kvs_mget does.
+/// @param payload Payload of the response, terminated with '\0'.
+/// @param num_keys Number of keys read.
+/// @param keys Keys read, in the order of the request.
+/// @param values Set to the value of each key, or "" if it does not exist.
+/// @param found Set to 1 for each key that exists, 0 otherwise.
+/// @return 0 if the payload has every key, 1 otherwise.
+int kvs_parse_values(const char *payload, size_t num_keys,
+                     const char *const keys[],
+                     char values[][MAX_STRING_SIZE], int found[]);
+
+/// Writes pairs in one round trip, as a job's WRITE does. See kvs_mget.
+/// @param num_pairs Number of pairs, at most DATA_MAX_KEYS.
+/// @param keys Keys to write.
+/// @param values Value of each key.
+/// @return 0 if the pairs were written, 1 otherwise.
+int kvs_put(size_t num_pairs, const char *const keys[],
+            const char *const values[]);
+
+/// Deletes keys in one round trip, as a job's DELETE does. See kvs_mget.
+/// @param num_keys Number of keys, at most DATA_MAX_KEYS.
+/// @param keys Keys to delete.
+/// @param num_missing Set to the number of keys that did not exist.
+/// @return 0 if the keys were deleted, 1 otherwise.
+int kvs_del(size_t num_keys, const char *const keys[], size_t *num_missing);
+
+// Most requests made with the kvs_async_ calls whose callback did not run
+// yet.
+#define KVS_ASYNC_MAX_IN_FLIGHT 1024
+
+/// How a request made with one of the kvs_async_ calls went.
+struct KvsCompletion {
+  uint32_t request_id;
+  int op_code;
+  int status; // Sent by the server, as protocol.h says for the opcode, or
+              // -1 if the server went away before answering.
+  const char *payload; // Terminated with '\0', NULL if there is none. Only
+                       // valid during the callback.
+  size_t len;
+};
+
+/// Called by kvs_async_poll for each request answered.
+typedef void (*KvsCallback)(const struct KvsCompletion *completion,
+                            void *arg);
+
+/// Hands the session to an I/O thread, which sends the requests made with
+/// the kvs_async_ calls as they come, many in one write, and reads their
+/// responses, many in one read. Callers never wait for the server: the
+/// calls only queue a request, and kvs_async_poll runs the callbacks of
+/// those answered. No other call may be made on the session until
+/// kvs_async_stop, but for kvs_read_notifications and kvs_disconnect, which
+/// stops it first. Needs protocol version 2.
+/// @param event_fd Set to an eventfd, readable while callbacks wait to run,
+/// for the caller's own event loop. It is closed by kvs_async_stop.
+/// @return 0 if the I/O thread was started, or was already, 1 otherwise.
+int kvs_async_start(int *event_fd);
+
+/// Runs the callbacks of the requests answered, in the order of their
+/// responses, in the calling thread. Callbacks may make more requests, but
+/// must not call kvs_async_poll or kvs_async_stop. Only one thread may
+/// call it.
+/// @param timeout_ms How long to wait for a response if none is there: 0
+/// not to wait, -1 to wait for one.
+/// @return Number of callbacks run, or -1 if the I/O thread is not running
+/// or waiting failed.
+int kvs_async_poll(int timeout_ms);
+
+/// Waits for every request made to be answered, running its callback, then
+/// stops the I/O thread. The synchronous calls may be made again after.
+/// @return 0 on success, 1 if the server went away meanwhile.
+int kvs_async_stop(void);
+
+/// Reads keys, as kvs_mget does, without waiting for the response. Its
+/// payload is parsed with kvs_parse_values.
+/// @param num_keys Number of keys, at most DATA_MAX_KEYS.
+/// @param keys Keys to read. Only used during the call.
+/// @param callback Called with the response, or NULL.
+/// @param arg Passed to the callback.
+/// @return 0 if the request was queued, 1 if the keys do not fit a request,
+/// the server is gone, or too many requests are in flight: their callbacks
+/// must run first.
+int kvs_async_mget(size_t num_keys, const char *const keys[],
+                   KvsCallback callback, void *arg);
+
+/// Writes pairs, as kvs_put does, without waiting for the response. See
+/// kvs_async_mget.
+/// @param num_pairs Number of pairs, at most DATA_MAX_KEYS.
+/// @param keys Keys to write.
+/// @param values Value of each key.
+/// @param callback Called with the response, or NULL.
+/// @param arg Passed to the callback.
+/// @return 0 if the request was queued, 1 otherwise.
+int kvs_async_put(size_t num_pairs, const char *const keys[],
+                  const char *const values[], KvsCallback callback,
+                  void *arg);
+
+/// Deletes keys, as kvs_del does, without waiting for the response. The
+/// payload lists the missing keys. See kvs_async_mget.
+/// @param num_keys Number of keys, at most DATA_MAX_KEYS.
+/// @param keys Keys to delete.
+/// @param callback Called with the response, or NULL.
+/// @param arg Passed to the callback.
+/// @return 0 if the request was queued, 1 otherwise.
+int kvs_async_del(size_t num_keys, const char *const keys[],
+                  KvsCallback callback, void *arg);
+
+/// Subscribes to a key, as kvs_subscribe_mode does, without waiting for
+/// the response. Its status is 1 if the key was subscribed. See
+/// kvs_async_mget.
+/// @param key Key to be subscribed.
+/// @param mode Delivery mode, as kvs_subscribe_mode takes it.
+/// @param window_ms Debounce window, as kvs_subscribe_mode takes it.
+/// @param callback Called with the response, or NULL.
+/// @param arg Passed to the callback.
+/// @return 0 if the request was queued, 1 otherwise.
+int kvs_async_subscribe(const char *key, int mode, uint32_t window_ms,
+                        KvsCallback callback, void *arg);
 
-int kvs_unsubscribe(const char *req_pipe_path, const char *resp_pipe_path, const char *key);
+/// Removes a subscription, without waiting for the response. Its status is
+/// 0 if the subscription existed. See kvs_async_mget.
+/// @param key Key to be unsubscribed.
+/// @param callback Called with the response, or NULL.
+/// @param arg Passed to the callback.
+/// @return 0 if the request was queued, 1 otherwise.
+int kvs_async_unsubscribe(const char *key, KvsCallback callback, void *arg);
 
 #endif // CLIENT_API_H
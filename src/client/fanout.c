@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "../common/io.h"
+#include "../common/protocol.h"
+
+// Measures how fast the server fans a change out to its subscribers: a
+// session puts one key over and over while every other session, all
+// subscribed to it, drains its notification pipe.
+
+#define FANOUT_KEY "fanout"
+#define FANOUT_DEFAULT_PUTS 1000
+#define FANOUT_DELIVERY_TIMEOUT_S 30
+
+static const size_t default_subscribers[] = {1, 100, 1000};
+
+static int epoll_fd = -1;
+static atomic_size_t received_bytes;
+static atomic_int stopping;
+// Every put changes the value: one that does not would notify no one.
+static size_t next_value;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s <server_socket> [puts] [subscribers...]\n"
+          "Puts a key <puts> times (default %d) with 1, 100 and 1000 "
+          "subscribers to it, or the counts given in increasing order.\n",
+          name, FANOUT_DEFAULT_PUTS);
+}
+
+// Drains the notification pipes of the subscribers, counting the bytes
+// read, until the run is over.
+static void *drain(void *arg) {
+  (void)arg;
+  struct epoll_event events[256];
+  char buf[1 << 16];
+  while (!atomic_load(&stopping)) {
+    int n = epoll_wait(epoll_fd, events, 256, 50);
+    for (int i = 0; i < n; i++) {
+      ssize_t got;
+      while ((got = read(events[i].data.fd, buf, sizeof(buf))) > 0) {
+        atomic_fetch_add(&received_bytes, (size_t)got);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Opens a version 3 session on the server socket, subscribes it to the key
+// and has its notification pipe drained. The session is left open until
+// the program exits.
+// @return 0 on success, 1 otherwise.
+static int add_subscriber(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Error connecting to server socket");
+    return 1;
+  }
+
+  char request[SOCKET_CONNECT_SIZE] = {OP_CODE_CONNECT,
+                                       (char)PROTOCOL_VERSION_3};
+  if (write_all(fd, request, sizeof(request)) != 1) {
+    perror("Error writing to server socket");
+    return 1;
+  }
+
+  // The notification pipe comes with the first byte of the reply.
+  char reply[3] = {0};
+  struct iovec iov = {.iov_base = reply, .iov_len = sizeof(reply)};
+  int notif_fd = -1;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(fd, &msg, 0);
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&notif_fd, CMSG_DATA(cmsg), sizeof(notif_fd));
+  }
+  if (n <= 0 || notif_fd == -1 ||
+      (n < (ssize_t)sizeof(reply) &&
+       read_all(fd, reply + n, sizeof(reply) - (size_t)n, NULL) != 1) ||
+      reply[1] != '0') {
+    fprintf(stderr, "Server refused the session\n");
+    return 1;
+  }
+
+  char frame[sizeof(struct FrameHeader) + sizeof(FANOUT_KEY) - 1];
+  struct FrameHeader header = {
+      .length = sizeof(FANOUT_KEY) - 1,
+      .request_id = 1,
+      .opcode = OP_CODE_SUBSCRIBE,
+  };
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), FANOUT_KEY, sizeof(FANOUT_KEY) - 1);
+  if (write_all(fd, frame, sizeof(frame)) != 1 ||
+      read_all(fd, &header, sizeof(header), NULL) != 1 || header.status != 1) {
+    fprintf(stderr, "Failed to subscribe to %s\n", FANOUT_KEY);
+    return 1;
+  }
+
+  if (fcntl(notif_fd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Failed to make notification pipe non-blocking");
+    return 1;
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = notif_fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notif_fd, &event) == -1) {
+    perror("Failed to watch notification pipe");
+    return 1;
+  }
+  return 0;
+}
+
+// Puts the key as many times as asked and waits for every subscriber to
+// be notified of every put, then prints the put latency and the rate the
+// notifications came at.
+// @return 0 on success, 1 if a put failed or notifications went missing.
+static int run(size_t subscribers, size_t puts) {
+  char value[MAX_STRING_SIZE];
+  const char *keys[1] = {FANOUT_KEY};
+  const char *values[1] = {value};
+  // Values all have the same length, so every notification the same size.
+  size_t size = sizeof(struct NotificationHeader) + sizeof(FANOUT_KEY) - 1 + 8;
+  size_t expected = atomic_load(&received_bytes) + subscribers * puts * size;
+
+  double start = now();
+  for (size_t i = 0; i < puts; i++) {
+    snprintf(value, sizeof(value), "%08zu", next_value++ % 100000000);
+    if (kvs_put(1, keys, values) != 0) {
+      fprintf(stderr, "Failed to put %s\n", FANOUT_KEY);
+      return 1;
+    }
+  }
+  double put_time = now() - start;
+
+  while (atomic_load(&received_bytes) < expected &&
+         now() - start < FANOUT_DELIVERY_TIMEOUT_S) {
+    nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+  }
+  double delivery_time = now() - start;
+  size_t received = subscribers * puts -
+                    (expected - atomic_load(&received_bytes)) / size;
+
+  printf("%5zu subscribers: put %8.1f us, %zu/%zu notifications in %.3f s "
+         "(%.0f/s)\n",
+         subscribers, put_time / (double)puts * 1e6, received,
+         subscribers * puts, delivery_time,
+         (double)received / delivery_time);
+  fflush(stdout);
+  return received == subscribers * puts ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *socket_path = argv[1];
+  if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+
+  size_t puts = FANOUT_DEFAULT_PUTS;
+  if (argc > 2 && sscanf(argv[2], "%zu", &puts) != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  size_t counts[64];
+  size_t num_counts = 0;
+  for (int i = 3; i < argc && num_counts < 64; i++) {
+    if (sscanf(argv[i], "%zu", &counts[num_counts++]) != 1) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (num_counts == 0) {
+    num_counts = sizeof(default_subscribers) / sizeof(default_subscribers[0]);
+    memcpy(counts, default_subscribers, sizeof(default_subscribers));
+  }
+
+  // Every subscriber holds a socket and a pipe open.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    return 1;
+  }
+
+  int notif_fd;
+  if (kvs_connect("", "", socket_path, "", &notif_fd) != 0) {
+    fprintf(stderr, "Failed to connect to the server\n");
+    return 1;
+  }
+
+  // Only keys that exist can be subscribed to.
+  const char *keys[1] = {FANOUT_KEY};
+  const char *values[1] = {"none"};
+  if (kvs_put(1, keys, values) != 0) {
+    fprintf(stderr, "Failed to put %s\n", FANOUT_KEY);
+    return 1;
+  }
+
+  pthread_t drainer;
+  if (pthread_create(&drainer, NULL, drain, NULL) != 0) {
+    fprintf(stderr, "Failed to create drain thread\n");
+    return 1;
+  }
+
+  // Subscribers are added to those of the previous run.
+  int result = 0;
+  size_t subscribers = 0;
+  for (size_t i = 0; i < num_counts && result == 0; i++) {
+    while (subscribers < counts[i] && result == 0) {
+      result = add_subscriber(socket_path);
+      subscribers++;
+    }
+    if (result == 0) {
+      result = run(subscribers, puts);
+    }
+  }
+
+  atomic_store(&stopping, 1);
+  pthread_join(drainer, NULL);
+  kvs_disconnect();
+  close(notif_fd);
+  return result;
+}
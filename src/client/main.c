@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,40 +11,20 @@
 #include "../common/constants.h"
 #include "../common/io.h"
 
-// unfinished
+// Prints the notifications sent on the session's notification pipe until
+// the server closes it, which it does when the session ends.
 static void* notification_handler(void* arg) {
-    printf("[DEBUG] Notification handler started\n");
-    char* notif_path = (char*)arg;
-  
-
-    while (1) {
-        char key[41] = {0};
-        char value[41] = {0};
-
-        int notif_fd = open(notif_path, O_RDONLY);
-        if (notif_fd < 0) {
-          perror("Failed to open notification FIFO");
-          return NULL;
-        }        
-        // Read fixed-size fields
-        if (read_all(notif_fd, key, 41, NULL) <= 0 ||
-            read_all(notif_fd, value, 41, NULL) <= 0) {
-            close(notif_fd);
-            continue;
-        }
-
-        // Trim spaces
-        for (int i = 39; i >= 0; i--) {
-            if (key[i] == ' ') key[i] = '\0'; else break;
-        }
-        for (int i = 39; i >= 0; i--) {
-            if (value[i] == ' ') value[i] = '\0'; else break;
+    int notif_fd = *(int*)arg;
+
+    struct KvsNotification notifications[64];
+    int count;
+    while ((count = kvs_read_notifications(notif_fd, notifications, 64)) >
+           0) {
+        for (int i = 0; i < count; i++) {
+            printf("(%s,%s)\n", notifications[i].key,
+                   notifications[i].value);
         }
-
-        printf("(%s,%s)\n", key, value);
-        close(notif_fd);
     }
-    
 
     return NULL;
 }
@@ -63,8 +44,11 @@ int main(int argc, char *argv[]) {
   char notif_pipe_path[256] = "/tmp/notif";
   char server_pipe_path[256] = "../server/";
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  const char *key_list[MAX_NUMBER_SUB];
+  int results[MAX_NUMBER_SUB];
   unsigned int delay_ms;
   size_t num;
+  uint64_t from;
 
   strncat(req_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
   strncat(resp_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
@@ -76,15 +60,19 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Invalid register pipe path\n");
     return 1;
   }
- // int notif_pipe;
-  if (kvs_connect(req_pipe_path, resp_pipe_path, server_pipe_path, notif_pipe_path) != 0) {
+  // A server that goes away shows up as a failed request, not a SIGPIPE.
+  signal(SIGPIPE, SIG_IGN);
+
+  int notif_pipe;
+  if (kvs_connect(req_pipe_path, resp_pipe_path, server_pipe_path,
+                  notif_pipe_path, &notif_pipe) != 0) {
     fprintf(stderr, "Failed to connect to the server\n");
     return 1;
   }  //se a conexão for successful entao avançamos
   printf("Connected to server\n");
 
   pthread_t notif_thread;
-  if (pthread_create(&notif_thread, NULL, notification_handler, (void*)notif_pipe_path) != 0) {
+  if (pthread_create(&notif_thread, NULL, notification_handler, (void*)&notif_pipe) != 0) {
       perror("Failed to create notification thread");
       return 1;
   }
@@ -93,38 +81,106 @@ int main(int argc, char *argv[]) {
   while (1) {
     switch (get_next(STDIN_FILENO)) {
     case CMD_DISCONNECT:
-      if (kvs_disconnect(req_pipe_path, resp_pipe_path)) {
+      if (kvs_disconnect()) {
         fprintf(stderr, "Failed to disconnect to the server\n");
         return 1;
       }
-      //close(notif_pipe);
-      pthread_cancel(notif_thread);
+      // The server closed the notification pipe, so the thread sees EOF.
       pthread_join(notif_thread, NULL);
+      close(notif_pipe);
       printf("Disconnected from server\n");
       return 0;
 
     case CMD_SUBSCRIBE:
-      num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+      num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
       if (num == 0) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_subscribe(req_pipe_path, resp_pipe_path, keys[0])) {
+      if (num == 1) {
+        if (kvs_subscribe(keys[0]) != 1) {
+          fprintf(stderr, "Command subscribe failed\n");
+        }
+        break;
+      }
+      // Several keys go in one request.
+      for (size_t i = 0; i < num; i++) {
+        key_list[i] = keys[i];
+      }
+      if (kvs_subscribe_many(num, key_list, DELIVERY_EVERY, 0, results)) {
         fprintf(stderr, "Command subscribe failed\n");
+        break;
+      }
+      for (size_t i = 0; i < num; i++) {
+        if (!results[i]) {
+          fprintf(stderr, "Command subscribe failed for key: %s\n", keys[i]);
+        }
       }
 
       break;
 
     case CMD_UNSUBSCRIBE:
-      num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+      num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
       if (num == 0) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_unsubscribe(req_pipe_path, resp_pipe_path, keys[0])) {
-        fprintf(stderr, "Command subscribe failed\n");
+      if (num == 1) {
+        if (kvs_unsubscribe(keys[0])) {
+          fprintf(stderr, "Command unsubscribe failed\n");
+        }
+        break;
+      }
+      // Several keys go in one request.
+      for (size_t i = 0; i < num; i++) {
+        key_list[i] = keys[i];
+      }
+      if (kvs_unsubscribe_many(num, key_list, results)) {
+        fprintf(stderr, "Command unsubscribe failed\n");
+        break;
+      }
+      for (size_t i = 0; i < num; i++) {
+        if (!results[i]) {
+          fprintf(stderr, "Command unsubscribe failed for key: %s\n", keys[i]);
+        }
+      }
+
+      break;
+
+    case CMD_PSUBSCRIBE:
+      if (parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE) == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_psubscribe(keys[0], DELIVERY_EVERY, 0) != 1) {
+        fprintf(stderr, "Command psubscribe failed\n");
+      }
+
+      break;
+
+    case CMD_PUNSUBSCRIBE:
+      if (parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE) == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_punsubscribe(keys[0])) {
+        fprintf(stderr, "Command punsubscribe failed\n");
+      }
+
+      break;
+
+    case CMD_CDC:
+      if (parse_seq(STDIN_FILENO, &from) == -1) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_cdc(from, NULL)) {
+        fprintf(stderr, "Command cdc failed\n");
       }
 
       break;
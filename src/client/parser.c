@@ -1,5 +1,6 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -115,6 +116,41 @@ enum Command get_next(int fd) {
 
     return CMD_UNSUBSCRIBE;
 
+  case 'P':
+    if (read(fd, buf + 1, 1) != 1 || buf[1] == '\n') {
+      return CMD_INVALID;
+    }
+    if (buf[1] == 'S') {
+      if (read(fd, buf + 2, 9) != 9 || strncmp(buf, "PSUBSCRIBE ", 11) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_PSUBSCRIBE;
+    }
+    if (buf[1] != 'U' || read(fd, buf + 2, 11) != 11 ||
+        strncmp(buf, "PUNSUBSCRIBE ", 13) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_PUNSUBSCRIBE;
+
+  case 'C':
+    // A character at a time, so that a short line is not read past.
+    for (size_t i = 1; i < 4; i++) {
+      if (read(fd, buf + i, 1) != 1) {
+        return CMD_INVALID;
+      }
+      if (buf[i] != "CDC "[i]) {
+        if (buf[i] != '\n') {
+          cleanup(fd);
+        }
+        return CMD_INVALID;
+      }
+    }
+
+    return CMD_CDC;
+
   case 'D':
     if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
       if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
@@ -192,3 +228,27 @@ int parse_delay(int fd, unsigned int *delay) {
 
   return 0;
 }
+
+int parse_seq(int fd, uint64_t *seq) {
+  char buf[24];
+  size_t i = 0;
+  char ch = '\0';
+  while (i < sizeof(buf) - 1 && read(fd, &ch, 1) == 1 && ch >= '0' &&
+         ch <= '9') {
+    buf[i++] = ch;
+  }
+  buf[i] = '\0';
+
+  if (ch != '\n') {
+    cleanup(fd);
+    return -1;
+  }
+  errno = 0;
+  unsigned long long ull = strtoull(buf, NULL, 10);
+  if (i == 0 || errno == ERANGE) {
+    return -1;
+  }
+
+  *seq = (uint64_t)ull;
+  return 0;
+}
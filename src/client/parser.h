@@ -2,6 +2,7 @@
 #define KVS_PARSER_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "../common/constants.h"
 
@@ -9,6 +10,9 @@ enum Command {
   CMD_DISCONNECT,
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
+  CMD_PSUBSCRIBE,
+  CMD_PUNSUBSCRIBE,
+  CMD_CDC,
   CMD_DELAY,
   CMD_EMPTY,
   CMD_INVALID,
@@ -40,4 +44,10 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 // error.
 int parse_delay(int fd, unsigned int *delay);
 
+// Parses the sequence number of a CDC command, up to the end of the line.
+// @param fd File descriptor to read from.
+// @param seq Pointer to the variable to store the sequence number in.
+// @return 0 if it was parsed successfully, -1 otherwise.
+int parse_seq(int fd, uint64_t *seq);
+
 #endif // KVS_PARSER_H
@@ -1,6 +1,10 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stdint.h>
+
+#include "constants.h"
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a
 // mensagem recebida no server usam estes opcodes tambem nos clientes quando
@@ -10,6 +14,177 @@ enum {
   OP_CODE_DISCONNECT,
   OP_CODE_SUBSCRIBE,
   OP_CODE_UNSUBSCRIBE,
+  OP_CODE_GET,
+  OP_CODE_PUT,
+  OP_CODE_DEL,
+  OP_CODE_MGET,
+  OP_CODE_MSUBSCRIBE,
+  OP_CODE_MUNSUBSCRIBE,
+  OP_CODE_PSUBSCRIBE,
+  OP_CODE_PUNSUBSCRIBE,
+  OP_CODE_CDC,
+};
+
+// Protocol versions. Version 1 sends a one-byte opcode followed by a fixed
+// 41-byte key and answers with 3 bytes, one request at a time. Version 2
+// sends frames: a FrameHeader followed by a variable-length payload.
+// Requests can be pipelined, and responses may come back in any order.
+// Version 3 takes the requests of version 2, and sends notifications as
+// frames too (see NotificationHeader).
+enum {
+  PROTOCOL_VERSION_1 = 1,
+  PROTOCOL_VERSION_2 = 2,
+  PROTOCOL_VERSION_3 = 3,
+  PROTOCOL_VERSION_MAX = PROTOCOL_VERSION_3,
+};
+
+// A connect request is the opcode, the highest version the client speaks
+// and the three FIFO paths. Clients that predate versions send no version
+// byte: as paths never start with a control character, a byte below this
+// after the opcode is a version. The reply carries the version the session
+// uses in its third byte, which version 1 clients ignore.
+#define PROTOCOL_VERSION_LIMIT 0x20
+
+// Over a Unix socket, a session is one connection: requests and responses
+// share it. The client sends the opcode and its highest version, 2 bytes,
+// and the reply comes with the read end of a pipe for notifications,
+// passed as SCM_RIGHTS.
+#define SOCKET_CONNECT_SIZE 2
+
+// Set in the version byte of a socket connect request to ask for the
+// session's requests, responses and notifications to go through rings in
+// shared memory (see ring.h) instead. The reply sets it too if the server
+// agrees, and passes the memory and its doorbells after the pipe. Nothing
+// is sent through the socket or the pipe after that: the socket only tells
+// either end when the other is gone, and the pipe is closed after the last
+// notification, as it would be otherwise.
+#define CONNECT_FLAG_SHM 0x80
+
+// Descriptors passed with the reply to a socket connect request, in this
+// order. Only the pipe is, unless the server agreed to shared memory. The
+// doorbells are eventfds, only rung for an end marked waiting in a ring.
+enum ConnectFd {
+  CONNECT_FD_NOTIFICATIONS, // Read end of the notification pipe.
+  CONNECT_FD_SHM,           // The rings, a struct RingPair.
+  CONNECT_FD_SERVER_BELL,   // Rung for the server: requests came, or
+                            // responses have room.
+  CONNECT_FD_CLIENT_BELL,   // Rung for the client: responses came, or
+                            // requests have room.
+  CONNECT_FD_NOTIFY_BELL,   // Rung for the client: notifications came.
+  CONNECT_FD_ROOM_BELL,     // Rung for the server: notifications have room.
+  CONNECT_FDS,
+};
+
+// Header of every frame of version 2, in host byte order: both ends of a
+// FIFO live on the same machine.
+struct FrameHeader {
+  uint32_t length;     // Bytes of payload after the header.
+  uint32_t request_id; // Chosen by the client, echoed in the response.
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t status; // Result of the request in responses, 0 in requests.
+};
+
+#define FRAME_HEADER_SIZE sizeof(struct FrameHeader)
+_Static_assert(sizeof(struct FrameHeader) == 12, "FrameHeader is packed");
+
+// Largest payload of a frame. Larger frames end the session.
+#define FRAME_MAX_PAYLOAD 4084
+
+// Payloads of the data opcodes, which only version 2 sessions can send.
+// Keys and values are strings of 1 to DATA_STRING_MAX characters, each
+// sent as a length byte followed by its characters, none of " ,()[]".
+// Keys start with a letter or a digit. The payloads are:
+//   GET:  one key.           MGET, DEL: one or more keys.
+//   PUT:  one or more pairs, each a key followed by its value.
+// A request holds at most DATA_MAX_KEYS keys. The response payload is the
+// line a job's READ or DELETE would write to its output: "[(k,v)...]\n" for
+// GET and MGET, with KVSERROR for missing keys, the missing keys of a DEL as
+// "[(k,KVSMISSING)...]\n" or nothing, and nothing for PUT.
+#define DATA_STRING_MAX (MAX_STRING_SIZE - 1)
+#define DATA_MAX_KEYS 256
+
+// A version 2 SUBSCRIBE may follow its key with a '\0' and these options,
+// in host byte order, to choose how changes of the key are delivered.
+// Without them, every change is.
+struct SubscribeOptions {
+  uint32_t window_ms; // Debounce window, for DELIVERY_DEBOUNCE only.
+  uint8_t mode;
+  uint8_t reserved[3]; // 0.
+};
+
+_Static_assert(sizeof(struct SubscribeOptions) == 8,
+               "SubscribeOptions is packed");
+
+enum {
+  DELIVERY_EVERY,    // Every change, in order.
+  DELIVERY_LATEST,   // Only the latest value: a change not sent yet is
+                     // overwritten in place by the next one.
+  DELIVERY_DEBOUNCE, // The latest value, window_ms after the first change
+                     // since the last one sent.
+  DELIVERY_MODES,
+};
+
+// Longest debounce window, in milliseconds.
+#define DELIVERY_MAX_WINDOW_MS 60000
+
+// MSUBSCRIBE and MUNSUBSCRIBE, version 2 only, carry up to DATA_MAX_KEYS
+// keys as the data opcodes do. An MSUBSCRIBE may end with a 0 length byte
+// followed by SubscribeOptions, which apply to every key. The status of
+// the response is the number of keys that succeeded, and its payload a
+// bitmap of (keys + 7) / 8 bytes: bit i % 8 of byte i / 8 is set if the
+// i-th key was subscribed to, or unsubscribed from. Keys the session was
+// already subscribed to, or not subscribed to, and missing keys fail.
+
+// PSUBSCRIBE and PUNSUBSCRIBE, version 2 only, are SUBSCRIBE and
+// UNSUBSCRIBE for a pattern instead of a key, options included: '*' in it
+// stands for any run of characters, and '?' for any one character. The
+// pattern covers keys created later, and its notifications name the key
+// that changed. They are answered as SUBSCRIBE and UNSUBSCRIBE are.
+
+// Versions 1 and 2 send each notification as the key and the value, each
+// space-padded to MAX_STRING_SIZE characters and NUL-terminated. Version 3
+// sends a NotificationHeader followed by the key_len characters of the key
+// and the value_len characters of the value, without terminators. Several
+// come in one write of at most PIPE_BUF bytes, but a read may still end in
+// the middle of one.
+struct NotificationHeader {
+  uint64_t seq; // Number of the change among all the server made, from 1.
+  uint8_t key_len;
+  uint8_t value_len;
+  uint8_t flags; // NOTIFICATION_FLAG_*.
+  uint8_t reserved[5]; // 0.
 };
 
+_Static_assert(sizeof(struct NotificationHeader) == 16,
+               "NotificationHeader is packed");
+
+// CDC, version 3 only, carries the sequence number of a change, a
+// uint64_t in host byte order, and streams the change log from there on
+// through the notification pipe, as notifications marked with
+// NOTIFICATION_FLAG_STREAM: every change the server made since, whether
+// the session subscribed to its key or not, then every change it makes
+// after. 0 starts at the oldest change kept. Changes no
+// longer kept are skipped, which shows as a gap in the sequence numbers. A
+// consumer resumes after reconnecting by asking for the change after the
+// last one it read. Another CDC moves the stream. The status of the
+// response is 0, or 1 if the log cannot be streamed, and its payload the
+// sequence number of the latest change made so far, a uint64_t.
+
+// Set in the flags of the notifications CDC streams. A session streaming
+// the log and also subscribed to a key is sent each change of it twice,
+// once without the flag for the subscription and once with it.
+#define NOTIFICATION_FLAG_STREAM 0x01
+
+// Largest notification of any version.
+#define NOTIFICATION_MAX_SIZE \
+  (sizeof(struct NotificationHeader) + 2 * MAX_STRING_SIZE)
+
+// Set in the flags of every response.
+#define FRAME_FLAG_RESPONSE 0x01
+
+// Status of a request the server could not make sense of: an unknown
+// opcode, or a payload that does not fit the opcode.
+#define FRAME_STATUS_BAD_REQUEST 0xFFFF
+
 #endif // COMMON_PROTOCOL_H
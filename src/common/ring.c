@@ -0,0 +1,184 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void ring_pair_init(struct RingPair *pair) {
+  atomic_init(&pair->requests.head, 0);
+  atomic_init(&pair->requests.tail, 0);
+  atomic_init(&pair->requests.sleeping, 1);
+  atomic_init(&pair->requests.waiting, 0);
+  atomic_init(&pair->responses.head, 0);
+  atomic_init(&pair->responses.tail, 0);
+  atomic_init(&pair->responses.sleeping, 0);
+  atomic_init(&pair->responses.waiting, 0);
+  atomic_init(&pair->notifications.head, 0);
+  atomic_init(&pair->notifications.tail, 0);
+  atomic_init(&pair->notifications.sleeping, 0);
+  atomic_init(&pair->notifications.waiting, 0);
+}
+
+size_t ring_write(struct Ring *ring, const void *data, size_t len) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t space = RING_SIZE - (size_t)(uint32_t)(tail - head);
+  if (len > space) {
+    len = space;
+  }
+
+  size_t at = tail & (RING_SIZE - 1);
+  size_t first = len < RING_SIZE - at ? len : RING_SIZE - at;
+  memcpy(ring->data + at, data, first);
+  memcpy(ring->data, (const char *)data + first, len - first);
+  atomic_store_explicit(&ring->tail, tail + (uint32_t)len,
+                        memory_order_release);
+  return len;
+}
+
+int ring_write_whole(struct Ring *ring, const void *data, size_t len) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (len > RING_SIZE - (size_t)(uint32_t)(tail - head)) {
+    return 0;
+  }
+  ring_write(ring, data, len);
+  return 1;
+}
+
+size_t ring_read(struct Ring *ring, void *data, size_t len) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t available = (uint32_t)(tail - head);
+  if (len > available) {
+    len = available;
+  }
+
+  size_t at = head & (RING_SIZE - 1);
+  size_t first = len < RING_SIZE - at ? len : RING_SIZE - at;
+  memcpy(data, ring->data + at, first);
+  memcpy((char *)data + first, ring->data, len - first);
+  atomic_store_explicit(&ring->head, head + (uint32_t)len,
+                        memory_order_release);
+  return len;
+}
+
+int ring_sleep(struct Ring *ring) {
+  // Pairs with the fence in ring_wake: either the producer sees the mark,
+  // or this sees what it wrote.
+  atomic_store(&ring->sleeping, 1);
+  if (atomic_load(&ring->tail) == atomic_load(&ring->head)) {
+    return 1;
+  }
+  atomic_store(&ring->sleeping, 0);
+  return 0;
+}
+
+int ring_wake(struct Ring *ring) {
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&ring->sleeping, memory_order_relaxed) &&
+         atomic_exchange(&ring->sleeping, 0);
+}
+
+int ring_wait_room(struct Ring *ring, size_t len) {
+  // Pairs with the fence in ring_made_room, as ring_sleep does.
+  atomic_store(&ring->waiting, 1);
+  uint32_t used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+  if (RING_SIZE - (size_t)used < len) {
+    return 1;
+  }
+  atomic_store(&ring->waiting, 0);
+  return 0;
+}
+
+int ring_made_room(struct Ring *ring) {
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&ring->waiting, memory_order_relaxed) &&
+         atomic_exchange(&ring->waiting, 0);
+}
+
+void ring_bell(int doorbell) {
+  uint64_t one = 1;
+  // A counter that cannot take more was rung already.
+  if (write(doorbell, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("Failed to ring a doorbell");
+  }
+}
+
+void ring_clear_bell(int doorbell) {
+  uint64_t rings;
+  if (read(doorbell, &rings, sizeof(rings)) == -1 && errno != EAGAIN) {
+    perror("Failed to clear a doorbell");
+  }
+}
+
+int ring_wait_bell(int doorbell, int peer) {
+  // Whatever the peer reports, it only does so once the other end is gone:
+  // nothing is sent through it.
+  struct pollfd pfds[2] = {{.fd = doorbell, .events = POLLIN},
+                           {.fd = peer, .events = 0}};
+  if (poll(pfds, 2, -1) == -1) {
+    if (errno == EINTR) {
+      return 1;
+    }
+    perror("Failed to wait for a doorbell");
+    return -1;
+  }
+  if (pfds[1].revents != 0) {
+    return 0;
+  }
+  ring_clear_bell(doorbell);
+  return 1;
+}
+
+int ring_write_all(struct Ring *ring, int wake, int bell, int peer,
+                   const void *data, size_t len) {
+  const char *bytes = data;
+  while (1) {
+    size_t written = ring_write(ring, bytes, len);
+    bytes += written;
+    len -= written;
+    if (ring_wake(ring)) {
+      ring_bell(wake);
+    }
+    if (len == 0) {
+      return 1;
+    }
+    // A doorbell left over from an earlier wait only costs a lap.
+    if (ring_wait_room(ring, 1) && ring_wait_bell(bell, peer) != 1) {
+      return -1;
+    }
+  }
+}
+
+int ring_read_all(struct Ring *ring, int wake, int bell, int peer, void *data,
+                  size_t len) {
+  char *bytes = data;
+  // Once the producer is gone, what it wrote before is still read.
+  int gone = 0;
+  while (1) {
+    size_t got = ring_read(ring, bytes, len);
+    bytes += got;
+    len -= got;
+    if (got > 0 && ring_made_room(ring)) {
+      ring_bell(wake);
+    }
+    if (len == 0) {
+      return 1;
+    }
+    if (got > 0 || !ring_sleep(ring)) {
+      continue;
+    }
+    if (gone) {
+      return 0;
+    }
+    // A doorbell left over from an earlier wake only costs a lap.
+    int rung = ring_wait_bell(bell, peer);
+    if (rung == -1) {
+      return -1;
+    }
+    gone = rung == 0;
+  }
+}
@@ -0,0 +1,135 @@
+#ifndef COMMON_RING_H
+#define COMMON_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes each ring holds. A power of two, so positions wrap with a mask.
+#define RING_SIZE (1 << 16)
+
+/// A single-producer, single-consumer byte ring in memory shared by the
+/// server and a client. Frames are written to it as they would be to a
+/// FIFO. The positions run freely and are only masked to index data.
+///
+/// A consumer with nothing to read marks itself sleeping before it waits
+/// for a doorbell, an eventfd, and a producer rings the doorbell only if it
+/// finds the mark: while both ends keep up, no system call is made at all.
+/// A producer short of room marks itself waiting the same way, and the
+/// consumer rings it once it made some.
+struct Ring {
+  _Alignas(64) _Atomic uint32_t head; // Bytes read so far, by the consumer.
+  _Atomic uint32_t waiting; // The producer waits for a doorbell.
+  _Alignas(64) _Atomic uint32_t tail; // Bytes written so far, by the producer.
+  _Atomic uint32_t sleeping; // The consumer waits for a doorbell.
+  _Alignas(64) char data[RING_SIZE];
+};
+
+/// What a shared-memory session maps: requests from the client, the
+/// server's responses to them, and the notifications of the session, as
+/// its notification pipe would take them.
+struct RingPair {
+  struct Ring requests;
+  struct Ring responses;
+  struct Ring notifications;
+};
+
+/// Initializes a ring pair. Its server starts asleep: the first request
+/// rings the doorbell.
+/// @param pair Ring pair, in shared memory.
+void ring_pair_init(struct RingPair *pair);
+
+/// Writes as many bytes as fit, without waiting. Producer only.
+/// @param ring Ring to write to.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write.
+/// @return Number of bytes written.
+size_t ring_write(struct Ring *ring, const void *data, size_t len);
+
+/// Writes all bytes if they fit, without waiting, as a pipe takes up to
+/// PIPE_BUF bytes. Producer only.
+/// @param ring Ring to write to.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write.
+/// @return 1 if they were written, 0 if the ring has no room for them.
+int ring_write_whole(struct Ring *ring, const void *data, size_t len);
+
+/// Reads as many bytes as are there, up to a limit, without waiting.
+/// Consumer only.
+/// @param ring Ring to read from.
+/// @param data Buffer to read into.
+/// @param len Most bytes to read.
+/// @return Number of bytes read.
+size_t ring_read(struct Ring *ring, void *data, size_t len);
+
+/// Marks the consumer sleeping if the ring is empty. Consumer only. A
+/// doorbell may still come after a 0 return, and must be ignored.
+/// @param ring Ring that was read to the end.
+/// @return 1 if the consumer must wait for a doorbell, 0 if bytes came in
+/// meanwhile.
+int ring_sleep(struct Ring *ring);
+
+/// Clears the consumer's sleeping mark after a write. Producer only.
+/// @param ring Ring just written to.
+/// @return 1 if the consumer was sleeping and the producer must ring the
+/// doorbell, 0 otherwise.
+int ring_wake(struct Ring *ring);
+
+/// Marks the producer waiting if the ring has less room than it needs.
+/// Producer only. A doorbell may still come after a 0 return, and must be
+/// ignored.
+/// @param ring Ring that took less than was written.
+/// @param len Bytes of room the producer needs.
+/// @return 1 if the producer must wait for a doorbell, 0 if room was made
+/// meanwhile.
+int ring_wait_room(struct Ring *ring, size_t len);
+
+/// Clears the producer's waiting mark after a read. Consumer only.
+/// @param ring Ring just read from.
+/// @return 1 if the producer was waiting and the consumer must ring the
+/// doorbell, 0 otherwise.
+int ring_made_room(struct Ring *ring);
+
+/// Rings a doorbell.
+/// @param doorbell The eventfd.
+void ring_bell(int doorbell);
+
+/// Clears the rings of a doorbell so far, without waiting.
+/// @param doorbell The eventfd, non-blocking.
+void ring_clear_bell(int doorbell);
+
+/// Waits for a doorbell, and clears it, unless the other end is gone.
+/// @param doorbell The eventfd, non-blocking.
+/// @param peer Descriptor that hangs up once the other end is gone.
+/// @return 1 once the doorbell rang, 0 if the other end is gone, -1 on
+/// error.
+int ring_wait_bell(int doorbell, int peer);
+
+/// Writes all bytes, ringing the consumer's doorbell whenever it sleeps. A
+/// full ring is waited on, as a full FIFO would be.
+/// @param ring Ring to write to.
+/// @param wake Doorbell of the consumer.
+/// @param bell Doorbell the consumer rings once it made room.
+/// @param peer Socket to the consumer. It hangs up once the consumer is
+/// gone.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write.
+/// @return 1 once everything was written, -1 if the consumer is gone.
+int ring_write_all(struct Ring *ring, int wake, int bell, int peer,
+                   const void *data, size_t len);
+
+/// Reads exactly the given number of bytes, sleeping until a doorbell when
+/// the ring runs dry, and ringing the producer's doorbell whenever it waits
+/// for room.
+/// @param ring Ring to read from.
+/// @param wake Doorbell of the producer.
+/// @param bell Doorbell the producer rings once it wrote.
+/// @param peer Socket to the producer. It hangs up once the producer is
+/// gone.
+/// @param data Buffer to read into.
+/// @param len Number of bytes to read.
+/// @return 1 on success, 0 if the producer is gone, -1 on error.
+int ring_read_all(struct Ring *ring, int wake, int bell, int peer, void *data,
+                  size_t len);
+
+#endif // COMMON_RING_H
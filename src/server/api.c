@@ -1,14 +1,18 @@
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 #include "constants.h"
 #include "io.h"
 #include "operations.h"
@@ -22,193 +26,809 @@
 #include "operations.h"
 #include "api.h"
 #include "errno.h"
+#include "qos.h"
+#include "loop.h"
+#include "sessions.h"
+#include "patterns.h"
+#include "cdc.h"
+
+_Static_assert(SESSION_INPUT_SIZE >= FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD,
+               "the input of a session fits the largest frame");
+_Static_assert(DATA_MAX_KEYS <= MAX_WRITE_SIZE,
+               "a data request fits the engine's batches");
+// Each pair is at most "(key,value)" and the line adds "[]\n".
+_Static_assert(FRAME_HEADER_SIZE + DATA_MAX_KEYS * (2 * DATA_STRING_MAX + 3) +
+                       3 <
+                   OUT_BUFFER_FLUSH_SIZE,
+               "a data response is never flushed before it is complete");
+
+// Sends the reply to a connect request on a response FIFO.
+// @return 0 if the reply was written, 1 if the client is gone.
+static int send_connect_reply(int fd, char result, int version) {
+    char response[3] = {OP_CODE_CONNECT, result + '0', (char)version};
+    return write_all(fd, response, sizeof(response)) == 1 ? 0 : 1;
+}
 
+// Whether socket clients may have their sessions in shared memory.
+static int shm_offered = 0;
+
+void api_offer_shm(void) { shm_offered = 1; }
+
+// Writes as much of a response as the session takes without waiting. A
+// full ring asks the client to ring the doorbell once it made room.
+// @return Number of bytes written, or -1 if the client is gone.
+static ssize_t write_some(struct Client *client, const char *data,
+                          size_t len) {
+    if (client->shm != NULL) {
+        struct Ring *ring = &client->shm->responses;
+        size_t written = 0;
+        do {
+            written += ring_write(ring, data + written, len - written);
+        } while (written < len && !ring_wait_room(ring, 1));
+        if (ring_wake(ring)) {
+            ring_bell(client->client_bell);
+        }
+        return (ssize_t)written;
+    }
+    ssize_t written = client->socket
+                          ? send(client->resp_fd, data, len, MSG_DONTWAIT)
+                          : write(client->resp_fd, data, len);
+    if (written == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    return written;
+}
 
+// Writes a whole response to the session, wherever its responses go. What
+// the client does not take now is queued after the responses already
+// queued, for the event loop to write. Called with the session's write lock
+// held.
+// @return 1 on success, -1 if the client is gone.
+static int session_write(struct Client *client, const void *data,
+                         size_t len) {
+    const char *bytes = data;
+    int queued = client->output_len > 0;
+    if (!queued) {
+        ssize_t written = write_some(client, bytes, len);
+        if (written == -1) {
+            return -1;
+        }
+        bytes += written;
+        len -= (size_t)written;
+        if (len == 0) {
+            return 1;
+        }
+    }
 
-const int s = MAX_SESSION_COUNT;
-extern sem_t session_sem;
+    if (client->output_len + len > client->output_cap) {
+        size_t cap = client->output_cap > 0 ? client->output_cap
+                                            : SESSION_INPUT_SIZE;
+        while (cap < client->output_len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(client->output, cap);
+        if (grown == NULL) {
+            perror("Failed to queue response");
+            return -1;
+        }
+        client->output = grown;
+        client->output_cap = cap;
+    }
+    memcpy(client->output + client->output_len, bytes, len);
+    client->output_len += len;
+    if (!queued) {
+        loop_watch_output(client);
+    }
+    return 1;
+}
 
+int session_flush(struct Client *client) {
+    if (client->output_len == 0) {
+        return 0;
+    }
+    ssize_t written = write_some(client, client->output, client->output_len);
+    if (written == -1) {
+        // Nobody is left to read them.
+        client->output_len = 0;
+        return 0;
+    }
+    client->output_len -= (size_t)written;
+    memmove(client->output, client->output + written, client->output_len);
+    return client->output_len > 0;
+}
 
+// Sends the result of a request on the session's response FIFO, as the
+// version of the session frames it.
+// @return 0 if the response was written, 1 if the client is gone.
+static int write_response(struct Client *client, char op_code,
+                          uint32_t request_id, int result) {
+    if (client->version < PROTOCOL_VERSION_2) {
+        char response[3] = {op_code, (char)(result + '0'), '\0'};
+        pthread_mutex_lock(&client->write_lock);
+        int written = session_write(client, response, sizeof(response));
+        pthread_mutex_unlock(&client->write_lock);
+        return written == 1 ? 0 : 1;
+    }
 
-struct Client g_clients[MAX_SESSION_COUNT] = {0}; 
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct FrameHeader header = {
+        .length = 0,
+        .request_id = request_id,
+        .opcode = (uint8_t)op_code,
+        .flags = FRAME_FLAG_RESPONSE,
+        .status = (uint16_t)result,
+    };
+    pthread_mutex_lock(&client->write_lock);
+    int written = session_write(client, &header, sizeof(header));
+    pthread_mutex_unlock(&client->write_lock);
+    return written == 1 ? 0 : 1;
+}
 
-static int write_response(const char *pipe_path, char op_code, char result) {
-    int fd = open(pipe_path, O_WRONLY);
-    if (fd == -1) return 1;
-    
-    char response[3] = {op_code, result + '0', '\0'};
-    write(fd, response, sizeof(response));
-    close(fd);
-    return 0;
+// Opens a FIFO the client already has open at the other end. Fails instead
+// of blocking if it does not.
+// @return The descriptor, blocking unless nonblocking is set, or -1.
+static int open_fifo(const char *path, int flags, int nonblocking) {
+    int fd = open(path, flags | O_NONBLOCK);
+    if (fd == -1) {
+        fprintf(stderr, "[ERROR] Failed to open pipe %s (errno=%d)\n", path,
+                errno);
+        return -1;
+    }
+    if (!nonblocking && fcntl(fd, F_SETFL, flags) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
+// Opens the session's FIFOs, all non-blocking: the request FIFO is read by
+// the event loop, the notification FIFO written to by the dispatchers, and
+// the response FIFO written to by workers until it is full, then by the
+// event loop.
+// @return 0 if every FIFO was opened, 1 otherwise.
+static int open_session(struct Client *client) {
+    client->resp_fd = open_fifo(client->resp_pipe, O_WRONLY, 1);
+    int notif_fd = open_fifo(client->notif_pipe, O_WRONLY, 1);
+    if (notif_fd != -1 &&
+        notify_open(&client->notifier, notif_fd,
+                    client->version >= PROTOCOL_VERSION_3) != 0) {
+        notif_fd = -1;
+    }
+    client->req_fd = open_fifo(client->req_pipe, O_RDONLY, 1);
+    return client->resp_fd == -1 || notif_fd == -1 || client->req_fd == -1;
+}
 
+void close_session(struct Client *client) {
+    // No change is queued for the session once it has no subscriptions, so
+    // the FIFO is not written to after it is closed.
+    kvs_unsubscribe_all_keys(&client->notifier);
+    notify_close(&client->notifier);
+    if (client->req_fd != -1) {
+        close(client->req_fd);
+    }
+    if (client->resp_fd != -1 && client->resp_fd != client->req_fd) {
+        close(client->resp_fd);
+    }
+    if (client->shm != NULL) {
+        munmap(client->shm, sizeof(*client->shm));
+        client->shm = NULL;
+        close(client->server_bell);
+        close(client->client_bell);
+        client->server_bell = -1;
+        client->client_bell = -1;
+    }
+    session_release(client);
+}
 
-int handle_connection(int fd_server) {
-    char total_pipe_path[MAX_PIPE_PATH_LENGTH * 3 + 1] = {0};
+// Readies a session just taken from the table for a new client.
+static void reset_session(struct Client *client, int version) {
+    client->version = version;
+    client->input_start = 0;
+    client->input_len = 0;
+    client->queued = 0;
+    client->in_flight = 0;
+    client->paused = 0;
+    client->eof = 0;
+    client->hung_up = 0;
+    client->writing = 0;
+    client->output_len = 0;
+    client->output_registered = 0;
+    client->done = 0;
+}
 
-    if (sem_wait(&session_sem) != 0) {
-        perror("sem_wait failed");
-        close(fd_server);
-        return 1;
+int handle_connection(const char *paths, int version) {
+    if (version > PROTOCOL_VERSION_MAX) {
+        version = PROTOCOL_VERSION_MAX;
     }
-    
-    if (read(fd_server, total_pipe_path, MAX_PIPE_PATH_LENGTH * 3 + 1) < 0) {
-        fprintf(stderr, "[ERROR] Failed to read pipe paths\n");
-        write_response(g_client.resp_pipe, OP_CODE_CONNECT, 1);
+
+    struct Client *client = session_acquire();
+    if (client == NULL) {
+        // Every session is taken: turn the client away.
+        char resp_pipe[MAX_PIPE_PATH_LENGTH + 1] = {0};
+        memcpy(resp_pipe, paths + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
+        fprintf(stderr, "[ERROR] No free session for %s (%zu in use)\n",
+                resp_pipe, sessions_active());
+        int fd = open_fifo(resp_pipe, O_WRONLY, 0);
+        if (fd != -1) {
+            send_connect_reply(fd, 1, version);
+            close(fd);
+        }
         return 1;
     }
 
-    pthread_mutex_lock(&clients_mutex);
-    if (g_client.active) {
-        pthread_mutex_unlock(&clients_mutex);
-        fprintf(stderr, "[ERROR] Client already connected\n");
+    memcpy(client->req_pipe, paths, MAX_PIPE_PATH_LENGTH);
+    memcpy(client->resp_pipe, paths + MAX_PIPE_PATH_LENGTH,
+           MAX_PIPE_PATH_LENGTH);
+    memcpy(client->notif_pipe, paths + 2 * MAX_PIPE_PATH_LENGTH,
+           MAX_PIPE_PATH_LENGTH);
+    client->req_pipe[MAX_PIPE_PATH_LENGTH] = '\0';
+    client->resp_pipe[MAX_PIPE_PATH_LENGTH] = '\0';
+    client->notif_pipe[MAX_PIPE_PATH_LENGTH] = '\0';
+    client->socket = 0;
+    client->shm = NULL;
+    client->server_bell = -1;
+    client->client_bell = -1;
+    reset_session(client, version);
+
+    // Nothing watches the session yet, so it can still be closed here if
+    // the client is already gone.
+    if (open_session(client) != 0 ||
+        send_connect_reply(client->resp_fd, 0, version) != 0 ||
+        loop_add_session(client) != 0) {
+        close_session(client);
         return 1;
     }
 
-    strncpy(g_client.req_pipe, total_pipe_path, MAX_PIPE_PATH_LENGTH);
-    strncpy(g_client.resp_pipe, total_pipe_path + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
-    strncpy(g_client.notif_pipe, total_pipe_path + (2 * MAX_PIPE_PATH_LENGTH), MAX_PIPE_PATH_LENGTH);
-    g_client.active = 1;
+    printf("[DEBUG] Client pipes configured (protocol version %d)\n",
+           version);
+    return 0;
+}
 
-    pthread_mutex_unlock(&clients_mutex);
+int handle_socket_connection(int fd) {
+    struct Client *client = session_acquire();
+    if (client == NULL) {
+        fprintf(stderr, "[ERROR] No free session for a socket client "
+                        "(%zu in use)\n",
+                sessions_active());
+        // The connection is new, so the reply fits its buffer.
+        send_connect_reply(fd, 1, PROTOCOL_VERSION_MAX);
+        close(fd);
+        return 1;
+    }
 
-    printf("[DEBUG] Client pipes configured\n");
-    return write_response(g_client.resp_pipe, OP_CODE_CONNECT, 0);
+    client->req_pipe[0] = '\0';
+    client->resp_pipe[0] = '\0';
+    client->notif_pipe[0] = '\0';
+    client->socket = 1;
+    client->shm = NULL;
+    client->server_bell = -1;
+    client->client_bell = -1;
+    client->req_fd = fd;
+    client->resp_fd = fd;
+    reset_session(client, SESSION_VERSION_PENDING);
+
+    if (loop_add_session(client) != 0) {
+        close_session(client);
+        return 1;
+    }
+    return 0;
 }
 
-void *client_handler(void *arg) {
-    struct Client *client = (struct Client *)arg;
-    printf("[DEBUG] Client handler started\n");
-    
-    while (client->active) {
-        int fd = open(client->req_pipe, O_RDONLY);
-        if (fd == -1) {
-            fprintf(stderr, "[ERROR] Failed to open request pipe (errno=%d)\n", errno);
-            continue;
-        }
-
-        char opcode;
-        int interrupted = 0;
-        if (read_all(fd, &opcode, 1, &interrupted) < 0) {
-            fprintf(stderr, "[ERROR] Failed to read opcode (errno=%d)\n", errno);
-            close(fd);
-            continue;
-        }
-
-        printf("[DEBUG] Received opcode: %d\n", opcode);
-        switch(opcode) {
-            case OP_CODE_DISCONNECT:
-                printf("[DEBUG] Processing disconnect\n");
-                client_disconnect(client);
-                close(fd);
-                return NULL;
-            
-            case OP_CODE_SUBSCRIBE:
-                printf("[DEBUG] Processing subscribe\n");
-                handle_subscribe(fd, client);
-                break;
-                
-            case OP_CODE_UNSUBSCRIBE:
-                printf("[DEBUG] Processing unsubscribe\n");
-                handle_unsubscribe(fd, client);
-                break;
-                
-            default:
-                fprintf(stderr, "[ERROR] Unknown opcode: %d\n", opcode);
+// Closes what create_shm made so far.
+static void destroy_shm(struct RingPair *pair, int fds[]) {
+    if (pair != NULL) {
+        munmap(pair, sizeof(*pair));
+    }
+    for (int i = CONNECT_FD_SHM; i < CONNECT_FDS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
         }
-        close(fd);
     }
-    printf("[DEBUG] Client handler exiting\n");
-    return NULL;
 }
 
-int client_disconnect(struct Client *client) {
- 
-  if (write_response(client->resp_pipe, OP_CODE_DISCONNECT, 0) != 0) {
-    return 1;
-  }
+// Maps fresh rings for a session, creates their doorbells, and has the
+// loop watch the server's doorbell instead of the socket.
+// @param fds Set to the memory and the doorbells, at their CONNECT_FD_
+// positions, to pass on to the client.
+// @return The rings, or NULL if shared memory is not available.
+static struct RingPair *create_shm(struct Client *client, int fds[]) {
+    // The name is only needed until the memory is open: nobody else can
+    // reach it once it is unlinked.
+    static atomic_uint counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/kvs-%ld-%zu-%u", (long)getpid(),
+             client->slot, atomic_fetch_add(&counter, 1));
+    fds[CONNECT_FD_SHM] = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fds[CONNECT_FD_SHM] == -1) {
+        perror("Failed to create shared memory");
+        return NULL;
+    }
+    shm_unlink(name);
 
-  pthread_mutex_lock(&clients_mutex);
-  client->active = 0;
-  kvs_unsubscribe_all_keys(client->notif_pipe);
-  pthread_mutex_unlock(&clients_mutex);
-  
-  return 0;
+    struct RingPair *pair = MAP_FAILED;
+    if (ftruncate(fds[CONNECT_FD_SHM], sizeof(struct RingPair)) == 0) {
+        pair = mmap(NULL, sizeof(struct RingPair), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fds[CONNECT_FD_SHM], 0);
+    }
+    if (pair == MAP_FAILED) {
+        perror("Failed to map shared memory");
+        destroy_shm(NULL, fds);
+        return NULL;
+    }
+    ring_pair_init(pair);
+
+    for (int i = CONNECT_FD_SERVER_BELL; i < CONNECT_FDS; i++) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] == -1) {
+            perror("Failed to create doorbell");
+            destroy_shm(pair, fds);
+            return NULL;
+        }
+    }
+    client->server_bell = fds[CONNECT_FD_SERVER_BELL];
+    if (loop_watch_doorbell(client) != 0) {
+        client->server_bell = -1;
+        destroy_shm(pair, fds);
+        return NULL;
+    }
+    return pair;
 }
 
+// Serves the connect request of a socket session: settles on a version and
+// hands the client the read end of its notification pipe with the reply,
+// and the session's rings if it asked for shared memory. Runs alone, as
+// every request of a session without a version does, and the session is
+// not watched meanwhile.
+static void socket_connect(struct Client *client, int request) {
+    int version = request & ~CONNECT_FLAG_SHM;
+    if (version > PROTOCOL_VERSION_MAX) {
+        version = PROTOCOL_VERSION_MAX;
+    } else if (version < PROTOCOL_VERSION_1) {
+        version = PROTOCOL_VERSION_1;
+    }
 
+    int notif[2];
+    if (pipe(notif) == -1) {
+        perror("Failed to create notification pipe");
+        send_connect_reply(client->resp_fd, 1, version);
+        client->done = 1;
+        return;
+    }
+    if (notify_open(&client->notifier, notif[1],
+                    version >= PROTOCOL_VERSION_3) != 0) {
+        close(notif[0]);
+        send_connect_reply(client->resp_fd, 1, version);
+        client->done = 1;
+        return;
+    }
+    int fds[CONNECT_FDS] = {notif[0], -1, -1, -1, -1, -1};
+    struct RingPair *shm = NULL;
+    if ((request & CONNECT_FLAG_SHM) && shm_offered) {
+        // Without shared memory, the session stays on the socket.
+        shm = create_shm(client, fds);
+    }
+    size_t num_fds = shm != NULL ? CONNECT_FDS : 1;
+
+    char response[3] = {OP_CODE_CONNECT, '0',
+                        (char)(shm != NULL ? version | CONNECT_FLAG_SHM
+                                           : version)};
+    struct iovec iov = {.iov_base = response, .iov_len = sizeof(response)};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(num_fds * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    // Requests may come through the rings as soon as the reply is out, and
+    // notifications go to the ring from now on.
+    pthread_mutex_lock(&client->lock);
+    client->shm = shm;
+    client->client_bell = fds[CONNECT_FD_CLIENT_BELL];
+    client->version = version;
+    pthread_mutex_unlock(&client->lock);
+    if (shm != NULL) {
+        notify_use_ring(&client->notifier, &shm->notifications,
+                        fds[CONNECT_FD_NOTIFY_BELL],
+                        fds[CONNECT_FD_ROOM_BELL]);
+    }
 
+    ssize_t sent = sendmsg(client->resp_fd, &msg, 0);
+    close(notif[0]);
+    if (shm != NULL) {
+        close(fds[CONNECT_FD_SHM]);
+    }
+    if (sent != (ssize_t)sizeof(response)) {
+        notify_close(&client->notifier);
+        client->done = 1;
+        return;
+    }
+    printf("[DEBUG] Socket client connected (protocol version %d%s)\n",
+           version, shm != NULL ? ", shared memory" : "");
+}
 
-int handle_subscribe(int fd_req, struct Client *client) {
-    char key[MAX_STRING_SIZE] = {0};
-    printf("[DEBUG] Starting subscribe operation\n");
+int parse_request(int version, const char *input, size_t len, size_t *size) {
+    if (version == SESSION_VERSION_PENDING) {
+        if (len < SOCKET_CONNECT_SIZE) {
+            return 1;
+        }
+        *size = SOCKET_CONNECT_SIZE;
+        return input[0] == OP_CODE_CONNECT ? 0 : -1;
+    }
+    if (version >= PROTOCOL_VERSION_2) {
+        struct FrameHeader header;
+        if (len < sizeof(header)) {
+            return 1;
+        }
+        memcpy(&header, input, sizeof(header));
+        if (header.length > FRAME_MAX_PAYLOAD) {
+            return -1;
+        }
+        *size = sizeof(header) + header.length;
+        return len < *size;
+    }
 
-    int fd_resp = open(client->resp_pipe, O_WRONLY);
-    if (fd_resp == -1) {
-        fprintf(stderr, "[ERROR] Subscribe: Failed to open response pipe %s (errno=%d)\n", 
-                client->resp_pipe, errno);
+    if (len == 0) {
         return 1;
     }
-    printf("[DEBUG] Opened response pipe: %s\n", client->resp_pipe);
+    switch (input[0]) {
+        case OP_CODE_DISCONNECT:
+            *size = 1;
+            break;
+        case OP_CODE_SUBSCRIBE:
+        case OP_CODE_UNSUBSCRIBE:
+            // Opcode and key, padded to MAX_STRING_SIZE + 1 bytes.
+            *size = 1 + MAX_STRING_SIZE + 1;
+            break;
+        default:
+            return -1;
+    }
+    return len < *size;
+}
+
+// Checks the options of a subscription.
+// @return 1 if they are valid, 0 otherwise.
+static int options_valid(const struct SubscribeOptions *options) {
+    if (options->mode >= DELIVERY_MODES || options->reserved[0] != 0 ||
+        options->reserved[1] != 0 || options->reserved[2] != 0) {
+        return 0;
+    }
+    if (options->mode == DELIVERY_DEBOUNCE) {
+        return options->window_ms > 0 &&
+               options->window_ms <= DELIVERY_MAX_WINDOW_MS;
+    }
+    return options->window_ms == 0;
+}
 
-    if (read(fd_req, key, MAX_STRING_SIZE) < 0) {
-        fprintf(stderr, "[ERROR] Subscribe: Failed to read key from request (errno=%d)\n", 
-                errno);
-        write_response(client->resp_pipe, OP_CODE_SUBSCRIBE, 1);
-        close(fd_resp);
+int request_is_barrier(const struct Client *client, const char *request) {
+    if (client->version < PROTOCOL_VERSION_2) {
         return 1;
     }
-    printf("[DEBUG] Read key: %s\n", key);
+    struct FrameHeader header;
+    memcpy(&header, request, sizeof(header));
+    return header.opcode == OP_CODE_DISCONNECT;
+}
 
-    if (kvs_subscribe(key, client->notif_pipe)) {
-        printf("[DEBUG] Successfully subscribed to key: %s\n", key);
-        printf("[DEBUG] Using notification pipe: %s\n", client->notif_pipe);
-        kvs_print_notif_pipes(key);
-        
-    write_response(client->resp_pipe, OP_CODE_SUBSCRIBE, 1);
+void serve_request(struct Client *client, const char *request) {
+    char key[MAX_STRING_SIZE + 1] = {0};
+    struct SubscribeOptions options = {.mode = DELIVERY_EVERY};
+    uint32_t request_id = 0;
+    char opcode = request[0];
+    int valid = 1;
+
+    if (client->version == SESSION_VERSION_PENDING) {
+        socket_connect(client, (unsigned char)request[1]);
+        return;
+    }
+    if (client->version >= PROTOCOL_VERSION_2) {
+        struct FrameHeader header;
+        memcpy(&header, request, sizeof(header));
+        request_id = header.request_id;
+        opcode = (char)header.opcode;
+        if (opcode >= OP_CODE_GET && opcode <= OP_CODE_MGET) {
+            handle_data(client, request_id, opcode, request + sizeof(header),
+                        header.length);
+            return;
+        }
+        if (opcode == OP_CODE_MSUBSCRIBE || opcode == OP_CODE_MUNSUBSCRIBE) {
+            handle_subscribe_batch(client, request_id, opcode,
+                                   request + sizeof(header), header.length);
+            return;
+        }
+        if (opcode == OP_CODE_CDC) {
+            handle_cdc(client, request_id, request + sizeof(header),
+                       header.length);
+            return;
+        }
+        // Keys are sent without padding or terminator, but may be followed
+        // by a '\0' and the options of a subscription.
+        const char *payload = request + sizeof(header);
+        size_t key_len = header.length;
+        const char *end = memchr(payload, '\0', header.length);
+        if ((opcode == OP_CODE_SUBSCRIBE || opcode == OP_CODE_PSUBSCRIBE) &&
+            end != NULL) {
+            key_len = (size_t)(end - payload);
+            if (header.length - key_len - 1 != sizeof(options)) {
+                valid = 0;
+            } else {
+                memcpy(&options, end + 1, sizeof(options));
+                valid = options_valid(&options);
+            }
+        }
+        if (key_len > MAX_STRING_SIZE ||
+            (opcode != OP_CODE_DISCONNECT && key_len == 0)) {
+            valid = 0;
+        } else {
+            memcpy(key, payload, key_len);
+        }
+        // The table is indexed by the first character of keys.
+        if ((opcode == OP_CODE_SUBSCRIBE || opcode == OP_CODE_UNSUBSCRIBE) &&
+            !isalnum((unsigned char)key[0])) {
+            valid = 0;
+        }
     } else {
-        fprintf(stderr, "[ERROR] Subscribe: KVS subscription failed for key: %s\n", key);
-    write_response(client->resp_pipe, OP_CODE_SUBSCRIBE, 0);
+        memcpy(key, request + 1, MAX_STRING_SIZE);
     }
 
-    printf("[DEBUG] Subscribe operation completed for key: %s\n", key);
-    close(fd_resp);
-    return 0;
+    printf("[DEBUG] Received opcode: %d\n", opcode);
+    if (!valid) {
+        write_response(client, opcode, request_id, FRAME_STATUS_BAD_REQUEST);
+        return;
+    }
+    switch (opcode) {
+        case OP_CODE_DISCONNECT:
+            printf("[DEBUG] Processing disconnect\n");
+            client_disconnect(client, request_id);
+            break;
+
+        case OP_CODE_SUBSCRIBE:
+            handle_subscribe(client, request_id, key, &options);
+            break;
+
+        case OP_CODE_UNSUBSCRIBE:
+            handle_unsubscribe(client, request_id, key);
+            break;
+
+        case OP_CODE_PSUBSCRIBE:
+        case OP_CODE_PUNSUBSCRIBE:
+            handle_pattern(client, request_id, opcode, key, &options);
+            break;
+
+        default:
+            fprintf(stderr, "[ERROR] Unknown opcode: %d\n", opcode);
+            write_response(client, opcode, request_id,
+                           FRAME_STATUS_BAD_REQUEST);
+    }
 }
 
-int handle_unsubscribe(int fd_req, struct Client *client) {
-    char key[MAX_STRING_SIZE] = {0};
-    printf("[DEBUG] Starting unsubscribe operation\n");
+// Splits the payload of a data request into its strings, checking each one
+// is something a job could have written.
+// @param values If not NULL, strings alternate between keys and values.
+// @return Number of keys, or -1 if the payload is malformed.
+static int read_strings(const char *payload, size_t len,
+                        char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]) {
+    int count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        if (count == DATA_MAX_KEYS) {
+            return -1;
+        }
+        for (int is_value = 0; is_value <= (values != NULL); is_value++) {
+            size_t str_len = pos < len ? (unsigned char)payload[pos] : 0;
+            if (str_len == 0 || str_len > DATA_STRING_MAX ||
+                str_len > len - pos - 1) {
+                return -1;
+            }
+            // The table is indexed by the first character of keys.
+            if (!is_value && !isalnum((unsigned char)payload[pos + 1])) {
+                return -1;
+            }
+            char *str = is_value ? values[count] : keys[count];
+            for (size_t i = 0; i < str_len; i++) {
+                // The terminator strchr finds rejects '\0' too.
+                if (strchr(" ,()[]", payload[pos + 1 + i]) != NULL) {
+                    return -1;
+                }
+                str[i] = payload[pos + 1 + i];
+            }
+            str[str_len] = '\0';
+            pos += 1 + str_len;
+        }
+        count++;
+    }
+    return count;
+}
 
-    int fd_resp = open(client->resp_pipe, O_WRONLY);
-    if (fd_resp == -1) {
-        fprintf(stderr, "[ERROR] Unsubscribe: Failed to open response pipe %s (errno=%d)\n", 
-                client->resp_pipe, errno);
-        return 1;
+int handle_data(struct Client *client, uint32_t request_id, char opcode,
+                const char *payload, size_t len) {
+    char keys[DATA_MAX_KEYS][MAX_STRING_SIZE];
+    char values[DATA_MAX_KEYS][MAX_STRING_SIZE];
+    int count = read_strings(payload, len, keys,
+                             opcode == OP_CODE_PUT ? values : NULL);
+    if (count <= 0 || (opcode == OP_CODE_GET && count != 1)) {
+        return write_response(client, opcode, request_id,
+                              FRAME_STATUS_BAD_REQUEST);
     }
-    printf("[DEBUG] Opened response pipe: %s\n", client->resp_pipe);
 
-    if (read(fd_req, key, MAX_STRING_SIZE) < 0) {
-        fprintf(stderr, "[ERROR] Unsubscribe: Failed to read key from request (errno=%d)\n", 
-                errno);
-        write_response(client->resp_pipe, OP_CODE_UNSUBSCRIBE, 1);
-        close(fd_resp);
-        return 1;
+    // The engine formats its output after the header, and the whole frame
+    // goes out in one write once the header knows its length.
+    struct OutBuffer out;
+    if (out_buffer_init(&out, client->resp_fd) != 0) {
+        return write_response(client, opcode, request_id, 1);
     }
-    printf("[DEBUG] Read key: %s\n", key);
+    struct FrameHeader header = {
+        .request_id = request_id,
+        .opcode = (uint8_t)opcode,
+        .flags = FRAME_FLAG_RESPONSE,
+    };
+    out_buffer_append(&out, &header, sizeof(header));
+
+    int result;
+    switch (opcode) {
+        case OP_CODE_PUT:
+            result = kvs_write((size_t)count, keys, values);
+            break;
+        case OP_CODE_DEL:
+            result = kvs_delete((size_t)count, keys, &out);
+            break;
+        default:
+            result = kvs_read((size_t)count, keys, &out);
+    }
+
+    header.length = (uint32_t)(out.len - sizeof(header));
+    header.status = (uint16_t)result;
+    memcpy(out.data, &header, sizeof(header));
+    pthread_mutex_lock(&client->write_lock);
+    int written = session_write(client, out.data, out.len);
+    pthread_mutex_unlock(&client->write_lock);
+    out.len = 0;
+    out_buffer_destroy(&out);
+    return written == 1 ? 0 : 1;
+}
+
+int client_disconnect(struct Client *client, uint32_t request_id) {
+    int result = write_response(client, OP_CODE_DISCONNECT, request_id, 0);
+
+    // Closing the notification FIFO tells the client no more notifications
+    // will come; the rest is closed once the client closes its end.
+    kvs_unsubscribe_all_keys(&client->notifier);
+    notify_close(&client->notifier);
+    client->done = 1;
+    return result;
+}
 
-    if (kvs_unsubscribe(key, client->notif_pipe)) {
+int handle_subscribe(struct Client *client, uint32_t request_id,
+                     const char *key, const struct SubscribeOptions *options) {
+    const char *const keys[] = {key};
+    if (kvs_subscribe(1, keys, &client->notifier, options->mode,
+                      options->window_ms, NULL)) {
+        printf("[DEBUG] Successfully subscribed to key: %s\n", key);
+        return write_response(client, OP_CODE_SUBSCRIBE, request_id, 1);
+    }
+    fprintf(stderr, "[ERROR] Subscribe: KVS subscription failed for key: %s\n",
+            key);
+    return write_response(client, OP_CODE_SUBSCRIBE, request_id, 0);
+}
+
+int handle_unsubscribe(struct Client *client, uint32_t request_id,
+                       const char *key) {
+    const char *const keys[] = {key};
+    if (kvs_unsubscribe(1, keys, &client->notifier, NULL)) {
         printf("[DEBUG] Successfully unsubscribed from key: %s\n", key);
-        printf("[DEBUG] Removed notification pipe: %s\n", client->notif_pipe);
-        write_response(client->resp_pipe, OP_CODE_UNSUBSCRIBE, 0);
-    } else {
-        fprintf(stderr, "[ERROR] Unsubscribe: KVS unsubscription failed for key: %s\n", key);
-        write_response(client->resp_pipe, OP_CODE_UNSUBSCRIBE, 1);
+        return write_response(client, OP_CODE_UNSUBSCRIBE, request_id, 0);
     }
+    fprintf(stderr,
+            "[ERROR] Unsubscribe: KVS unsubscription failed for key: %s\n",
+            key);
+    return write_response(client, OP_CODE_UNSUBSCRIBE, request_id, 1);
+}
 
-    printf("[DEBUG] Unsubscribe operation completed for key: %s\n", key);
-    close(fd_resp);
-    return 0;
-}
\ No newline at end of file
+int handle_pattern(struct Client *client, uint32_t request_id, char opcode,
+                   const char *pattern,
+                   const struct SubscribeOptions *options) {
+    if (!patterns_valid(pattern)) {
+        return write_response(client, opcode, request_id,
+                              FRAME_STATUS_BAD_REQUEST);
+    }
+    if (opcode == OP_CODE_PSUBSCRIBE) {
+        int added = kvs_psubscribe(pattern, &client->notifier, options->mode,
+                                   options->window_ms);
+        return write_response(client, opcode, request_id, added);
+    }
+    int removed = kvs_punsubscribe(pattern, &client->notifier);
+    return write_response(client, opcode, request_id, !removed);
+}
+
+int handle_cdc(struct Client *client, uint32_t request_id,
+               const char *payload, size_t len) {
+    uint64_t from;
+    if (client->version < PROTOCOL_VERSION_3 || len != sizeof(from)) {
+        return write_response(client, OP_CODE_CDC, request_id,
+                              FRAME_STATUS_BAD_REQUEST);
+    }
+    memcpy(&from, payload, sizeof(from));
+
+    // The latest change is taken first: the stream may only go past it.
+    uint64_t last = cdc_last();
+    struct FrameHeader header = {
+        .length = sizeof(last),
+        .request_id = request_id,
+        .opcode = OP_CODE_CDC,
+        .flags = FRAME_FLAG_RESPONSE,
+        .status = (uint16_t)notify_stream(&client->notifier, from),
+    };
+    char response[sizeof(header) + sizeof(last)];
+    memcpy(response, &header, sizeof(header));
+    memcpy(response + sizeof(header), &last, sizeof(last));
+
+    pthread_mutex_lock(&client->write_lock);
+    int written = session_write(client, response, sizeof(response));
+    pthread_mutex_unlock(&client->write_lock);
+    return written == 1 ? 0 : 1;
+}
+
+int handle_subscribe_batch(struct Client *client, uint32_t request_id,
+                           char opcode, const char *payload, size_t len) {
+    struct SubscribeOptions options = {.mode = DELIVERY_EVERY};
+    // Key characters and lengths are never 0, so a 0 where the options
+    // would start can only be their marker.
+    size_t trailer = 1 + sizeof(options);
+    if (opcode == OP_CODE_MSUBSCRIBE && len > trailer &&
+        payload[len - trailer] == '\0') {
+        memcpy(&options, payload + len - sizeof(options), sizeof(options));
+        len -= trailer;
+        if (!options_valid(&options)) {
+            return write_response(client, opcode, request_id,
+                                  FRAME_STATUS_BAD_REQUEST);
+        }
+    }
+    char keys[DATA_MAX_KEYS][MAX_STRING_SIZE];
+    int count = read_strings(payload, len, keys, NULL);
+    if (count <= 0) {
+        return write_response(client, opcode, request_id,
+                              FRAME_STATUS_BAD_REQUEST);
+    }
+
+    const char *key_list[DATA_MAX_KEYS];
+    for (int i = 0; i < count; i++) {
+        key_list[i] = keys[i];
+    }
+    struct {
+        struct FrameHeader header;
+        unsigned char results[DATA_MAX_KEYS / 8];
+    } response = {
+        .header = {
+            .length = ((uint32_t)count + 7) / 8,
+            .request_id = request_id,
+            .opcode = (uint8_t)opcode,
+            .flags = FRAME_FLAG_RESPONSE,
+        },
+    };
+    size_t done;
+    if (opcode == OP_CODE_MSUBSCRIBE) {
+        done = kvs_subscribe((size_t)count, key_list, &client->notifier,
+                             options.mode, options.window_ms,
+                             response.results);
+    } else {
+        done = kvs_unsubscribe((size_t)count, key_list, &client->notifier,
+                               response.results);
+    }
+    response.header.status = (uint16_t)done;
+
+    pthread_mutex_lock(&client->write_lock);
+    int written = session_write(client, &response,
+                                sizeof(response.header) +
+                                    response.header.length);
+    pthread_mutex_unlock(&client->write_lock);
+    return written == 1 ? 0 : 1;
+}
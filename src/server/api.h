@@ -2,24 +2,203 @@
 #define API_H
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "../common/constants.h"
+#include "../common/protocol.h"
+#include "../common/ring.h"
+#include "notify.h"
+
+// Size of the connect request that follows the opcode on the registry FIFO.
+#define CONNECT_REQUEST_SIZE (3 * MAX_PIPE_PATH_LENGTH)
+
+// Request bytes buffered per session before the event loop stops reading
+// its FIFO and waits for a worker to catch up. Fits the largest frame.
+#define SESSION_INPUT_SIZE 4096
 
+// Version of a socket session whose connect request was not served yet.
+#define SESSION_VERSION_PENDING 0
+
+/// A client session. The session's FIFOs are opened once, when the client
+/// connects, and stay open until it disconnects or goes away.
 struct Client {
-    char req_pipe[40];
-    char resp_pipe[40];
-    char notif_pipe[40];
-    pthread_t thread;
+    char req_pipe[MAX_PIPE_PATH_LENGTH + 1];
+    char resp_pipe[MAX_PIPE_PATH_LENGTH + 1];
+    char notif_pipe[MAX_PIPE_PATH_LENGTH + 1];
+    int req_fd;
+    int resp_fd;
+    struct Subscriber notifier; // Owns the notification FIFO once open.
+    size_t slot; // Index in the session table.
     int active;
+    int version; // Protocol version negotiated at connect.
+    // Connected over a Unix socket: req_fd is also resp_fd, and the session
+    // has no paths.
+    int socket;
+    // Shared-memory rings of a socket session that asked for them, NULL
+    // otherwise, and the doorbells of its requests and responses, -1
+    // without. Set under lock.
+    struct RingPair *shm;
+    int server_bell; // Watched by the loop instead of req_fd.
+    int client_bell;
+
+    // Responses of version 2 requests served at once must not interleave.
+    pthread_mutex_t write_lock;
+    // Responses the client did not take yet, written by the event loop once
+    // it does: workers never wait for a client. Guarded by write_lock. The
+    // buffer is kept for the sessions that take the slot.
+    char *output;
+    size_t output_len;
+    size_t output_cap;
+    int output_registered; // resp_fd was added to the loop's output watch.
+
+    // Requests read by the event loop and not yet served, and the state of
+    // the session in the loop. Guarded by lock.
+    pthread_mutex_t lock;
+    char input[SESSION_INPUT_SIZE];
+    size_t input_start;
+    size_t input_len;
+    int queued; // Some worker is, or is queued to be, taking its requests.
+    size_t in_flight; // Requests taken by workers and not finished yet.
+    int paused; // Input full: the FIFO is not watched until it drains.
+    int eof;    // The client closed the request FIFO. Nothing more is read.
+    int watched; // The FIFO is watched, or an I/O thread is reading it.
+    int hung_up; // The socket of a session in shared memory hung up: the
+                 // client is gone once its requests ring is read.
+    int writing; // Responses are queued: no request is taken until they
+                 // are written.
+    struct Client *next_queued;
+
+    // Set once the session disconnected or broke the protocol. Later
+    // requests are dropped. Guarded by lock, except while a barrier runs.
+    int done;
 };
 
-extern struct Client g_client;  // Single client instance
-extern pthread_mutex_t clients_mutex;
+/// Starts a session for a connect request read from the registry FIFO, or
+/// turns the client away if every session is taken. The client must have
+/// opened its response and notification FIFOs for reading before sending
+/// the request, so that opening them never blocks.
+/// @param paths Request, response and notification FIFO paths, each
+/// MAX_PIPE_PATH_LENGTH bytes and padded with '\0'.
+/// @param version Highest protocol version the client speaks.
+/// @return 0 if a session was started, 1 otherwise.
+int handle_connection(const char *paths, int version);
+
+/// Starts a session for a client that connected to the Unix socket, or
+/// turns it away if every session is taken. The session speaks
+/// SESSION_VERSION_PENDING until its connect request is served.
+/// @param fd The connection, blocking.
+/// @return 0 if a session was started, 1 otherwise.
+int handle_socket_connection(int fd);
+
+/// Lets socket clients ask for their requests, responses and notifications
+/// to go through shared memory.
+void api_offer_shm(void);
+
+/// Checks whether a complete request is at the start of a session's input.
+/// @param version Protocol version of the session.
+/// @param input Buffered request bytes.
+/// @param len Number of buffered bytes.
+/// @param size Set to the size of the request if it is complete.
+/// @return 0 if a request is complete, 1 if more bytes are needed, -1 if the
+/// input cannot be framed.
+int parse_request(int version, const char *input, size_t len, size_t *size);
+
+/// Whether a request must run alone: no other request of the session may be
+/// in flight while it runs, and none starts before it finishes. Version 1
+/// requests always do; version 2 requests only if they end the session.
+/// @param client Session the request came from.
+/// @param request Request checked by parse_request.
+/// @return 1 if it runs alone, 0 if it may overlap others.
+int request_is_barrier(const struct Client *client, const char *request);
+
+/// Serves a complete request. Called by a worker, possibly at the same time
+/// as other requests of the session if neither is a barrier.
+/// @param client Session the request came from.
+/// @param request Request checked by parse_request.
+void serve_request(struct Client *client, const char *request);
+
+/// Writes the responses queued while the client did not take them, as many
+/// as it takes now. Called with the session's write lock held.
+/// @param client Session to write to.
+/// @return 1 if some are still queued, 0 otherwise. Responses to a client
+/// that is gone are dropped.
+int session_flush(struct Client *client);
+
+/// Ends a session the client is gone from: drops its subscriptions, closes
+/// its FIFOs and releases it.
+/// @param client Session to close. Must not be watched by the loop any more.
+void close_session(struct Client *client);
+
+/// Acknowledges a disconnect request and drops the session's subscriptions.
+/// The session is closed once the client closes its request FIFO.
+/// @param client Session to end.
+/// @param request_id Id of the request, for version 2 sessions.
+/// @return 0 if the acknowledgement was sent, 1 otherwise.
+int client_disconnect(struct Client *client, uint32_t request_id);
+
+/// Subscribes the session to a key.
+/// @param client Session the request came from.
+/// @param request_id Id of the request, for version 2 sessions.
+/// @param key Key to subscribe to.
+/// @param options How changes of the key are delivered.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_subscribe(struct Client *client, uint32_t request_id,
+                     const char *key, const struct SubscribeOptions *options);
+
+/// Unsubscribes the session from a key.
+/// @param client Session the request came from.
+/// @param request_id Id of the request, for version 2 sessions.
+/// @param key Key to unsubscribe from.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_unsubscribe(struct Client *client, uint32_t request_id,
+                       const char *key);
+
+/// Subscribes the session to, or unsubscribes it from, a pattern, answering
+/// as for a key.
+/// @param client Session the request came from.
+/// @param request_id Id of the request.
+/// @param opcode OP_CODE_PSUBSCRIBE or OP_CODE_PUNSUBSCRIBE.
+/// @param pattern Pattern, as patterns.h describes it.
+/// @param options How changes are delivered, for PSUBSCRIBE.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_pattern(struct Client *client, uint32_t request_id, char opcode,
+                   const char *pattern,
+                   const struct SubscribeOptions *options);
+
+/// Subscribes the session to, or unsubscribes it from, every key of a
+/// request at once, and sends back which keys succeeded.
+/// @param client Session the request came from.
+/// @param request_id Id of the request.
+/// @param opcode OP_CODE_MSUBSCRIBE or OP_CODE_MUNSUBSCRIBE.
+/// @param payload Keys, and options for MSUBSCRIBE, as protocol.h
+/// describes them.
+/// @param len Length of the payload.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_subscribe_batch(struct Client *client, uint32_t request_id,
+                           char opcode, const char *payload, size_t len);
+
+/// Streams the change log to the session's notification pipe, and sends
+/// back the latest change made so far.
+/// @param client Session the request came from.
+/// @param request_id Id of the request.
+/// @param payload Sequence number to stream from, as protocol.h describes
+/// it.
+/// @param len Length of the payload.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_cdc(struct Client *client, uint32_t request_id,
+               const char *payload, size_t len);
 
-int handle_connection(int fd_server);
-void *client_handler(void *arg);
-int client_disconnect(struct Client *client);
-int handle_disconnect(const char *name);
-int handle_subscribe(int fd_req, struct Client *client);
-int handle_unsubscribe(int fd_req, struct Client *client);
+/// Serves a GET, PUT, DEL or MGET request of a version 2 session through
+/// the engine, and sends the output the engine formats as the payload of
+/// the response.
+/// @param client Session the request came from.
+/// @param request_id Id of the request.
+/// @param opcode One of the data opcodes.
+/// @param payload Keys, or pairs for PUT, as protocol.h describes them.
+/// @param len Length of the payload.
+/// @return 0 if the response was sent, 1 otherwise.
+int handle_data(struct Client *client, uint32_t request_id, char opcode,
+                const char *payload, size_t len);
 
-#endif // API_H
\ No newline at end of file
+#endif // API_H
@@ -0,0 +1,319 @@
+#include "cdc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Segment files are named after their first sequence number, zero-padded
+// so that they sort in order.
+#define SEGMENT_NAME "%020" PRIu64 ".cdc"
+#define SEGMENT_NAME_LENGTH (20 + sizeof(".cdc") - 1)
+
+static pthread_mutex_t cdc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The change of sequence number seq is at ring[seq % ring_capacity], for
+// seq from ring_first to last.
+static struct Notification *ring;
+static size_t ring_capacity;
+static uint64_t ring_first = 1;
+static uint64_t last;
+
+// Segments on disk, by their first sequence number, oldest first. The last
+// one is open for appending, and holds changes up to spilled.
+static char *segment_dir;
+static uint64_t *segments;
+static size_t num_segments;
+static size_t max_segments;
+static int segment_fd = -1;
+static uint64_t spilled;
+
+// Path of a segment.
+static void segment_path(uint64_t first, char *path, size_t size) {
+  snprintf(path, size, "%s/" SEGMENT_NAME, segment_dir, first);
+}
+
+static int compare_seq(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Removes the oldest segments past the limit. Called with the lock held.
+static void retire_segments(void) {
+  while (num_segments > max_segments) {
+    char path[PATH_MAX];
+    segment_path(segments[0], path, sizeof(path));
+    if (unlink(path) == -1) {
+      perror("Failed to remove change log segment");
+    }
+    memmove(segments, segments + 1, --num_segments * sizeof(*segments));
+  }
+}
+
+// Starts a segment for the changes after spilled. Called with the lock
+// held.
+// @return 0 on success, 1 otherwise.
+static int open_segment(void) {
+  uint64_t *grown = realloc(segments, (num_segments + 1) * sizeof(*grown));
+  if (grown == NULL) {
+    return 1;
+  }
+  segments = grown;
+
+  char path[PATH_MAX];
+  segment_path(spilled + 1, path, sizeof(path));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                0666);
+  if (fd == -1) {
+    perror("Failed to create change log segment");
+    return 1;
+  }
+  if (segment_fd != -1) {
+    close(segment_fd);
+  }
+  segment_fd = fd;
+  segments[num_segments++] = spilled + 1;
+  retire_segments();
+  return 0;
+}
+
+// Finds the segments left in the directory by an earlier server, and opens
+// the last one to go on from its last change.
+// @return 0 on success, 1 otherwise.
+static int load_segments(void) {
+  if (mkdir(segment_dir, 0777) == -1 && errno != EEXIST) {
+    perror("Failed to create change log directory");
+    return 1;
+  }
+  DIR *dir = opendir(segment_dir);
+  if (dir == NULL) {
+    perror("Failed to open change log directory");
+    return 1;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char *end;
+    uint64_t first = strtoull(entry->d_name, &end, 10);
+    if (strlen(entry->d_name) != SEGMENT_NAME_LENGTH ||
+        strcmp(end, ".cdc") != 0 || first == 0) {
+      continue;
+    }
+    uint64_t *grown = realloc(segments, (num_segments + 1) * sizeof(*grown));
+    if (grown == NULL) {
+      closedir(dir);
+      return 1;
+    }
+    segments = grown;
+    segments[num_segments++] = first;
+  }
+  closedir(dir);
+  if (num_segments == 0) {
+    return 0;
+  }
+  qsort(segments, num_segments, sizeof(*segments), compare_seq);
+
+  // A change cut short when the last server stopped is dropped.
+  char path[PATH_MAX];
+  uint64_t first = segments[num_segments - 1];
+  segment_path(first, path, sizeof(path));
+  segment_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  struct stat st;
+  if (segment_fd == -1 || fstat(segment_fd, &st) == -1) {
+    perror("Failed to open change log segment");
+    return 1;
+  }
+  uint64_t records = (uint64_t)st.st_size / sizeof(struct Notification);
+  if (ftruncate(segment_fd,
+                (off_t)(records * sizeof(struct Notification))) == -1) {
+    perror("Failed to truncate change log segment");
+    return 1;
+  }
+  close(segment_fd);
+  segment_fd = -1;
+  // Left empty by a server that wrote nothing: it only holds the numbers.
+  if (records == 0 && unlink(path) == 0) {
+    num_segments--;
+  }
+  // The last server may have numbered changes it did not write: numbers
+  // start again a batch further, in a segment of their own, so that none
+  // is used twice, even if this server stops before writing any.
+  last = spilled = first + records - 1 + CDC_SPILL_BATCH;
+  ring_first = last + 1;
+  return open_segment();
+}
+
+// Writes the changes after spilled to the last segment, starting new ones
+// as they fill up. Called with the lock held. On failure, the log goes on
+// in memory only.
+static void spill(void) {
+  while (spilled < last) {
+    uint64_t in_segment = num_segments > 0 && segment_fd != -1
+                              ? spilled + 1 - segments[num_segments - 1]
+                              : CDC_SEGMENT_RECORDS;
+    if (in_segment == CDC_SEGMENT_RECORDS && open_segment() != 0) {
+      break;
+    }
+    if (in_segment == CDC_SEGMENT_RECORDS) {
+      in_segment = 0;
+    }
+    // As much as the segment takes, and the ring holds without wrapping.
+    size_t start = (size_t)((spilled + 1) % ring_capacity);
+    size_t count = (size_t)(last - spilled);
+    if (count > CDC_SEGMENT_RECORDS - in_segment) {
+      count = (size_t)(CDC_SEGMENT_RECORDS - in_segment);
+    }
+    if (count > ring_capacity - start) {
+      count = ring_capacity - start;
+    }
+    size_t size = count * sizeof(*ring);
+    if (write(segment_fd, ring + start, size) != (ssize_t)size) {
+      perror("Failed to write change log segment");
+      break;
+    }
+    spilled += count;
+  }
+
+  // The segments are left alone, but no longer read: changes after them
+  // would be missing.
+  if (spilled < last) {
+    fprintf(stderr, "[ERROR] Change log kept in memory only from change "
+                    "%" PRIu64 " on\n", spilled + 1);
+    free(segment_dir);
+    segment_dir = NULL;
+    num_segments = 0;
+  }
+}
+
+int cdc_start(const char *dir, size_t capacity, size_t max) {
+  if (capacity < CDC_SPILL_BATCH || max == 0) {
+    return 1;
+  }
+  ring = malloc(capacity * sizeof(*ring));
+  if (ring == NULL) {
+    return 1;
+  }
+  ring_capacity = capacity;
+  max_segments = max;
+  if (dir != NULL) {
+    segment_dir = strdup(dir);
+    if (segment_dir == NULL || load_segments() != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+uint64_t cdc_last(void) {
+  pthread_mutex_lock(&cdc_lock);
+  uint64_t seq = last;
+  pthread_mutex_unlock(&cdc_lock);
+  return seq;
+}
+
+void cdc_append(const struct Notification *change) {
+  pthread_mutex_lock(&cdc_lock);
+  ring[change->seq % ring_capacity] = *change;
+  last = change->seq;
+  if (last - ring_first == ring_capacity) {
+    ring_first++;
+  }
+  // Changes are only dropped from the ring once on disk: the ring holds at
+  // least a batch of them.
+  if (segment_dir != NULL && last - spilled >= CDC_SPILL_BATCH) {
+    spill();
+  }
+  pthread_mutex_unlock(&cdc_lock);
+}
+
+// Reads changes from the segment that holds one, past the ring. Called
+// with the lock held, which is let go while reading.
+// @param from Sequence number of the first change. Moved past the segment
+// if it has none from there: it was removed, or a server stopped before
+// filling it.
+// @return Number of changes read.
+static size_t read_segment(uint64_t *from, struct Notification changes[],
+                           size_t max) {
+  size_t i = num_segments;
+  while (i > 1 && segments[i - 1] > *from) {
+    i--;
+  }
+  uint64_t first = segments[i - 1];
+  // Changes from the ring on may not be on disk yet.
+  uint64_t end = i < num_segments ? segments[i] : ring_first;
+  if (end > ring_first) {
+    end = ring_first;
+  }
+  if ((uint64_t)max > end - *from) {
+    max = (size_t)(end - *from);
+  }
+
+  char path[PATH_MAX];
+  segment_path(first, path, sizeof(path));
+  pthread_mutex_unlock(&cdc_lock);
+  ssize_t got = -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    got = pread(fd, changes, max * sizeof(*changes),
+                (off_t)((*from - first) * sizeof(*changes)));
+    close(fd);
+  }
+  if (got == -1 && errno != ENOENT) {
+    perror("Failed to read change log segment");
+  }
+  pthread_mutex_lock(&cdc_lock);
+  if (got < (ssize_t)sizeof(*changes)) {
+    *from = end;
+    return 0;
+  }
+  return (size_t)got / sizeof(*changes);
+}
+
+size_t cdc_read(uint64_t from, struct Notification changes[], size_t max) {
+  pthread_mutex_lock(&cdc_lock);
+  size_t count = 0;
+  while (count == 0 && max > 0) {
+    uint64_t oldest = num_segments > 0 ? segments[0] : ring_first;
+    if (from < oldest) {
+      from = oldest;
+    }
+    if (from > last) {
+      break;
+    }
+    if (from >= ring_first) {
+      count = (size_t)(last - from + 1);
+      if (count > max) {
+        count = max;
+      }
+      for (size_t i = 0; i < count; i++) {
+        changes[i] = ring[(from + i) % ring_capacity];
+      }
+    } else {
+      count = read_segment(&from, changes, max);
+    }
+  }
+  pthread_mutex_unlock(&cdc_lock);
+  return count;
+}
+
+void cdc_stop(void) {
+  pthread_mutex_lock(&cdc_lock);
+  if (segment_dir != NULL) {
+    spill();
+  }
+  if (segment_fd != -1) {
+    close(segment_fd);
+    segment_fd = -1;
+  }
+  free(segment_dir);
+  segment_dir = NULL;
+  num_segments = 0;
+  pthread_mutex_unlock(&cdc_lock);
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_CDC_H
+#define KVS_CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "notify.h"
+
+#define CDC_DEFAULT_RING 16384
+#define CDC_DEFAULT_SEGMENTS 16
+
+// Changes per segment file.
+#define CDC_SEGMENT_RECORDS 65536
+
+// Changes written to the current segment at a time: the latest ones are
+// only in memory until there are this many of them.
+#define CDC_SPILL_BATCH 64
+
+/// The change log: every change the server makes, in the order of its
+/// sequence number, for consumers to stream from any point on. The latest
+/// changes are kept in a ring in memory. With a directory, they are also
+/// written to segment files in it, CDC_SEGMENT_RECORDS each, named after
+/// the sequence number of their first change. The oldest segments are
+/// removed past a limit, and a restarted server numbers its changes after
+/// the last one on disk.
+///
+/// Changes are appended with the table lock held for writing, and read by
+/// the notification dispatchers without it: the log has a lock of its own,
+/// which is never held while reading a segment.
+
+/// Starts the log. Must be called before any change is appended.
+/// @param dir Directory of the segments, created if missing, or NULL to
+/// only keep the ring.
+/// @param capacity Changes kept in memory, at least CDC_SPILL_BATCH.
+/// @param max Segments kept on disk, at least 1.
+/// @return 0 if the log was started, 1 otherwise.
+int cdc_start(const char *dir, size_t capacity, size_t max);
+
+/// Sequence number of the latest change in the log.
+/// @return It, or 0 if there is none yet.
+uint64_t cdc_last(void);
+
+/// Appends a change, whose sequence number must follow the latest one.
+/// @param change Change to append.
+void cdc_append(const struct Notification *change);
+
+/// Reads changes from the log, in order.
+/// @param from Sequence number of the first change to read. Changes no
+/// longer kept are skipped: reading starts at the oldest one then.
+/// @param changes Where to copy the changes.
+/// @param max Most changes to read.
+/// @return Number of changes read, 0 if there is none from there on.
+size_t cdc_read(uint64_t from, struct Notification changes[], size_t max);
+
+/// Writes the changes still only in memory to disk, and stops writing any.
+/// The ring is kept for the streams still reading it.
+void cdc_stop(void);
+
+#endif // KVS_CDC_H
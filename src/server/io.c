@@ -1,5 +1,8 @@
+#include "io.h"
+
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -43,3 +46,68 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+int out_buffer_init(struct OutBuffer *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+  out->capacity = OUT_BUFFER_FLUSH_SIZE;
+  out->data = malloc(out->capacity);
+  return out->data == NULL;
+}
+
+void out_buffer_destroy(struct OutBuffer *out) {
+  out_buffer_flush(out);
+  free(out->data);
+  out->data = NULL;
+}
+
+static void out_buffer_write(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+
+    if (written < 0) {
+      perror("Error writing string");
+      break;
+    }
+
+    data += written;
+    len -= (size_t)written;
+  }
+}
+
+void out_buffer_str(struct OutBuffer *out, const char *str) {
+  out_buffer_append(out, str, strlen(str));
+}
+
+void out_buffer_append(struct OutBuffer *out, const void *data, size_t len) {
+  if (out->len + len > out->capacity) {
+    size_t capacity = out->capacity * 2;
+    while (out->len + len > capacity) {
+      capacity *= 2;
+    }
+
+    char *grown = realloc(out->data, capacity);
+    if (grown == NULL) {
+      // Out of memory: fall back to writing straight through.
+      out_buffer_flush(out);
+      out_buffer_write(out->fd, data, len);
+      return;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+  }
+
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+void out_buffer_flush(struct OutBuffer *out) {
+  out_buffer_write(out->fd, out->data, out->len);
+  out->len = 0;
+}
+
+void out_buffer_flush_full(struct OutBuffer *out) {
+  if (out->len >= OUT_BUFFER_FLUSH_SIZE) {
+    out_buffer_flush(out);
+  }
+}
@@ -20,4 +20,46 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+// Buffered output is written out once this many bytes are pending.
+#define OUT_BUFFER_FLUSH_SIZE 65536
+
+/// In-memory output of a job. Operations format into it while holding the
+/// table lock, and it is only written to the file descriptor afterwards.
+struct OutBuffer {
+  int fd;
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+/// Initializes an output buffer over the given file descriptor.
+/// @param out Output buffer to initialize.
+/// @param fd The file descriptor it writes to.
+/// @return 0 if the buffer was initialized successfully, 1 otherwise.
+int out_buffer_init(struct OutBuffer *out, int fd);
+
+/// Flushes and frees an output buffer. Does not close its file descriptor.
+/// @param out Output buffer to destroy.
+void out_buffer_destroy(struct OutBuffer *out);
+
+/// Appends a string to the buffer, growing it as needed. Never writes to the
+/// file descriptor, so it is safe to call with the table lock held.
+/// @param out Output buffer to append to.
+/// @param str The string to append.
+void out_buffer_str(struct OutBuffer *out, const char *str);
+
+/// Appends raw bytes to the buffer, growing it as needed.
+/// @param out Output buffer to append to.
+/// @param data The bytes to append.
+/// @param len Number of bytes to append.
+void out_buffer_append(struct OutBuffer *out, const void *data, size_t len);
+
+/// Writes everything pending to the file descriptor.
+/// @param out Output buffer to flush.
+void out_buffer_flush(struct OutBuffer *out);
+
+/// Flushes the buffer if at least OUT_BUFFER_FLUSH_SIZE bytes are pending.
+/// @param out Output buffer to flush.
+void out_buffer_flush_full(struct OutBuffer *out);
+
 #endif // KVS_IO_H
@@ -0,0 +1,65 @@
+#include "job.h"
+
+#include "jobc.h"
+
+void job_source_text(struct JobSource *src, struct Reader *reader) {
+  src->reader = reader;
+  src->code = NULL;
+  src->code_len = 0;
+  src->pc = 0;
+}
+
+void job_source_compiled(struct JobSource *src, const unsigned char *code,
+                         size_t code_len) {
+  src->reader = NULL;
+  src->code = code;
+  src->code_len = code_len;
+  src->pc = 0;
+}
+
+// Parses the next command from the text of a job.
+static enum Command next_text(struct Reader *reader,
+                              struct JobCommand *command) {
+  command->num_pairs = 0;
+  command->delay = 0;
+
+  switch (command->cmd = get_next(reader)) {
+  case CMD_WRITE:
+    command->num_pairs =
+        parse_write(reader, command->keys, command->values, MAX_WRITE_SIZE,
+                    MAX_STRING_SIZE);
+    break;
+
+  case CMD_READ:
+  case CMD_DELETE:
+    command->num_pairs = parse_read_delete(reader, command->keys,
+                                           MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    break;
+
+  case CMD_WAIT:
+    if (parse_wait(reader, &command->delay, NULL) == -1) {
+      command->cmd = CMD_INVALID;
+    }
+    return command->cmd;
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    return command->cmd;
+  }
+
+  if (command->num_pairs == 0) {
+    command->cmd = CMD_INVALID;
+  }
+  return command->cmd;
+}
+
+enum Command job_next(struct JobSource *src, struct JobCommand *command) {
+  if (src->reader != NULL) {
+    return next_text(src->reader, command);
+  }
+  return jobc_next(src, command);
+}
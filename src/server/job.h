@@ -0,0 +1,49 @@
+#ifndef KVS_JOB_H
+#define KVS_JOB_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "reader.h"
+
+/// One command of a job, with its arguments already decoded. The key and
+/// value arrays are supplied by the caller and filled in by job_next.
+struct JobCommand {
+  enum Command cmd;
+  size_t num_pairs;
+  unsigned int delay;
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE];
+};
+
+/// Where the commands of a job come from: the text of a .job file, or the
+/// records of its compiled .jobc form.
+struct JobSource {
+  struct Reader *reader; // NULL for a compiled job.
+  const unsigned char *code;
+  size_t code_len;
+  size_t pc;
+};
+
+/// Reads commands from the text of a job.
+/// @param src Source to initialize.
+/// @param reader Reader over the .job file.
+void job_source_text(struct JobSource *src, struct Reader *reader);
+
+/// Reads commands from the records of a compiled job.
+/// @param src Source to initialize.
+/// @param code Records, as returned by jobc_load.
+/// @param code_len Size of the records in bytes.
+void job_source_compiled(struct JobSource *src, const unsigned char *code,
+                         size_t code_len);
+
+/// Decodes the next command of a job. Commands whose arguments do not parse
+/// are returned as CMD_INVALID.
+/// @param src Source to read from.
+/// @param command Command to fill in. Its keys and values arrays must hold
+/// MAX_WRITE_SIZE strings.
+/// @return The command code, EOC at the end of the job.
+enum Command job_next(struct JobSource *src, struct JobCommand *command);
+
+#endif // KVS_JOB_H
@@ -0,0 +1,385 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "io.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Hashes the whole contents of a file, leaving its offset at the end.
+// @param fd File descriptor to hash, at its start.
+// @param hash Pointer to store the hash in.
+// @return 0 if the file was read successfully, 1 otherwise.
+static int hash_fd(int fd, uint64_t *hash) {
+  char buffer[READER_WINDOW_SIZE];
+  uint64_t h = FNV_OFFSET_BASIS;
+  ssize_t len;
+
+  while ((len = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (len < 0) {
+      return 1;
+    }
+    for (ssize_t i = 0; i < len; i++) {
+      h = (h ^ (unsigned char)buffer[i]) * FNV_PRIME;
+    }
+  }
+
+  *hash = h;
+  return 0;
+}
+
+static void put_string(struct OutBuffer *out, const char *str) {
+  unsigned char len = (unsigned char)strnlen(str, MAX_STRING_SIZE - 1);
+  out_buffer_append(out, &len, sizeof(len));
+  out_buffer_append(out, str, len);
+}
+
+int jobc_compile(int in_fd, int out_fd, const struct stat *source_st) {
+  struct JobcHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, JOBC_MAGIC, sizeof(header.magic));
+  header.version = JOBC_VERSION;
+  header.source_mtime_sec = (int64_t)source_st->st_mtim.tv_sec;
+  header.source_mtime_nsec = (uint32_t)source_st->st_mtim.tv_nsec;
+  header.source_size = (uint64_t)source_st->st_size;
+
+  if (hash_fd(in_fd, &header.source_hash) ||
+      lseek(in_fd, 0, SEEK_SET) == -1) {
+    return 1;
+  }
+
+  struct Reader reader;
+  struct OutBuffer out;
+  char(*keys)[MAX_STRING_SIZE] = malloc(2 * MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (keys == NULL) {
+    return 1;
+  }
+  if (reader_init(&reader, in_fd)) {
+    free(keys);
+    return 1;
+  }
+  if (out_buffer_init(&out, out_fd)) {
+    reader_destroy(&reader);
+    free(keys);
+    return 1;
+  }
+
+  struct JobSource src;
+  struct JobCommand command = {.keys = keys, .values = keys + MAX_WRITE_SIZE};
+  job_source_text(&src, &reader);
+  out_buffer_append(&out, &header, sizeof(header));
+
+  enum Command cmd;
+  while ((cmd = job_next(&src, &command)) != EOC) {
+    if (cmd == CMD_EMPTY) {
+      continue;
+    }
+
+    unsigned char op = (unsigned char)cmd;
+    out_buffer_append(&out, &op, sizeof(op));
+
+    if (cmd == CMD_WAIT) {
+      uint32_t delay = command.delay;
+      out_buffer_append(&out, &delay, sizeof(delay));
+    } else if (cmd == CMD_WRITE || cmd == CMD_READ || cmd == CMD_DELETE) {
+      uint16_t count = (uint16_t)command.num_pairs;
+      out_buffer_append(&out, &count, sizeof(count));
+      for (size_t i = 0; i < command.num_pairs; i++) {
+        put_string(&out, command.keys[i]);
+        if (cmd == CMD_WRITE) {
+          put_string(&out, command.values[i]);
+        }
+      }
+    }
+
+    out_buffer_flush_full(&out);
+  }
+
+  unsigned char op = EOC;
+  out_buffer_append(&out, &op, sizeof(op));
+  out_buffer_destroy(&out);
+  reader_destroy(&reader);
+  free(keys);
+
+  // The size of the records is only known now: fill it in last, so a file
+  // cut short at any point fails the check in map_jobc.
+  off_t end = lseek(out_fd, 0, SEEK_CUR);
+  if (end < (off_t)sizeof(header)) {
+    return 1;
+  }
+  header.code_size = (uint64_t)end - sizeof(header);
+  return pwrite(out_fd, &header, sizeof(header), 0) !=
+         (ssize_t)sizeof(header);
+}
+
+// Copies a length-prefixed string out of a compiled job.
+// @return 0 if the string fits in the job and in dest, 1 otherwise.
+static int get_string(struct JobSource *src, char *dest) {
+  if (src->pc >= src->code_len) {
+    return 1;
+  }
+
+  size_t len = src->code[src->pc++];
+  if (len >= MAX_STRING_SIZE || len > src->code_len - src->pc) {
+    return 1;
+  }
+
+  memcpy(dest, src->code + src->pc, len);
+  dest[len] = '\0';
+  src->pc += len;
+  return 0;
+}
+
+enum Command jobc_next(struct JobSource *src, struct JobCommand *command) {
+  command->num_pairs = 0;
+  command->delay = 0;
+
+  if (src->pc >= src->code_len) {
+    return command->cmd = EOC;
+  }
+
+  unsigned char op = src->code[src->pc++];
+  switch (op) {
+  case CMD_WRITE:
+  case CMD_READ:
+  case CMD_DELETE: {
+    uint16_t count;
+    if (src->code_len - src->pc < sizeof(count)) {
+      break;
+    }
+    memcpy(&count, src->code + src->pc, sizeof(count));
+    src->pc += sizeof(count);
+    if (count == 0 || count > MAX_WRITE_SIZE) {
+      break;
+    }
+
+    size_t i = 0;
+    for (; i < count; i++) {
+      if (get_string(src, command->keys[i]) ||
+          (op == CMD_WRITE && get_string(src, command->values[i]))) {
+        break;
+      }
+    }
+    if (i < count) {
+      break;
+    }
+
+    command->num_pairs = count;
+    return command->cmd = (enum Command)op;
+  }
+
+  case CMD_WAIT: {
+    uint32_t delay;
+    if (src->code_len - src->pc < sizeof(delay)) {
+      break;
+    }
+    memcpy(&delay, src->code + src->pc, sizeof(delay));
+    src->pc += sizeof(delay);
+    command->delay = delay;
+    return command->cmd = CMD_WAIT;
+  }
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_INVALID:
+    return command->cmd = (enum Command)op;
+
+  default:
+    break;
+  }
+
+  // Malformed or truncated record: stop the job here.
+  src->pc = src->code_len;
+  return command->cmd = EOC;
+}
+
+int jobc_decompile(const unsigned char *code, size_t code_len, int out_fd) {
+  struct OutBuffer out;
+  char(*keys)[MAX_STRING_SIZE] = malloc(2 * MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (keys == NULL) {
+    return 1;
+  }
+  if (out_buffer_init(&out, out_fd)) {
+    free(keys);
+    return 1;
+  }
+
+  static const char *names[] = {
+      [CMD_WRITE] = "WRITE",   [CMD_READ] = "READ",
+      [CMD_DELETE] = "DELETE", [CMD_SHOW] = "SHOW\n",
+      [CMD_WAIT] = "WAIT ",    [CMD_BACKUP] = "BACKUP\n",
+      [CMD_HELP] = "HELP\n",   [CMD_INVALID] = "INVALID\n",
+  };
+
+  struct JobSource src;
+  struct JobCommand command = {.keys = keys, .values = keys + MAX_WRITE_SIZE};
+  job_source_compiled(&src, code, code_len);
+
+  enum Command cmd;
+  size_t record = 0;
+  while ((cmd = jobc_next(&src, &command)) != EOC) {
+    record = src.pc;
+    out_buffer_str(&out, names[cmd]);
+
+    if (cmd == CMD_WAIT) {
+      char delay[16];
+      snprintf(delay, sizeof(delay), "%u\n", command.delay);
+      out_buffer_str(&out, delay);
+    } else if (cmd == CMD_WRITE || cmd == CMD_READ || cmd == CMD_DELETE) {
+      out_buffer_str(&out, " [");
+      for (size_t i = 0; i < command.num_pairs; i++) {
+        if (cmd == CMD_WRITE) {
+          out_buffer_str(&out, "(");
+          out_buffer_str(&out, command.keys[i]);
+          out_buffer_str(&out, ",");
+          out_buffer_str(&out, command.values[i]);
+          out_buffer_str(&out, ")");
+        } else {
+          out_buffer_str(&out, i == 0 ? "" : ",");
+          out_buffer_str(&out, command.keys[i]);
+        }
+      }
+      out_buffer_str(&out, "]\n");
+    }
+
+    out_buffer_flush_full(&out);
+  }
+
+  // A well formed job ends with a single EOC record.
+  int malformed = record + 1 != code_len || code[record] != EOC;
+  out_buffer_destroy(&out);
+  free(keys);
+  return malformed;
+}
+
+// Maps a .jobc file and checks its header.
+// @param fd File descriptor of the .jobc file.
+// @param job Compiled job to fill in.
+// @return 0 if the file was mapped successfully, 1 otherwise.
+static int map_jobc(int fd, struct CompiledJob *job) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      (size_t)st.st_size <= sizeof(struct JobcHeader)) {
+    return 1;
+  }
+
+  job->map_len = (size_t)st.st_size;
+  job->map = mmap(NULL, job->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (job->map == MAP_FAILED) {
+    job->map = NULL;
+    return 1;
+  }
+
+  const struct JobcHeader *header = job->map;
+  if (memcmp(header->magic, JOBC_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != JOBC_VERSION ||
+      header->code_size != job->map_len - sizeof(struct JobcHeader)) {
+    jobc_unload(job);
+    return 1;
+  }
+
+  job->code = (const unsigned char *)job->map + sizeof(struct JobcHeader);
+  job->code_len = job->map_len - sizeof(struct JobcHeader);
+  return 0;
+}
+
+int jobc_open(const char *jobc_path, struct CompiledJob *job) {
+  int fd = open(jobc_path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+
+  int failed = map_jobc(fd, job);
+  close(fd);
+  return failed;
+}
+
+// Checks whether a mapped .jobc was compiled from the current .job contents.
+// @param job Mapped compiled job.
+// @param job_fd File descriptor of the .job file, at its start.
+// @param job_st Status of the .job file.
+// @return 1 if the cache is up to date, 0 otherwise.
+static int jobc_is_fresh(const struct CompiledJob *job, int job_fd,
+                         const struct stat *job_st) {
+  const struct JobcHeader *header = job->map;
+  if (header->source_size != (uint64_t)job_st->st_size) {
+    return 0;
+  }
+  if (header->source_mtime_sec == (int64_t)job_st->st_mtim.tv_sec &&
+      header->source_mtime_nsec == (uint32_t)job_st->st_mtim.tv_nsec) {
+    return 1;
+  }
+
+  // Touched but maybe not changed, e.g. copied over with the same contents.
+  uint64_t hash;
+  int fresh = !hash_fd(job_fd, &hash) && hash == header->source_hash;
+  lseek(job_fd, 0, SEEK_SET);
+  return fresh;
+}
+
+int jobc_load(const char *job_path, struct CompiledJob *job) {
+  char jobc_path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  if (snprintf(jobc_path, sizeof(jobc_path), "%sc", job_path) >=
+          (int)sizeof(jobc_path) ||
+      snprintf(tmp_path, sizeof(tmp_path), "%sc.XXXXXX", job_path) >=
+          (int)sizeof(tmp_path)) {
+    return 1;
+  }
+
+  int job_fd = open(job_path, O_RDONLY);
+  struct stat job_st;
+  if (job_fd == -1) {
+    return 1;
+  }
+  if (fstat(job_fd, &job_st) == -1) {
+    close(job_fd);
+    return 1;
+  }
+
+  if (!jobc_open(jobc_path, job)) {
+    if (jobc_is_fresh(job, job_fd, &job_st)) {
+      close(job_fd);
+      return 0;
+    }
+    jobc_unload(job);
+  }
+
+  // Compile to a temporary file and rename it over the cache, so concurrent
+  // loads never map a half written .jobc.
+  int tmp_fd = mkstemp(tmp_path);
+  if (tmp_fd == -1 || fchmod(tmp_fd, 0644) == -1) {
+    if (tmp_fd != -1) {
+      close(tmp_fd);
+      unlink(tmp_path);
+    }
+    close(job_fd);
+    return 1;
+  }
+
+  int failed = jobc_compile(job_fd, tmp_fd, &job_st) ||
+               lseek(tmp_fd, 0, SEEK_SET) == -1 || map_jobc(tmp_fd, job);
+  if (failed || rename(tmp_path, jobc_path) == -1) {
+    // The compiled job stays usable even if the cache could not be updated.
+    unlink(tmp_path);
+  }
+
+  close(tmp_fd);
+  close(job_fd);
+  return failed;
+}
+
+void jobc_unload(struct CompiledJob *job) {
+  if (job->map != NULL) {
+    munmap(job->map, job->map_len);
+    job->map = NULL;
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "job.h"
+
+// A compiled job is a header followed by one record per command: a one byte
+// opcode (enum Command) and its arguments. WRITE, READ and DELETE carry a
+// 16-bit pair count and length-prefixed strings, WAIT a 32-bit delay. The
+// records end with EOC. Integers are stored in host byte order, since .jobc
+// files are a local cache kept next to their .job.
+#define JOBC_MAGIC "KVSJOBC"
+#define JOBC_VERSION 1
+
+struct JobcHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t source_mtime_nsec;
+  int64_t source_mtime_sec;
+  uint64_t source_size;
+  uint64_t source_hash; // FNV-1a of the .job contents.
+  uint64_t code_size;   // Size of the records, to catch truncated files.
+};
+
+/// A compiled job mapped into memory.
+struct CompiledJob {
+  void *map;
+  size_t map_len;
+  const unsigned char *code;
+  size_t code_len;
+};
+
+/// Compiles the text of a job.
+/// @param in_fd File descriptor of the .job file, at its start.
+/// @param out_fd File descriptor to write the .jobc to.
+/// @param source_st Status of the .job file, recorded in the header.
+/// @return 0 if the job was compiled successfully, 1 otherwise.
+int jobc_compile(int in_fd, int out_fd, const struct stat *source_st);
+
+/// Writes a compiled job back as text.
+/// @param code Records of the compiled job.
+/// @param code_len Size of the records in bytes.
+/// @param out_fd File descriptor to write the .job text to.
+/// @return 0 if every record was decoded, 1 if the records are malformed.
+int jobc_decompile(const unsigned char *code, size_t code_len, int out_fd);
+
+/// Maps a .jobc file, checking its header but not whether it is up to date.
+/// @param jobc_path Path of the .jobc file.
+/// @param job Compiled job to fill in.
+/// @return 0 if the file was mapped successfully, 1 otherwise.
+int jobc_open(const char *jobc_path, struct CompiledJob *job);
+
+/// Maps the compiled form of a job from its cache next to the .job file,
+/// compiling it first if the cache is missing or stale. The cache is stale
+/// when the size of the .job changed, or when its mtime changed and so did
+/// the hash of its contents.
+/// @param job_path Path of the .job file.
+/// @param job Compiled job to fill in.
+/// @return 0 if the job was loaded successfully, 1 otherwise.
+int jobc_load(const char *job_path, struct CompiledJob *job);
+
+/// Unmaps a compiled job.
+/// @param job Compiled job to unmap.
+void jobc_unload(struct CompiledJob *job);
+
+/// Decodes the next record of a compiled job. Used by job_next.
+/// @param src Compiled job source.
+/// @param command Command to fill in.
+/// @return The command code, EOC at the end or on a malformed record.
+enum Command jobc_next(struct JobSource *src, struct JobCommand *command);
+
+#endif // KVS_JOBC_H
@@ -0,0 +1,97 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "jobc.h"
+
+static void usage(const char *name) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " compile <in.job> [out.jobc]\n");
+  write_str(STDERR_FILENO, "       ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " decompile <in.jobc> [out.job]\n");
+}
+
+static int compile(const char *in_path, const char *out_path) {
+  char default_path[PATH_MAX];
+  if (out_path == NULL) {
+    snprintf(default_path, sizeof(default_path), "%sc", in_path);
+    out_path = default_path;
+  }
+
+  int in_fd = open(in_path, O_RDONLY);
+  struct stat st;
+  if (in_fd == -1 || fstat(in_fd, &st) == -1) {
+    fprintf(stderr, "Failed to open job: %s\n", in_path);
+    if (in_fd != -1) {
+      close(in_fd);
+    }
+    return 1;
+  }
+
+  int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd == -1) {
+    fprintf(stderr, "Failed to open output file: %s\n", out_path);
+    close(in_fd);
+    return 1;
+  }
+
+  int failed = jobc_compile(in_fd, out_fd, &st);
+  if (failed) {
+    fprintf(stderr, "Failed to compile job: %s\n", in_path);
+  }
+
+  close(out_fd);
+  close(in_fd);
+  return failed;
+}
+
+static int decompile(const char *in_path, const char *out_path) {
+  struct CompiledJob job;
+  if (jobc_open(in_path, &job)) {
+    fprintf(stderr, "Not a compiled job: %s\n", in_path);
+    return 1;
+  }
+
+  int out_fd = STDOUT_FILENO;
+  if (out_path != NULL &&
+      (out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+    fprintf(stderr, "Failed to open output file: %s\n", out_path);
+    jobc_unload(&job);
+    return 1;
+  }
+
+  int failed = jobc_decompile(job.code, job.code_len, out_fd);
+  if (failed) {
+    fprintf(stderr, "Malformed compiled job: %s\n", in_path);
+  }
+
+  if (out_fd != STDOUT_FILENO) {
+    close(out_fd);
+  }
+  jobc_unload(&job);
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *out_path = argc == 4 ? argv[3] : NULL;
+  if (strcmp(argv[1], "compile") == 0) {
+    return compile(argv[2], out_path);
+  }
+  if (strcmp(argv[1], "decompile") == 0) {
+    return decompile(argv[2], out_path);
+  }
+
+  usage(argv[0]);
+  return 1;
+}
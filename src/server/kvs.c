@@ -27,8 +27,10 @@ struct HashTable *create_hash_table() {
     return NULL;
   for (int i = 0; i < TABLE_SIZE; i++) {
     ht->table[i] = NULL;
+    ht->deletions[i] = 0;
   }
-  pthread_rwlock_init(&ht->tablelock, NULL);
+  ht->next_seq = 0;
+  qos_lock_init(&ht->tablelock);
   return ht;
 }
 
@@ -53,6 +55,9 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
   keyNode = malloc(sizeof(KeyNode));
   keyNode->key = strdup(key);       // Allocate memory for the key
   keyNode->value = strdup(value);   // Allocate memory for the value
+  keyNode->subscriptions = NULL;
+  keyNode->subscription_count = 0;
+  keyNode->seq = ht->next_seq++;
   keyNode->next = ht->table[index]; // Link to existing nodes
   ht->table[index] = keyNode; // Place new key node at the start of the list
   return 0;
@@ -100,8 +105,10 @@ int delete_pair(HashTable *ht, const char *key) {
       // Free the memory allocated for the key and value
       free(keyNode->key);
       free(keyNode->value);
+      free(keyNode->subscriptions);
       free(keyNode); // Free the key node itself
-      return 0;      // Exit the function
+      ht->deletions[index]++;
+      return 0; // Exit the function
     }
     prevNode = keyNode;      // Move prevNode to current node
     keyNode = keyNode->next; // Move to the next node
@@ -118,9 +125,10 @@ void free_table(HashTable *ht) {
       keyNode = keyNode->next;
       free(temp->key);
       free(temp->value);
+      free(temp->subscriptions);
       free(temp);
     }
   }
-  pthread_rwlock_destroy(&ht->tablelock);
+  qos_lock_destroy(&ht->tablelock);
   free(ht);
 }
@@ -5,17 +5,26 @@
 #include <pthread.h>
 #include <stddef.h>
 
+#include "notify.h"
+#include "qos.h"
+
 typedef struct KeyNode {
   char *key;
   char *value;
-  char **notif_pipe_paths;
-  size_t notif_pipe_count;
+  // Subscriptions of sessions to the key.
+  struct Subscription *subscriptions;
+  size_t subscription_count;
+  unsigned long seq; // Insertion order. Decreases along each list.
   struct KeyNode *next;
 } KeyNode;
 
 typedef struct HashTable {
   KeyNode *table[TABLE_SIZE];
-  pthread_rwlock_t tablelock;
+  struct QosLock tablelock;
+  unsigned long next_seq;
+  // Nodes freed from each list, so iterators that let go of the lock can
+  // tell whether the node they stopped at still exists.
+  unsigned long deletions[TABLE_SIZE];
 } HashTable;
 
 /// Creates a new KVS hash table.
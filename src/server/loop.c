@@ -0,0 +1,569 @@
+#include "loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/protocol.h"
+#include "qos.h"
+
+static int epoll_fd = -1;
+
+// The registry FIFO is opened for reading and writing, so it never reports
+// EOF between clients. Connect requests are buffered until complete. Only
+// the I/O thread holding its event touches them, but the lock makes that
+// handover explicit rather than implied by epoll.
+static int registry_fd = -1;
+static char registry_input[(2 + CONNECT_REQUEST_SIZE) * 16];
+static size_t registry_len = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Listening Unix socket, if clients may connect over one, and the send
+// buffer size set on its connections (0 keeps the system default).
+static int listen_fd = -1;
+static int socket_sndbuf = 0;
+
+// Sessions whose responses wait for room, watched through an epoll
+// instance of their own, itself watched by the I/O threads: a socket is
+// already in epoll_fd for its requests.
+static int output_fd = -1;
+
+// Tag the registry's, the socket's and the responses' epoll events. Sessions
+// are tagged with their address.
+static char registry_tag;
+static char listen_tag;
+static char output_tag;
+
+static pthread_t *io_threads = NULL;
+static size_t num_io_threads = 0;
+
+// Sessions with requests to serve, served in the order they were queued.
+static struct Client *queue_head = NULL;
+static struct Client *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Watches a descriptor for the next of some events. Every event is
+// one-shot, so no two threads ever handle the same FIFO at once.
+// @return 0 if the descriptor is watched, 1 otherwise.
+static int watch_events(int fd, void *tag, int op, uint32_t events) {
+  struct epoll_event event = {.events = events | EPOLLONESHOT,
+                              .data.ptr = tag};
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+    perror("Failed to watch pipe");
+    return 1;
+  }
+  return 0;
+}
+
+// Watches a descriptor for the next readable event.
+static int watch(int fd, void *tag, int op) {
+  return watch_events(fd, tag, op, EPOLLIN);
+}
+
+// Watches a session's requests again. Called with the session's lock held
+// by the only thread handling its requests. A session in shared memory is
+// woken by its doorbell once its ring was found empty: if requests came in
+// meanwhile, or the client hung up, ringing the doorbell itself brings the
+// loop straight back.
+static void rearm(struct Client *client) {
+  client->watched = 1;
+  if (client->shm != NULL) {
+    if (!ring_sleep(&client->shm->requests) || client->hung_up) {
+      ring_bell(client->server_bell);
+    }
+    watch(client->server_bell, client, EPOLL_CTL_MOD);
+    return;
+  }
+  watch(client->req_fd, client, EPOLL_CTL_MOD);
+}
+
+int loop_add_session(struct Client *client) {
+  client->watched = 1;
+  return watch(client->req_fd, client, EPOLL_CTL_ADD);
+}
+
+int loop_watch_doorbell(struct Client *client) {
+  // The doorbell is only armed once the session is watched again.
+  if (watch_events(client->server_bell, client, EPOLL_CTL_ADD, 0)) {
+    return 1;
+  }
+  if (watch_events(client->req_fd, client, EPOLL_CTL_MOD, EPOLLRDHUP)) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->server_bell, NULL);
+    return 1;
+  }
+  return 0;
+}
+
+// Watches a session's responses for room, unless they are in shared memory:
+// the client rings the session's doorbell once it made room in the ring.
+// Called with the session's lock held, and its write lock unless the
+// responses are in shared memory.
+static void watch_output(struct Client *client) {
+  if (client->shm != NULL) {
+    // A paused session must still be watched for the doorbell.
+    if (client->paused && !client->watched && !client->eof) {
+      client->watched = 1;
+      watch(client->server_bell, client, EPOLL_CTL_MOD);
+    }
+    return;
+  }
+  struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT,
+                              .data.ptr = client};
+  int op = client->output_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(output_fd, op, client->resp_fd, &event) == -1) {
+    perror("Failed to watch response pipe");
+    return;
+  }
+  client->output_registered = 1;
+}
+
+void loop_watch_output(struct Client *client) {
+  pthread_mutex_lock(&client->lock);
+  client->writing = 1;
+  watch_output(client);
+  pthread_mutex_unlock(&client->lock);
+}
+
+// Hands a session to the workers. Called with the session's lock held.
+static void enqueue(struct Client *client) {
+  client->queued = 1;
+  client->next_queued = NULL;
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail == NULL) {
+    queue_head = client;
+  } else {
+    queue_tail->next_queued = client;
+  }
+  queue_tail = client;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static struct Client *dequeue(void) {
+  pthread_mutex_lock(&queue_lock);
+  while (queue_head == NULL) {
+    pthread_cond_wait(&queue_cond, &queue_lock);
+  }
+  struct Client *client = queue_head;
+  queue_head = client->next_queued;
+  if (queue_head == NULL) {
+    queue_tail = NULL;
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return client;
+}
+
+// Reads what the registry FIFO has and starts a session for every complete
+// connect request.
+static void read_registry(void) {
+  pthread_mutex_lock(&registry_lock);
+  ssize_t n = read(registry_fd, registry_input + registry_len,
+                   sizeof(registry_input) - registry_len);
+  if (n > 0) {
+    registry_len += (size_t)n;
+  } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+    perror("Failed to read registry pipe");
+  }
+
+  size_t start = 0;
+  while (registry_len - start >= 1 + CONNECT_REQUEST_SIZE) {
+    const char *request = registry_input + start;
+    if (request[0] != OP_CODE_CONNECT) {
+      // Requests are written whole, so the rest cannot be framed either.
+      fprintf(stderr, "Unknown registry opcode: %d\n", request[0]);
+      start = registry_len;
+      break;
+    }
+    // Clients that predate versions send the paths right after the opcode.
+    int version = PROTOCOL_VERSION_1;
+    size_t size = 1 + CONNECT_REQUEST_SIZE;
+    if ((unsigned char)request[1] < PROTOCOL_VERSION_LIMIT) {
+      if (registry_len - start < 2 + CONNECT_REQUEST_SIZE) {
+        break;
+      }
+      version = request[1] > PROTOCOL_VERSION_1 ? request[1]
+                                                : PROTOCOL_VERSION_1;
+      size++;
+    }
+    handle_connection(request + size - CONNECT_REQUEST_SIZE, version);
+    start += size;
+  }
+  registry_len -= start;
+  memmove(registry_input, registry_input + start, registry_len);
+  pthread_mutex_unlock(&registry_lock);
+
+  watch(registry_fd, &registry_tag, EPOLL_CTL_MOD);
+}
+
+// Accepts every pending connection on the Unix socket and starts a session
+// for each.
+static void accept_clients(void) {
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Failed to accept client");
+      }
+      break;
+    }
+    if (socket_sndbuf > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socket_sndbuf,
+                   sizeof(socket_sndbuf)) == -1) {
+      perror("Failed to set socket send buffer");
+    }
+    handle_socket_connection(fd);
+  }
+
+  watch(listen_fd, &listen_tag, EPOLL_CTL_MOD);
+}
+
+// Writes what a session's responses hold back, and serves the session again
+// once none is left. Called by the I/O thread handling the output event of
+// the session, or the doorbells of a session in shared memory.
+static void write_session(struct Client *client) {
+  pthread_mutex_lock(&client->write_lock);
+  int pending = session_flush(client);
+  pthread_mutex_lock(&client->lock);
+  if (pending) {
+    watch_output(client);
+  } else if (client->writing) {
+    client->writing = 0;
+    if (!client->queued && (client->input_len > 0 || client->eof)) {
+      enqueue(client);
+    }
+  }
+  pthread_mutex_unlock(&client->write_lock);
+  pthread_mutex_unlock(&client->lock);
+}
+
+// Writes to every session whose responses have room. The output instance is
+// watched again first, so that other I/O threads take what comes next.
+static void write_sessions(void) {
+  struct epoll_event events[LOOP_MAX_EVENTS];
+  int n = epoll_wait(output_fd, events, LOOP_MAX_EVENTS, 0);
+  watch(output_fd, &output_tag, EPOLL_CTL_MOD);
+  for (int i = 0; i < n; i++) {
+    write_session(events[i].data.ptr);
+  }
+}
+
+// Reads what a session's request FIFO has into its input and queues the
+// session for a worker. The FIFO is watched again unless the input is full,
+// a connect request waits to be served, or the client closed it; a full
+// session in shared memory is still watched for doorbells while its
+// responses wait for room.
+static void read_session(struct Client *client, uint32_t events) {
+  pthread_mutex_lock(&client->lock);
+  if (client->server_bell != -1 && !(events & EPOLLIN)) {
+    // The socket of a session in shared memory hung up. Its last requests
+    // may still be in the ring: the doorbell has them read, and the session
+    // cannot close before, so the doorbell is still open.
+    client->hung_up = 1;
+    ring_bell(client->server_bell);
+    pthread_mutex_unlock(&client->lock);
+    return;
+  }
+  if (client->input_start > 0) {
+    memmove(client->input, client->input + client->input_start,
+            client->input_len);
+    client->input_start = 0;
+  }
+  size_t space = SESSION_INPUT_SIZE - client->input_len;
+  struct RingPair *shm = client->shm;
+  if (shm != NULL) {
+    // Cleared before the ring is read, so no request written after is
+    // missed, and before the hangup is looked at, so it is not either.
+    ring_clear_bell(client->server_bell);
+  }
+  // Requests written before the hangup are all in the ring by now.
+  int gone = client->hung_up;
+  pthread_mutex_unlock(&client->lock);
+
+  // Only this thread adds to the input, and workers only take from it, so
+  // the space cannot shrink while the lock is not held.
+  // Sockets stay blocking for the connect reply, which shares the
+  // descriptor: only this read and the responses must not wait.
+  char buffer[SESSION_INPUT_SIZE];
+  ssize_t n;
+  if (shm != NULL) {
+    n = (ssize_t)ring_read(&shm->requests, buffer, space);
+    if (n > 0 && ring_made_room(&shm->requests)) {
+      ring_bell(client->client_bell);
+    }
+    // Some doorbells tell there is room for responses again.
+    write_session(client);
+  } else {
+    n = client->socket ? recv(client->req_fd, buffer, space, MSG_DONTWAIT)
+                       : read(client->req_fd, buffer, space);
+    gone = n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR);
+  }
+
+  pthread_mutex_lock(&client->lock);
+  if (n > 0) {
+    memcpy(client->input + client->input_start + client->input_len, buffer,
+           (size_t)n);
+    client->input_len += (size_t)n;
+  }
+  if (shm != NULL) {
+    // A full input may have left some in the ring, which is still served,
+    // unless its responses wait for room the client will never make.
+    gone = gone && ((size_t)n < space || client->writing);
+  }
+  if (gone) {
+    client->eof = 1;
+  }
+
+  client->watched = 0;
+  if (client->input_len == SESSION_INPUT_SIZE ||
+      (client->version == SESSION_VERSION_PENDING &&
+       client->input_len >= SOCKET_CONNECT_SIZE)) {
+    // The worker watches the FIFO again once it drains, or, for a connect
+    // request, once it settled where the session's requests come from.
+    client->paused = 1;
+    if (client->shm != NULL && client->writing) {
+      watch_output(client);
+    }
+  } else if (!client->eof) {
+    rearm(client);
+  }
+  // The worker closes the session once it has served what is left.
+  if (!client->queued && (n > 0 || client->eof)) {
+    enqueue(client);
+  }
+  pthread_mutex_unlock(&client->lock);
+}
+
+static void *io_thread(void *arg) {
+  (void)arg;
+  struct epoll_event events[LOOP_MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, LOOP_MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait failed");
+      return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &registry_tag) {
+        read_registry();
+      } else if (events[i].data.ptr == &listen_tag) {
+        accept_clients();
+      } else if (events[i].data.ptr == &output_tag) {
+        write_sessions();
+      } else {
+        read_session(events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+}
+
+// Takes the next request of a session to serve, if it is complete and may
+// start now: not before the responses to the previous ones are written.
+// Called with the session's lock held.
+// @return 0 if a request was copied to request, 1 if there is none to take.
+static int take_request(struct Client *client, char *request) {
+  size_t size = 0;
+  const char *input = client->input + client->input_start;
+  int parsed = client->done ? 1
+                            : parse_request(client->version, input,
+                                            client->input_len, &size);
+  if (parsed == -1) {
+    fprintf(stderr, "[ERROR] Cannot frame request of session %zu\n",
+            client->slot);
+    client->done = 1;
+  }
+  int taken = parsed == 0 && !client->writing &&
+              !(client->in_flight > 0 && request_is_barrier(client, input));
+  if (client->done) {
+    // Drop whatever else the client sends until it closes the FIFO.
+    client->input_start = 0;
+    client->input_len = 0;
+  } else if (taken) {
+    memcpy(request, input, size);
+    client->input_start += size;
+    client->input_len -= size;
+  }
+  if (client->paused && client->input_len < SESSION_INPUT_SIZE &&
+      (client->version != SESSION_VERSION_PENDING || client->done)) {
+    client->paused = 0;
+    if (!client->watched && !client->eof) {
+      rearm(client);
+    }
+  }
+  return taken ? 0 : 1;
+}
+
+// Whether the request at the start of a session's input could be served
+// alongside those in flight. Called with the session's lock held.
+static int can_overlap(struct Client *client) {
+  size_t size = 0;
+  const char *input = client->input + client->input_start;
+  return !client->done &&
+         parse_request(client->version, input, client->input_len, &size) ==
+             0 &&
+         !request_is_barrier(client, input);
+}
+
+// Serves the complete requests in a session's input, then either gives the
+// session back to the loop or closes it if the client is gone. Requests of
+// version 2 sessions that are not barriers may be served by several workers
+// at once: before serving one, a worker hands the session to the next
+// worker if the following request could overlap it.
+static void serve_session(struct Client *client) {
+  char request[SESSION_INPUT_SIZE];
+
+  pthread_mutex_lock(&client->lock);
+  while (take_request(client, request) == 0) {
+    client->in_flight++;
+    int handed_over = 0;
+    if (!request_is_barrier(client, request) && can_overlap(client)) {
+      enqueue(client);
+      handed_over = 1;
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    serve_request(client, request);
+
+    pthread_mutex_lock(&client->lock);
+    client->in_flight--;
+    if (handed_over) {
+      if (client->queued) {
+        // Another worker takes it from here.
+        pthread_mutex_unlock(&client->lock);
+        return;
+      }
+      client->queued = 1;
+    }
+  }
+
+  // Whoever finishes the last request in flight closes the session, once
+  // its responses are written. Those in shared memory never will be: the
+  // client left with the socket.
+  int closing = client->eof && client->in_flight == 0 &&
+                (!client->writing || client->shm != NULL);
+  client->queued = closing;
+  pthread_mutex_unlock(&client->lock);
+
+  // The FIFO is no longer watched, and no I/O thread will queue the session
+  // again: this worker is the last one to touch it.
+  if (closing) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->req_fd, NULL);
+    if (client->server_bell != -1) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->server_bell, NULL);
+    }
+    if (client->output_registered) {
+      epoll_ctl(output_fd, EPOLL_CTL_DEL, client->resp_fd, NULL);
+    }
+    close_session(client);
+  }
+}
+
+static void *worker_thread(void *arg) {
+  (void)arg;
+  // A client is waiting on every request: let it ahead of batch jobs.
+  qos_set_class(QOS_INTERACTIVE);
+
+  while (1) {
+    serve_session(dequeue());
+  }
+  return NULL;
+}
+
+int loop_start(const char *registry_path, size_t io_count, size_t workers) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    return 1;
+  }
+
+  output_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (output_fd == -1 || watch(output_fd, &output_tag, EPOLL_CTL_ADD)) {
+    perror("Failed to create epoll instance");
+    return 1;
+  }
+
+  registry_fd = open(registry_path, O_RDWR | O_NONBLOCK);
+  if (registry_fd == -1) {
+    perror("Failed to open registry pipe");
+    return 1;
+  }
+  if (watch(registry_fd, &registry_tag, EPOLL_CTL_ADD)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < workers; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_thread, NULL) != 0 ||
+        pthread_detach(thread) != 0) {
+      fprintf(stderr, "Failed to create session worker %zu\n", i);
+      return 1;
+    }
+  }
+
+  io_threads = malloc(io_count * sizeof(pthread_t));
+  if (io_threads == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < io_count; i++) {
+    if (pthread_create(&io_threads[i], NULL, io_thread, NULL) != 0) {
+      fprintf(stderr, "Failed to create I/O thread %zu\n", i);
+      return 1;
+    }
+    num_io_threads++;
+  }
+  return 0;
+}
+
+int loop_listen(const char *socket_path, int backlog, int sndbuf) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    perror("Failed to create socket");
+    return 1;
+  }
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, backlog) == -1) {
+    perror("Failed to listen on socket");
+    close(listen_fd);
+    listen_fd = -1;
+    return 1;
+  }
+  // Connections are accepted until none is left, so accept must not block.
+  if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Failed to set socket non-blocking");
+    return 1;
+  }
+
+  socket_sndbuf = sndbuf;
+  return watch(listen_fd, &listen_tag, EPOLL_CTL_ADD);
+}
+
+void loop_join(void) {
+  for (size_t i = 0; i < num_io_threads; i++) {
+    pthread_join(io_threads[i], NULL);
+  }
+  free(io_threads);
+  io_threads = NULL;
+  num_io_threads = 0;
+}
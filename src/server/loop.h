@@ -0,0 +1,60 @@
+#ifndef KVS_LOOP_H
+#define KVS_LOOP_H
+
+#include <stddef.h>
+
+#include "api.h"
+
+#define LOOP_DEFAULT_IO_THREADS 1
+#define LOOP_DEFAULT_WORKERS 2
+#define LOOP_DEFAULT_BACKLOG 128
+
+// Events taken from epoll per wakeup of an I/O thread.
+#define LOOP_MAX_EVENTS 64
+
+/// Starts the event loop that serves the registry FIFO and every session.
+/// I/O threads wait on a single epoll instance, read whatever is ready into
+/// the session's input buffer and queue the session for a worker, which
+/// serves its complete requests in order. Responses the client does not take
+/// at once are queued, and written by the I/O threads once it does; until
+/// then, no more of its requests are served. Threads never block on a
+/// client.
+/// @param registry_path Path of the registry FIFO. It must exist.
+/// @param io_threads Number of threads reading from the FIFOs.
+/// @param workers Number of threads serving requests.
+/// @return 0 if the loop was started, 1 otherwise.
+int loop_start(const char *registry_path, size_t io_threads, size_t workers);
+
+/// Also serves clients over a Unix socket. Sessions started from it are
+/// served like those of the registry FIFO, over a single connection.
+/// @param socket_path Path to bind the socket to. Whatever is there is
+/// removed first.
+/// @param backlog Connections the kernel queues until they are accepted.
+/// @param sndbuf Send buffer size of every connection, 0 for the default.
+/// @return 0 if the socket is being listened on, 1 otherwise.
+int loop_listen(const char *socket_path, int backlog, int sndbuf);
+
+/// Waits for the I/O threads. They only return if epoll fails.
+void loop_join(void);
+
+/// Starts watching the request FIFO of a newly connected session.
+/// @param client Session, with its FIFOs open.
+/// @return 0 if the session is being watched, 1 otherwise.
+int loop_add_session(struct Client *client);
+
+/// Watches the doorbell of a socket session moving to shared memory for
+/// its requests from now on, and its socket only to see the client leave.
+/// Called by the worker serving the connect request: the session is not
+/// watched until the worker is done with it.
+/// @param client Session, with its server_bell set.
+/// @return 0 if the doorbell is watched, 1 if the session must stay on
+/// its socket.
+int loop_watch_doorbell(struct Client *client);
+
+/// Has the responses just queued for a session written once the client
+/// takes them, and serves none of its requests until then. Called with the
+/// session's write lock held.
+/// @param client Session whose responses were queued.
+void loop_watch_output(struct Client *client);
+
+#endif // KVS_LOOP_H
@@ -1,6 +1,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,10 +10,20 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include "cdc.h"
 #include "constants.h"
 #include "io.h"
+#include "job.h"
+#include "jobc.h"
+#include "loop.h"
+#include "notify.h"
 #include "operations.h"
 #include "parser.h"
+#include "qos.h"
+#include "reader.h"
+#include "scheduler.h"
+#include "sessions.h"
+#include "watch.h"
 #include "pthread.h"
 #include "../common/protocol.h"
 #include "../common/io.h"
@@ -21,20 +33,34 @@
 
 
 
-struct SharedData {
-  DIR *dir;
-  char *dir_name;
-  pthread_mutex_t directory_mutex;
+struct WorkerArgs {
+  struct Scheduler *sched;
+  size_t worker;
 };
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
-struct Client *g_clients[MAX_SESSION_COUNT];
 size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
 size_t max_threads;        // Maximum allowed simultaneous threads
 char *jobs_directory = NULL;
+int coalesce = 0; // Merge consecutive WRITE/DELETE commands of a job
+int use_jobc = 0; // Run jobs from their cached compiled form
+unsigned int qos_stats_interval = 0; // Seconds between QoS reports, 0 for none
+size_t io_threads = LOOP_DEFAULT_IO_THREADS;   // Threads reading client FIFOs
+size_t session_workers = LOOP_DEFAULT_WORKERS; // Threads serving requests
+char *socket_path = NULL; // Unix socket clients may connect to, if any
+int socket_backlog = LOOP_DEFAULT_BACKLOG; // Connections queued to be accepted
+int socket_sndbuf = 0; // Send buffer of socket sessions, 0 for the default
+size_t notify_threads = NOTIFY_DEFAULT_THREADS; // Threads writing notifications
+size_t notify_queue = NOTIFY_DEFAULT_QUEUE; // Changes queued per subscriber
+enum NotifyPolicy notify_policy = NOTIFY_COALESCE; // When a queue is full
+enum NotifyFanout notify_fanout = NOTIFY_FANOUT_QUEUE; // How changes go out
+char *cdc_dir = NULL; // Where the change log is written, if anywhere
+size_t cdc_ring = CDC_DEFAULT_RING; // Changes of the log kept in memory
+size_t cdc_segments = CDC_DEFAULT_SEGMENTS; // Segments of the log kept
+atomic_size_t job_lock_acquisitions = 0; // Table lock acquisitions by jobs
 
 int filter_job_files(const struct dirent *entry) {
   const char *dot = strrchr(entry->d_name, '.');
@@ -44,92 +70,119 @@ int filter_job_files(const struct dirent *entry) {
   return 0;
 }
 
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,
-                       char *out_path) {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
-      strcmp(dot, ".job")) {
-    return 1;
+// Collects consecutive WRITE and DELETE commands, starting with the one in
+// command, into the batch and applies them with a single acquisition of the
+// table lock. Any other command is a barrier that ends the batch.
+// @param src Source of the job's commands.
+// @param out Output buffer of the job.
+// @param batch Empty batch to fill.
+// @param command First command of the batch. Holds the command that ended the
+// batch, still to be executed, on return.
+static void coalesce_writes(struct JobSource *src, struct OutBuffer *out,
+                            struct WriteBatch *batch,
+                            struct JobCommand *command) {
+  while (command->cmd == CMD_WRITE || command->cmd == CMD_DELETE ||
+         command->cmd == CMD_EMPTY) {
+    if (command->cmd != CMD_EMPTY) {
+      if (batch->num_commands == MAX_BATCH_COMMANDS ||
+          batch->num_pairs + MAX_WRITE_SIZE > MAX_BATCH_PAIRS) {
+        if (kvs_apply_batch(batch, out)) {
+          write_str(STDERR_FILENO, "Failed to write batch\n");
+        }
+      }
+
+      struct BatchCommand *batched = &batch->commands[batch->num_commands];
+      size_t size = command->num_pairs * MAX_STRING_SIZE;
+      memcpy(batch->keys + batch->num_pairs, command->keys, size);
+      if (command->cmd == CMD_WRITE) {
+        batched->kind = BATCH_WRITE;
+        memcpy(batch->values + batch->num_pairs, command->values, size);
+      } else {
+        batched->kind = BATCH_DELETE;
+      }
+
+      batched->first = batch->num_pairs;
+      batched->num_pairs = command->num_pairs;
+      batch->num_commands++;
+      batch->num_pairs += command->num_pairs;
+    }
+
+    job_next(src, command);
   }
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
-    return 1;
+  if (kvs_apply_batch(batch, out)) {
+    write_str(STDERR_FILENO, "Failed to write batch\n");
   }
+}
 
-  strcpy(in_path, dir);
-  strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+// A job in progress. Everything needed to pick a job up again after it
+// parked on a WAIT lives here rather than on the worker's stack.
+struct JobTask {
+  int in_fd;
+  int out_fd;
+  struct Reader reader;
+  struct CompiledJob compiled;
+  struct JobSource src;
+  struct OutBuffer out;
+  struct WriteBatch *batch;
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  struct JobCommand command; // Next command to execute.
+  unsigned int wait_ms;      // Delay of the WAIT the job is parked on.
+  size_t file_backups;
+};
 
-  strcpy(out_path, in_path);
-  strcpy(strrchr(out_path, '.'), ".out");
+enum JobStatus {
+  JOB_FINISHED,
+  JOB_EXIT,   // Backup child process, which must exit.
+  JOB_WAITING // Stopped at a WAIT of task->wait_ms milliseconds.
+};
 
-  return 0;
-}
+// Runs a job until it ends or reaches a WAIT. A waiting job resumes from the
+// command after the WAIT on the next call.
+// @param task Job to run.
+// @param filename Name of the job file.
+// @return The reason the job stopped.
+static enum JobStatus execute_job(struct JobTask *task, char *filename) {
+  struct JobCommand *command = &task->command;
+  struct OutBuffer *out = &task->out;
 
-static int run_job(int in_fd, int out_fd, char *filename) {
-  size_t file_backups = 0;
   while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+    if (task->batch != NULL &&
+        (command->cmd == CMD_WRITE || command->cmd == CMD_DELETE)) {
+      coalesce_writes(&task->src, out, task->batch, command);
+    }
 
-    switch (get_next(in_fd)) {
+    switch (command->cmd) {
     case CMD_WRITE:
-      num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (kvs_write(num_pairs, keys, values)) {
+      if (kvs_write(command->num_pairs, task->keys, task->values)) {
         write_str(STDERR_FILENO, "Failed to write pair\n");
       }
       break;
 
     case CMD_READ:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (kvs_read(num_pairs, keys, out_fd)) {
+      if (kvs_read(command->num_pairs, task->keys, out)) {
         write_str(STDERR_FILENO, "Failed to read pair\n");
       }
       break;
 
     case CMD_DELETE:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (kvs_delete(num_pairs, keys, out_fd)) {
+      if (kvs_delete(command->num_pairs, task->keys, out)) {
         write_str(STDERR_FILENO, "Failed to delete pair\n");
       }
       break;
 
     case CMD_SHOW:
-      kvs_show(out_fd);
+      kvs_show(out);
       break;
 
     case CMD_WAIT:
-      if (parse_wait(in_fd, &delay, NULL) == -1) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (delay > 0) {
-        printf("Waiting %d seconds\n", delay / 1000);
-        kvs_wait(delay);
+      if (command->delay > 0) {
+        out_buffer_flush(out);
+        printf("Waiting %d seconds\n", command->delay / 1000);
+        task->wait_ms = command->delay;
+        job_next(&task->src, command);
+        return JOB_WAITING;
       }
       break;
 
@@ -141,12 +194,16 @@ static int run_job(int in_fd, int out_fd, char *filename) {
         active_backups++;
       }
       pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
+      // The forked child gets a copy of whatever output is still buffered.
+      // It exits inside kvs_backup without writing it, but flushing first
+      // leaves it nothing to inherit.
+      out_buffer_flush(out);
+      int aux = kvs_backup(++task->file_backups, filename, jobs_directory);
 
       if (aux < 0) {
         write_str(STDERR_FILENO, "Failed to do backup\n");
       } else if (aux == 1) {
-        return 1;
+        return JOB_EXIT;
       }
       break;
 
@@ -172,141 +229,211 @@ static int run_job(int in_fd, int out_fd, char *filename) {
 
     case EOC:
       printf("EOF\n");
-      return 0;
+      return JOB_FINISHED;
     }
+
+    job_next(&task->src, command);
   }
 }
 
-// frees arguments
-static void *get_file(void *arguments) {
-  struct SharedData *thread_data = (struct SharedData *)arguments;
-  DIR *dir = thread_data->dir;
-  char *dir_name = thread_data->dir_name;
+// Opens a job's files and sets up its task. Jobs run from their compiled
+// form, or from their text when compiled jobs are disabled or the job could
+// not be compiled.
+// @param job Job to start.
+// @return The task of the job, or NULL if it could not be started.
+static struct JobTask *start_job(const struct JobEntry *job) {
+  struct JobTask *task = calloc(1, sizeof(struct JobTask));
+  if (task == NULL) {
+    write_str(STDERR_FILENO, "Failed to allocate job\n");
+    return NULL;
+  }
 
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
+  task->in_fd = open(job->in_path, O_RDONLY);
+  if (task->in_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open input file: ");
+    write_str(STDERR_FILENO, job->in_path);
+    write_str(STDERR_FILENO, "\n");
+    free(task);
     return NULL;
   }
 
-  struct dirent *entry;
-  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
-      continue;
-    }
+  task->out_fd = open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (task->out_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open output file: ");
+    write_str(STDERR_FILENO, job->out_path);
+    write_str(STDERR_FILENO, "\n");
+    close(task->in_fd);
+    free(task);
+    return NULL;
+  }
 
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-      return NULL;
-    }
+  if (use_jobc && !jobc_load(job->in_path, &task->compiled)) {
+    job_source_compiled(&task->src, task->compiled.code,
+                        task->compiled.code_len);
+  } else if (!reader_init(&task->reader, task->in_fd)) {
+    job_source_text(&task->src, &task->reader);
+  } else {
+    write_str(STDERR_FILENO, "Failed to allocate job reader\n");
+    close(task->out_fd);
+    close(task->in_fd);
+    free(task);
+    return NULL;
+  }
 
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
+  if (out_buffer_init(&task->out, task->out_fd)) {
+    write_str(STDERR_FILENO, "Failed to allocate job output buffer\n");
+    jobc_unload(&task->compiled);
+    reader_destroy(&task->reader);
+    close(task->out_fd);
+    close(task->in_fd);
+    free(task);
+    return NULL;
+  }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
+  if (coalesce && (task->batch = malloc(sizeof(struct WriteBatch))) != NULL) {
+    task->batch->num_commands = 0;
+    task->batch->num_pairs = 0;
+  }
+
+  task->command.keys = task->keys;
+  task->command.values = task->values;
+  job_next(&task->src, &task->command);
+  return task;
+}
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
+static void finish_job(struct JobTask *task) {
+  free(task->batch);
+  out_buffer_destroy(&task->out);
+  jobc_unload(&task->compiled);
+  reader_destroy(&task->reader);
+  close(task->in_fd);
+  close(task->out_fd);
+  free(task);
+}
 
-    close(in_fd);
-    close(out_fd);
+static void *get_file(void *arguments) {
+  struct WorkerArgs *args = (struct WorkerArgs *)arguments;
+  struct JobEntry *job;
 
-    if (out) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
+  while ((job = scheduler_next(args->sched, args->worker)) != NULL) {
+    struct JobTask *task = job->task;
+    if (task == NULL && (task = start_job(job)) == NULL) {
+      scheduler_done(args->sched, args->worker, job, 0);
+      continue;
+    }
+    job->task = task;
 
-      exit(0);
+    enum JobStatus status;
+    while (1) {
+      size_t locks_before = kvs_lock_acquisitions();
+      status = execute_job(task, job->name);
+      job_lock_acquisitions += kvs_lock_acquisitions() - locks_before;
+
+      // A waiting job is parked so this worker can run other jobs meanwhile.
+      // Once parked, another worker may resume it at any time.
+      if (status != JOB_WAITING ||
+          !scheduler_park(args->sched, args->worker, job, task->wait_ms)) {
+        break;
+      }
+      kvs_wait(task->wait_ms); // Could not park it: wait in place.
     }
 
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
+    if (status == JOB_WAITING) {
+      continue;
     }
-  }
 
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-    return NULL;
+    finish_job(task);
+    scheduler_done(args->sched, args->worker, job, 1);
+
+    if (status == JOB_EXIT) {
+      exit(0);
+    }
   }
 
   pthread_exit(NULL);
 }
 
 
-void *registry_handler(void *arg) {
-    char *registry_pipe = (char *)arg;
-    
-    while (1) {
-        int fd = open(registry_pipe, O_RDONLY);
-        if (fd == -1) continue;
-
-        char opcode;
-        if (read(fd, &opcode, 1) == 1 && opcode == OP_CODE_CONNECT) {
-            for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-                if (!g_clients[i]->active) {
-                    if (handle_connection(fd) == 0) {
-                        pthread_create(&g_clients[i]->thread, NULL, client_handler, &g_clients[i]);
-                    }
-                    break;
-                }
-            }
-        }
-        close(fd);
-    }
-    return NULL;
+// Prints the table lock waits of each QoS class every qos_stats_interval
+// seconds, for as long as the server runs.
+static void *qos_stats_loop(void *arg) {
+  (void)arg;
+  while (1) {
+    sleep(qos_stats_interval);
+    kvs_qos_report(stdout);
+    notify_report(stdout);
+  }
+  return NULL;
 }
 
-static void dispatch_threads(DIR *dir,const char *fifo_registry) {
+static void dispatch_threads(DIR *dir, const char *fifo_registry,
+                             enum SchedulerMode mode, int watch) {
   pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  struct WorkerArgs *args = malloc(max_threads * sizeof(struct WorkerArgs));
 
-  if (threads == NULL) {
+  if (threads == NULL || args == NULL) {
     fprintf(stderr, "Failed to allocate memory for threads\n");
+    free(threads);
+    free(args);
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory,
-                                   PTHREAD_MUTEX_INITIALIZER};
+  struct Scheduler sched;
+  if (scheduler_init(&sched, mode, dir, jobs_directory, max_threads, watch)) {
+    fprintf(stderr, "Failed to initialize job scheduler\n");
+    free(threads);
+    free(args);
+    return;
+  }
+
+  pthread_t stats_thread;
+  if (qos_stats_interval > 0 &&
+      (pthread_create(&stats_thread, NULL, qos_stats_loop, NULL) != 0 ||
+       pthread_detach(stats_thread) != 0)) {
+    fprintf(stderr, "Failed to start QoS stats thread\n");
+  }
+
+  pthread_t watcher_thread;
+  if (watch && watch_start(&sched, &watcher_thread)) {
+    fprintf(stderr, "Failed to watch jobs directory\n");
+    scheduler_close(&sched);
+  }
 
   for (size_t i = 0; i < max_threads; i++) {
-    if (pthread_create(&threads[i], NULL, get_file, (void *)&thread_data) !=
-        0) {
+    args[i] = (struct WorkerArgs){&sched, i};
+    if (pthread_create(&threads[i], NULL, get_file, (void *)&args[i]) != 0) {
       fprintf(stderr, "Failed to create thread %zu\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
+      scheduler_destroy(&sched);
       free(threads);
+      free(args);
       return;
     }
   }
 
   // ler do FIFO de registo///////////////////////////////////////////////////////////////////////////////////////////////
 
-  pthread_t receiver_thread;
-  pthread_create(&receiver_thread, NULL, registry_handler, (void *)fifo_registry);
-  pthread_join(receiver_thread, NULL);
+  if (loop_start(fifo_registry, io_threads, session_workers)) {
+    fprintf(stderr, "Failed to start serving clients\n");
+  } else if (socket_path != NULL &&
+             loop_listen(socket_path, socket_backlog, socket_sndbuf)) {
+    fprintf(stderr, "Failed to serve clients on %s\n", socket_path);
+  }
 
   for (unsigned int i = 0; i < max_threads; i++) {
     if (pthread_join(threads[i], NULL) != 0) {
       fprintf(stderr, "Failed to join thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
-      free(threads);
-      return;
     }
   }
-  if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0) {
-    fprintf(stderr, "Failed to destroy directory_mutex\n");
-  }
+  scheduler_report(&sched);
+  printf("Jobs took the table lock %zu times\n",
+         (size_t)job_lock_acquisitions);
+  kvs_qos_report(stdout);
+  notify_report(stdout);
+  scheduler_destroy(&sched);
   free(threads);
+  free(args);
+
+  loop_join();
 }
 
 
@@ -317,7 +444,21 @@ int main(int argc, char **argv) {
     write_str(STDERR_FILENO, " <jobs_dir>");
     write_str(STDERR_FILENO, " <max_threads>");
     write_str(STDERR_FILENO, " <max_backups>");
-    write_str(STDERR_FILENO, " <FIFO_registry>\n");
+    write_str(STDERR_FILENO, " <FIFO_registry>");
+    write_str(STDERR_FILENO, " [--scheduler=steal|readdir] [--watch]");
+    write_str(STDERR_FILENO, " [--coalesce] [--jobc]");
+    write_str(STDERR_FILENO, " [--qos-weights=<interactive>:<batch>]");
+    write_str(STDERR_FILENO, " [--qos-stats=<seconds>]");
+    write_str(STDERR_FILENO, " [--max-sessions=<n>] [--io-threads=<n>]");
+    write_str(STDERR_FILENO, " [--session-workers=<n>]");
+    write_str(STDERR_FILENO, " [--socket=<path>] [--socket-backlog=<n>]");
+    write_str(STDERR_FILENO, " [--socket-sndbuf=<bytes>] [--shm]");
+    write_str(STDERR_FILENO, " [--notify-threads=<n>] [--notify-queue=<n>]");
+    write_str(STDERR_FILENO,
+              " [--notify-policy=drop-oldest|coalesce|disconnect]");
+    write_str(STDERR_FILENO, " [--notify-fanout=tee|write|queue]");
+    write_str(STDERR_FILENO, " [--cdc-dir=<path>] [--cdc-ring=<n>]");
+    write_str(STDERR_FILENO, " [--cdc-segments=<n>]\n");
     return 1;
   }
 
@@ -351,10 +492,145 @@ int main(int argc, char **argv) {
     write_str(STDERR_FILENO, "Invalid path\n");
     return 0;
   }
+
+  enum SchedulerMode sched_mode = SCHED_STEAL;
+  int watch = 0;
+  size_t max_sessions = MAX_SESSION_COUNT;
+  for (int i = 5; i < argc; i++) {
+    if (strcmp(argv[i], "--scheduler=steal") == 0) {
+      sched_mode = SCHED_STEAL;
+    } else if (strcmp(argv[i], "--scheduler=readdir") == 0) {
+      sched_mode = SCHED_READDIR;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      watch = 1;
+    } else if (strcmp(argv[i], "--coalesce") == 0) {
+      coalesce = 1;
+    } else if (strcmp(argv[i], "--jobc") == 0) {
+      use_jobc = 1;
+    } else if (strncmp(argv[i], "--qos-weights=", 14) == 0) {
+      unsigned long interactive = strtoul(argv[i] + 14, &endptr, 10);
+      unsigned long batch = 0;
+      if (*endptr == ':') {
+        batch = strtoul(endptr + 1, &endptr, 10);
+      }
+      if (*endptr != '\0' || interactive > UINT_MAX || batch > UINT_MAX ||
+          qos_set_weights((unsigned int)interactive, (unsigned int)batch)) {
+        fprintf(stderr, "Invalid QoS weights: %s\n", argv[i] + 14);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--qos-stats=", 12) == 0) {
+      qos_stats_interval = (unsigned int)strtoul(argv[i] + 12, &endptr, 10);
+      if (*endptr != '\0' || qos_stats_interval == 0) {
+        fprintf(stderr, "Invalid QoS stats interval: %s\n", argv[i] + 12);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--max-sessions=", 15) == 0) {
+      max_sessions = strtoul(argv[i] + 15, &endptr, 10);
+      if (*endptr != '\0' || max_sessions == 0) {
+        fprintf(stderr, "Invalid number of sessions: %s\n", argv[i] + 15);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--io-threads=", 13) == 0) {
+      io_threads = strtoul(argv[i] + 13, &endptr, 10);
+      if (*endptr != '\0' || io_threads == 0) {
+        fprintf(stderr, "Invalid number of I/O threads: %s\n", argv[i] + 13);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--session-workers=", 18) == 0) {
+      session_workers = strtoul(argv[i] + 18, &endptr, 10);
+      if (*endptr != '\0' || session_workers == 0) {
+        fprintf(stderr, "Invalid number of session workers: %s\n",
+                argv[i] + 18);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--socket=", 9) == 0) {
+      socket_path = argv[i] + 9;
+      if (*socket_path == '\0') {
+        fprintf(stderr, "Invalid socket path\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--socket-backlog=", 17) == 0) {
+      unsigned long backlog = strtoul(argv[i] + 17, &endptr, 10);
+      if (*endptr != '\0' || backlog == 0 || backlog > INT_MAX) {
+        fprintf(stderr, "Invalid socket backlog: %s\n", argv[i] + 17);
+        return 1;
+      }
+      socket_backlog = (int)backlog;
+    } else if (strcmp(argv[i], "--shm") == 0) {
+      api_offer_shm();
+    } else if (strncmp(argv[i], "--socket-sndbuf=", 16) == 0) {
+      unsigned long sndbuf = strtoul(argv[i] + 16, &endptr, 10);
+      if (*endptr != '\0' || sndbuf == 0 || sndbuf > INT_MAX) {
+        fprintf(stderr, "Invalid socket send buffer: %s\n", argv[i] + 16);
+        return 1;
+      }
+      socket_sndbuf = (int)sndbuf;
+    } else if (strncmp(argv[i], "--notify-threads=", 17) == 0) {
+      notify_threads = strtoul(argv[i] + 17, &endptr, 10);
+      if (*endptr != '\0' || notify_threads == 0) {
+        fprintf(stderr, "Invalid number of notification threads: %s\n",
+                argv[i] + 17);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--notify-queue=", 15) == 0) {
+      notify_queue = strtoul(argv[i] + 15, &endptr, 10);
+      if (*endptr != '\0' || notify_queue == 0) {
+        fprintf(stderr, "Invalid notification queue length: %s\n",
+                argv[i] + 15);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--notify-policy=", 16) == 0) {
+      if (notify_parse_policy(argv[i] + 16, &notify_policy)) {
+        fprintf(stderr, "Invalid notification policy: %s\n", argv[i] + 16);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--notify-fanout=", 16) == 0) {
+      if (notify_parse_fanout(argv[i] + 16, &notify_fanout)) {
+        fprintf(stderr, "Invalid notification fan-out: %s\n", argv[i] + 16);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--cdc-dir=", 10) == 0) {
+      cdc_dir = argv[i] + 10;
+      if (*cdc_dir == '\0') {
+        fprintf(stderr, "Invalid change log directory\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--cdc-ring=", 11) == 0) {
+      cdc_ring = strtoul(argv[i] + 11, &endptr, 10);
+      if (*endptr != '\0' || cdc_ring < CDC_SPILL_BATCH) {
+        fprintf(stderr, "Invalid change log ring size: %s\n", argv[i] + 11);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--cdc-segments=", 15) == 0) {
+      cdc_segments = strtoul(argv[i] + 15, &endptr, 10);
+      if (*endptr != '\0' || cdc_segments == 0) {
+        fprintf(stderr, "Invalid number of change log segments: %s\n",
+                argv[i] + 15);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      return 1;
+    }
+  }
   
 
 
-  
+  // Sessions keep their FIFOs open: a client that goes away must show up as
+  // EPIPE on the next write, not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  sessions_init(max_sessions);
+  if (notify_start(notify_threads, notify_queue, notify_policy,
+                   notify_fanout)) {
+    write_str(STDERR_FILENO, "Failed to start notification dispatchers\n");
+    return 1;
+  }
+
+  if (cdc_start(cdc_dir, cdc_ring, cdc_segments)) {
+    write_str(STDERR_FILENO, "Failed to start change log\n");
+    return 1;
+  }
+
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
@@ -366,14 +642,14 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  char *fifo_registry = malloc (strlen(argv[4] + 1));
+  char *fifo_registry = malloc (strlen(argv[4]) + 1);
   strcpy(fifo_registry, argv[4]);
   unlink (fifo_registry);
   if (mkfifo(fifo_registry, 0666) < 0) {
       perror("Error creating server registration FIFO");
       return 1;
   }
-  dispatch_threads(dir, fifo_registry);
+  dispatch_threads(dir, fifo_registry, sched_mode, watch);
 
   free(fifo_registry);
 
@@ -388,6 +664,7 @@ int main(int argc, char **argv) {
   }
 
   kvs_terminate();
+  cdc_stop();
 
   return 0;
 }
\ No newline at end of file
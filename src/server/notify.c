@@ -0,0 +1,859 @@
+// For tee and splice.
+#define _GNU_SOURCE
+
+#include "notify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/protocol.h"
+#include "cdc.h"
+
+// Watches the pipes of subscribers with changes they could not take yet,
+// and the timers of subscribers with changes held.
+static int epoll_fd = -1;
+
+static size_t notify_capacity = NOTIFY_DEFAULT_QUEUE;
+static enum NotifyPolicy notify_policy = NOTIFY_COALESCE;
+// Read by every writer, and turned to NOTIFY_FANOUT_WRITE under the stage
+// lock if tee turns out not to be supported.
+static _Atomic enum NotifyFanout notify_fanout = NOTIFY_FANOUT_QUEUE;
+
+// Changes fanned out with tee are written once to this pipe. The lock
+// keeps one change at a time in it.
+static int stage[2] = {-1, -1};
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Changes of the log read at a time for a stream.
+#define STREAM_BATCH 128
+
+// Subscribers streaming the change log, linked by next_stream. Its lock is
+// taken before theirs.
+static struct Subscriber *streams = NULL;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Changes over every subscriber since the server started.
+static atomic_size_t total_sent = 0;
+static atomic_size_t total_suppressed = 0;
+static atomic_size_t total_dropped = 0;
+
+// Adds to one of a subscriber's counts, and to the server's total.
+static void tally(size_t *count, atomic_size_t *total, size_t n) {
+  *count += n;
+  atomic_fetch_add(total, n);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Where the change at a position of a subscriber's queue is kept.
+static struct Notification *slot(struct Subscriber *subscriber,
+                                  uint64_t position) {
+  return &subscriber->queue[position % notify_capacity];
+}
+
+// Whether two changes are of the same key.
+static int same_key(const struct Notification *a,
+                    const struct Notification *b) {
+  return memcmp(a->key, b->key, sizeof(a->key)) == 0;
+}
+
+// Writes a change as a pipe takes it.
+// @param framed The pipe takes frames.
+// @param flags NOTIFICATION_FLAG_* to mark a frame with.
+// @param out Where to write it, with room for it.
+// @return Number of bytes written.
+static size_t encode(int framed, uint8_t flags,
+                     const struct Notification *change, char *out) {
+  if (!framed) {
+    memcpy(out, change, NOTIFY_MESSAGE_SIZE);
+    return NOTIFY_MESSAGE_SIZE;
+  }
+  struct NotificationHeader header = {.seq = change->seq,
+                                      .key_len = change->key_len,
+                                      .value_len = change->value_len,
+                                      .flags = flags};
+  memcpy(out, &header, sizeof(header));
+  memcpy(out + sizeof(header), change->key, change->key_len);
+  memcpy(out + sizeof(header) + change->key_len, change->value,
+         change->value_len);
+  return sizeof(header) + change->key_len + change->value_len;
+}
+
+// Watches a subscriber's pipe until it has room. Every event is one-shot,
+// so no two dispatchers ever write to the same pipe. Called with the
+// subscriber's lock held.
+static void arm(struct Subscriber *subscriber) {
+  struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT,
+                              .data.ptr = subscriber};
+  int fd = subscriber->fd;
+  if (subscriber->ring != NULL) {
+    // The client rings once it made room for a batch, as a pipe reports
+    // room for PIPE_BUF bytes. Room made before it was marked waiting
+    // rings no doorbell, so it is rung here.
+    event.events = EPOLLIN | EPOLLONESHOT;
+    fd = subscriber->room_bell;
+    if (!ring_wait_room(subscriber->ring, PIPE_BUF)) {
+      ring_bell(subscriber->room_bell);
+    }
+  }
+  int op = subscriber->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+    perror("Failed to watch notification pipe");
+    return;
+  }
+  subscriber->registered = 1;
+  subscriber->armed = 1;
+}
+
+// Writes notifications to the subscriber's pipe, or its ring, whole.
+// Called with the subscriber's lock held.
+// @param len At most PIPE_BUF bytes.
+// @return As write does: len, or -1 with errno EAGAIN if there is no room.
+static ssize_t put(struct Subscriber *subscriber, const void *data,
+                   size_t len) {
+  if (subscriber->ring == NULL) {
+    return write(subscriber->fd, data, len);
+  }
+  if (!ring_write_whole(subscriber->ring, data, len)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (ring_wake(subscriber->ring)) {
+    ring_bell(subscriber->bell);
+  }
+  return (ssize_t)len;
+}
+
+// Writes queued changes until the pipe is full. Called with the
+// subscriber's lock held.
+// @return 1 if changes are left for when the pipe has room, 0 otherwise.
+static int flush(struct Subscriber *subscriber) {
+  while (subscriber->len > 0) {
+    // A write of up to PIPE_BUF bytes to a pipe is all or nothing, even
+    // when non-blocking, so no change is ever cut in half.
+    char batch[PIPE_BUF];
+    size_t used = 0;
+    size_t count = 0;
+    while (count < subscriber->len &&
+           used + NOTIFICATION_MAX_SIZE <= sizeof(batch)) {
+      used += encode(subscriber->framed, 0,
+                     slot(subscriber, subscriber->first + count),
+                     batch + used);
+      count++;
+    }
+
+    ssize_t written = put(subscriber, batch, used);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        return 1;
+      }
+      // The client is gone: its session drops the subscriptions when it
+      // sees the EOF.
+      count = subscriber->len;
+      tally(&subscriber->dropped, &total_dropped, count);
+    } else {
+      tally(&subscriber->sent, &total_sent, count);
+    }
+    subscriber->first += count;
+    subscriber->len -= count;
+  }
+  return 0;
+}
+
+// Writes the change log from the stream's position on, until the pipe is
+// full or the log has no more. Called with the subscriber's lock held, and
+// nothing left in its queue.
+// @return 1 if changes are left for when the pipe has room, 0 otherwise.
+static int flush_stream(struct Subscriber *subscriber) {
+  struct Notification changes[STREAM_BATCH];
+  size_t count;
+  while ((count = cdc_read(subscriber->stream_next, changes,
+                           STREAM_BATCH)) > 0) {
+    char batch[PIPE_BUF];
+    size_t used = 0;
+    size_t taken = 0;
+    while (taken < count && used + NOTIFICATION_MAX_SIZE <= sizeof(batch)) {
+      used += encode(1, NOTIFICATION_FLAG_STREAM, &changes[taken++],
+                     batch + used);
+    }
+
+    ssize_t written = put(subscriber, batch, used);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Once the client is gone, its session closes the stream.
+      return errno == EAGAIN;
+    }
+    tally(&subscriber->sent, &total_sent, taken);
+    subscriber->stream_next = changes[taken - 1].seq + 1;
+  }
+  return 0;
+}
+
+// Closes the pipe, and the timer with it. Called with the subscriber's
+// lock held.
+static void close_pipe(struct Subscriber *subscriber) {
+  tally(&subscriber->dropped, &total_dropped, subscriber->num_held);
+  // A dispatcher that still holds an event for the pipe or the timer finds
+  // the subscriber disarmed, and leaves it alone.
+  if (subscriber->ring != NULL) {
+    // The client holds the doorbells too, so closing them would not take
+    // the one watched out of epoll.
+    if (subscriber->registered) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber->room_bell, NULL);
+    }
+    close(subscriber->bell);
+    close(subscriber->room_bell);
+    subscriber->bell = -1;
+    subscriber->room_bell = -1;
+  } else if (subscriber->registered) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber->fd, NULL);
+  }
+  close(subscriber->fd);
+  if (subscriber->timer_fd != -1) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber->timer_fd, NULL);
+    close(subscriber->timer_fd);
+  }
+  subscriber->fd = -1;
+  subscriber->timer_fd = -1;
+  subscriber->armed = 0;
+  subscriber->registered = 0;
+  subscriber->timing = 0;
+  subscriber->len = 0;
+  subscriber->num_held = 0;
+}
+
+// Appends a change to the queue, making room as the policy says if it is
+// full, and has the pipe watched. Called with the subscriber's lock held.
+// @return 1 + the position of the change in the queue, or 0 if it was not
+// queued.
+static uint64_t enqueue(struct Subscriber *subscriber,
+                        const struct Notification *change) {
+  if (subscriber->len == notify_capacity) {
+    switch (notify_policy) {
+    case NOTIFY_COALESCE:
+      // The latest change of the key is replaced, so the last one the
+      // client reads is still the key's value: nothing is lost.
+      for (size_t i = subscriber->len; i-- > 0;) {
+        uint64_t position = subscriber->first + i;
+        if (same_key(slot(subscriber, position), change)) {
+          *slot(subscriber, position) = *change;
+          tally(&subscriber->suppressed, &total_suppressed, 1);
+          return position + 1;
+        }
+      }
+      break;
+    case NOTIFY_DISCONNECT:
+      fprintf(stderr,
+              "[ERROR] Notification pipe %d fell %zu changes behind\n",
+              subscriber->fd, subscriber->len);
+      tally(&subscriber->dropped, &total_dropped, 1 + subscriber->len);
+      close_pipe(subscriber);
+      return 0;
+    case NOTIFY_DROP_OLDEST:
+      break;
+    }
+    tally(&subscriber->dropped, &total_dropped, 1);
+    subscriber->first++;
+    subscriber->len--;
+  }
+
+  uint64_t position = subscriber->first + subscriber->len;
+  *slot(subscriber, position) = *change;
+  subscriber->len++;
+  // A dispatcher writes it as soon as the pipe has room, which it usually
+  // has already.
+  if (!subscriber->armed) {
+    arm(subscriber);
+  }
+  return position + 1;
+}
+
+// Sets the timer to go off when the earliest held change is due, creating
+// it the first time. Called with the subscriber's lock held.
+// @return 0 if the timer is set, 1 otherwise.
+static int set_timer(struct Subscriber *subscriber) {
+  uint64_t deadline = subscriber->held[0].deadline_ns;
+  for (size_t i = 1; i < subscriber->num_held; i++) {
+    if (subscriber->held[i].deadline_ns < deadline) {
+      deadline = subscriber->held[i].deadline_ns;
+    }
+  }
+
+  if (subscriber->timer_fd == -1) {
+    // Added unwatched: it is watched each time it is set.
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLONESHOT,
+                                .data.ptr = subscriber};
+    if (fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("Failed to create notification timer");
+      if (fd != -1) {
+        close(fd);
+      }
+      return 1;
+    }
+    subscriber->timer_fd = fd;
+  }
+  struct itimerspec when = {
+      .it_value = {(time_t)(deadline / 1000000000),
+                   (long)(deadline % 1000000000)},
+  };
+  if (timerfd_settime(subscriber->timer_fd, TFD_TIMER_ABSTIME, &when,
+                      NULL) == -1) {
+    perror("Failed to set notification timer");
+    return 1;
+  }
+
+  // A set timer stays watched until it goes off.
+  if (!subscriber->timing) {
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                                .data.ptr = subscriber};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, subscriber->timer_fd, &event) ==
+        -1) {
+      perror("Failed to watch notification timer");
+      return 1;
+    }
+    subscriber->timing = 1;
+  }
+  return 0;
+}
+
+// Queues the held changes that are due, and sets the timer for the rest.
+// Called with the subscriber's lock held, once the timer went off.
+static void release_held(struct Subscriber *subscriber) {
+  uint64_t expirations;
+  if (read(subscriber->timer_fd, &expirations, sizeof(expirations)) == -1 &&
+      errno != EAGAIN) {
+    perror("Failed to read notification timer");
+  }
+
+  uint64_t now = now_ns();
+  size_t kept = 0;
+  for (size_t i = 0; i < subscriber->num_held; i++) {
+    if (subscriber->held[i].deadline_ns > now) {
+      subscriber->held[kept++] = subscriber->held[i];
+    } else {
+      enqueue(subscriber, &subscriber->held[i].change);
+      if (subscriber->fd == -1) {
+        return; // The policy closed the pipe, and dropped the rest.
+      }
+    }
+  }
+  subscriber->num_held = kept;
+  if (kept > 0 && set_timer(subscriber) != 0) {
+    // Without a timer, what is held goes out now.
+    subscriber->num_held = 0;
+    for (size_t i = 0; i < kept && subscriber->fd != -1; i++) {
+      enqueue(subscriber, &subscriber->held[i].change);
+    }
+  }
+}
+
+// Holds a change of a debounced key until its window closes, replacing
+// the change of the key already held if there is one. Called with the
+// subscriber's lock held.
+static void hold(struct Subscriber *subscriber,
+                 const struct Notification *change, uint32_t window_ms) {
+  for (size_t i = 0; i < subscriber->num_held; i++) {
+    if (same_key(&subscriber->held[i].change, change)) {
+      subscriber->held[i].change = *change;
+      tally(&subscriber->suppressed, &total_suppressed, 1);
+      return;
+    }
+  }
+
+  if (subscriber->held == NULL) {
+    subscriber->held = malloc(notify_capacity * sizeof(*subscriber->held));
+  }
+  // With no room to hold it, the change goes out right away.
+  if (subscriber->held == NULL || subscriber->num_held == notify_capacity) {
+    enqueue(subscriber, change);
+    return;
+  }
+  struct HeldChange *held = &subscriber->held[subscriber->num_held++];
+  held->change = *change;
+  held->deadline_ns = now_ns() + (uint64_t)window_ms * 1000000;
+  if (set_timer(subscriber) != 0) {
+    subscriber->num_held--;
+    enqueue(subscriber, change);
+  }
+}
+
+static void *dispatch_thread(void *arg) {
+  (void)arg;
+  struct epoll_event events[NOTIFY_MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, NOTIFY_MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to wait for notification pipes");
+      return NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+      struct Subscriber *subscriber = events[i].data.ptr;
+      pthread_mutex_lock(&subscriber->lock);
+      // Pipes are only watched for output, and timers for input, as are
+      // the room doorbells of rings: an input of a subscriber on a ring
+      // may be for either, and both are looked at.
+      int input = events[i].events & EPOLLIN;
+      if (input && subscriber->timing) {
+        subscriber->timing = 0;
+        release_held(subscriber);
+      }
+      if ((!input || subscriber->ring != NULL) && subscriber->armed) {
+        subscriber->armed = 0;
+        if (subscriber->ring != NULL) {
+          ring_clear_bell(subscriber->room_bell);
+        }
+        if (flush(subscriber) ||
+            (subscriber->streaming && flush_stream(subscriber))) {
+          arm(subscriber);
+        }
+      }
+      pthread_mutex_unlock(&subscriber->lock);
+    }
+  }
+  return NULL;
+}
+
+int notify_start(size_t threads, size_t queue, enum NotifyPolicy policy,
+                 enum NotifyFanout fanout) {
+  if (threads == 0 || queue == 0) {
+    return 1;
+  }
+  notify_capacity = queue;
+  notify_policy = policy;
+  atomic_store(&notify_fanout, fanout);
+
+  if (fanout == NOTIFY_FANOUT_TEE &&
+      pipe2(stage, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("Failed to create notification staging pipe");
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    return 1;
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dispatch_thread, NULL) != 0 ||
+        pthread_detach(thread) != 0) {
+      fprintf(stderr, "Failed to create notification dispatcher %zu\n", i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int notify_parse_policy(const char *name, enum NotifyPolicy *policy) {
+  if (strcmp(name, "drop-oldest") == 0) {
+    *policy = NOTIFY_DROP_OLDEST;
+  } else if (strcmp(name, "coalesce") == 0) {
+    *policy = NOTIFY_COALESCE;
+  } else if (strcmp(name, "disconnect") == 0) {
+    *policy = NOTIFY_DISCONNECT;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+int notify_parse_fanout(const char *name, enum NotifyFanout *fanout) {
+  if (strcmp(name, "tee") == 0) {
+    *fanout = NOTIFY_FANOUT_TEE;
+  } else if (strcmp(name, "write") == 0) {
+    *fanout = NOTIFY_FANOUT_WRITE;
+  } else if (strcmp(name, "queue") == 0) {
+    *fanout = NOTIFY_FANOUT_QUEUE;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+void notify_init(struct Subscriber *subscriber) {
+  pthread_mutex_init(&subscriber->lock, NULL);
+  subscriber->fd = -1;
+  subscriber->timer_fd = -1;
+  subscriber->bell = -1;
+  subscriber->room_bell = -1;
+}
+
+int notify_open(struct Subscriber *subscriber, int fd, int framed) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("Failed to set notification pipe non-blocking");
+    close(fd);
+    return 1;
+  }
+
+  pthread_mutex_lock(&subscriber->lock);
+  // The queue is kept for the next session of the slot.
+  if (subscriber->queue == NULL) {
+    subscriber->queue = malloc(notify_capacity * sizeof(*subscriber->queue));
+    if (subscriber->queue == NULL) {
+      pthread_mutex_unlock(&subscriber->lock);
+      close(fd);
+      return 1;
+    }
+  }
+  subscriber->fd = fd;
+  subscriber->framed = framed;
+  subscriber->ring = NULL;
+  subscriber->first = 0;
+  subscriber->len = 0;
+  subscriber->sent = 0;
+  subscriber->suppressed = 0;
+  subscriber->dropped = 0;
+  pthread_mutex_unlock(&subscriber->lock);
+  return 0;
+}
+
+void notify_use_ring(struct Subscriber *subscriber, struct Ring *ring,
+                     int bell, int room_bell) {
+  pthread_mutex_lock(&subscriber->lock);
+  subscriber->ring = ring;
+  subscriber->bell = bell;
+  subscriber->room_bell = room_bell;
+  pthread_mutex_unlock(&subscriber->lock);
+}
+
+int notify_subscription_add(struct Subscription **subscriptions,
+                            size_t *count, struct Subscriber *subscriber,
+                            int mode, uint32_t window_ms) {
+  for (size_t i = 0; i < *count; i++) {
+    if ((*subscriptions)[i].subscriber == subscriber) {
+      return 0;
+    }
+  }
+  struct Subscription *grown =
+      realloc(*subscriptions, (*count + 1) * sizeof(*grown));
+  if (grown == NULL) {
+    return 0;
+  }
+  grown[(*count)++] = (struct Subscription){
+      .subscriber = subscriber, .mode = mode, .window_ms = window_ms};
+  *subscriptions = grown;
+  return 1;
+}
+
+int notify_subscription_remove(struct Subscription **subscriptions,
+                               size_t *count, struct Subscriber *subscriber) {
+  for (size_t i = 0; i < *count; i++) {
+    if ((*subscriptions)[i].subscriber == subscriber) {
+      memmove(&(*subscriptions)[i], &(*subscriptions)[i + 1],
+              (*count - i - 1) * sizeof(**subscriptions));
+      if (--*count == 0) {
+        free(*subscriptions);
+        *subscriptions = NULL;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void notify_prepare(struct Notification *change, const char *key,
+                    const char *value, uint64_t seq) {
+  // Padding included, as the change log writes it to disk.
+  memset(change, 0, sizeof(*change));
+  change->key_len = (uint8_t)strnlen(key, MAX_STRING_SIZE);
+  change->value_len = (uint8_t)strnlen(value, MAX_STRING_SIZE);
+  memset(change->key, ' ', MAX_STRING_SIZE);
+  memset(change->value, ' ', MAX_STRING_SIZE);
+  memcpy(change->key, key, change->key_len);
+  memcpy(change->value, value, change->value_len);
+  change->key[MAX_STRING_SIZE] = '\0';
+  change->value[MAX_STRING_SIZE] = '\0';
+  change->seq = seq;
+}
+
+// Sends a change through the subscriber's queue, as the subscription's
+// mode says. Called with the subscriber's lock held.
+static void send_queued(struct Subscription *subscription,
+                        const struct Notification *change) {
+  struct Subscriber *subscriber = subscription->subscriber;
+  switch (subscription->mode) {
+  case DELIVERY_LATEST:
+    // The key's change not sent yet, if any, is still in the queue: its
+    // slot takes the new value in place. A pattern's subscription only
+    // remembers the last key it queued.
+    if (subscription->pending > subscriber->first &&
+        same_key(slot(subscriber, subscription->pending - 1), change)) {
+      *slot(subscriber, subscription->pending - 1) = *change;
+      tally(&subscriber->suppressed, &total_suppressed, 1);
+    } else {
+      subscription->pending = enqueue(subscriber, change);
+    }
+    break;
+  case DELIVERY_DEBOUNCE:
+    hold(subscriber, change, subscription->window_ms);
+    break;
+  default:
+    enqueue(subscriber, change);
+  }
+}
+
+void notify_send(struct Subscription *subscription,
+                 const struct Notification *change) {
+  struct Subscriber *subscriber = subscription->subscriber;
+  pthread_mutex_lock(&subscriber->lock);
+  if (subscriber->fd != -1) {
+    send_queued(subscription, change);
+  }
+  pthread_mutex_unlock(&subscriber->lock);
+}
+
+// Takes the result of writing, or teeing, a change straight to a
+// subscriber's pipe, queueing it if the pipe was full. Called with the
+// subscriber's lock held.
+static void sent_directly(struct Subscription *subscription,
+                          const struct Notification *change, ssize_t written,
+                          size_t len) {
+  struct Subscriber *subscriber = subscription->subscriber;
+  if (written == (ssize_t)len) {
+    tally(&subscriber->sent, &total_sent, 1);
+  } else if (written == -1 && (errno == EAGAIN || errno == EINTR)) {
+    send_queued(subscription, change);
+  } else {
+    // The client is gone, as in flush. Pipes take up to PIPE_BUF bytes
+    // whole, so nothing was cut.
+    tally(&subscriber->dropped, &total_dropped, 1);
+  }
+}
+
+// Whether a change can go straight to a subscriber's pipe: nothing queued
+// for it may go out after it, and its mode does not hold it back. Called
+// with the subscriber's lock held.
+static int sends_directly(const struct Subscription *subscription) {
+  const struct Subscriber *subscriber = subscription->subscriber;
+  return subscriber->fd != -1 && subscriber->len == 0 &&
+         subscription->mode != DELIVERY_DEBOUNCE;
+}
+
+// Writes a change straight to a subscriber's pipe if it can take it, and
+// queues it otherwise. Called with the subscriber's lock held.
+static void write_directly(struct Subscription *subscription,
+                           const struct Notification *change) {
+  struct Subscriber *subscriber = subscription->subscriber;
+  if (sends_directly(subscription)) {
+    char message[NOTIFICATION_MAX_SIZE];
+    size_t len = encode(subscriber->framed, 0, change, message);
+    sent_directly(subscription, change, put(subscriber, message, len), len);
+  } else if (subscriber->fd != -1) {
+    send_queued(subscription, change);
+  }
+}
+
+// Fans a change out, with tee, to the subscribers on pipes that take one
+// layout of it and can take it right away. Called with the stage lock held.
+// @return 0 if the change was fanned out, 1 if tee is not supported: the
+// subscribers of the layout it was not teed to yet had it written instead.
+static int fan_out(struct Subscription *subscriptions, size_t count,
+                   const struct Notification *change, int framed) {
+  char message[NOTIFICATION_MAX_SIZE];
+  size_t len = encode(framed, 0, change, message);
+  int staged = 0;
+  // The subscriber teed to last is kept locked: the change is spliced to
+  // it, which empties the stage.
+  struct Subscription *last = NULL;
+
+  for (size_t i = 0; i < count; i++) {
+    struct Subscription *subscription = &subscriptions[i];
+    struct Subscriber *subscriber = subscription->subscriber;
+    if (subscriber->framed != framed || subscriber->ring != NULL) {
+      continue;
+    }
+    pthread_mutex_lock(&subscriber->lock);
+    if (!sends_directly(subscription)) {
+      if (subscriber->fd != -1) {
+        send_queued(subscription, change);
+      }
+      pthread_mutex_unlock(&subscriber->lock);
+      continue;
+    }
+    if (!staged) {
+      if (write(stage[1], message, len) != (ssize_t)len) {
+        perror("Failed to stage notification");
+        send_queued(subscription, change);
+        pthread_mutex_unlock(&subscriber->lock);
+        continue;
+      }
+      staged = 1;
+    }
+    if (last != NULL) {
+      ssize_t teed = tee(stage[0], last->subscriber->fd, len,
+                         SPLICE_F_NONBLOCK);
+      if (teed == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        char scratch[NOTIFICATION_MAX_SIZE];
+        if (read(stage[0], scratch, len) != (ssize_t)len) {
+          perror("Failed to empty notification stage");
+        }
+        // Those before were sent the change or had it queued already.
+        write_directly(last, change);
+        pthread_mutex_unlock(&last->subscriber->lock);
+        write_directly(subscription, change);
+        pthread_mutex_unlock(&subscriber->lock);
+        for (size_t j = i + 1; j < count; j++) {
+          struct Subscriber *rest = subscriptions[j].subscriber;
+          if (rest->framed == framed && rest->ring == NULL) {
+            pthread_mutex_lock(&rest->lock);
+            write_directly(&subscriptions[j], change);
+            pthread_mutex_unlock(&rest->lock);
+          }
+        }
+        return 1;
+      }
+      sent_directly(last, change, teed, len);
+      pthread_mutex_unlock(&last->subscriber->lock);
+    }
+    last = subscription;
+  }
+
+  if (last != NULL) {
+    ssize_t spliced = splice(stage[0], NULL, last->subscriber->fd, NULL, len,
+                             SPLICE_F_NONBLOCK);
+    sent_directly(last, change, spliced, len);
+    pthread_mutex_unlock(&last->subscriber->lock);
+    if (spliced != (ssize_t)len) {
+      char scratch[NOTIFICATION_MAX_SIZE];
+      if (read(stage[0], scratch, len) != (ssize_t)len) {
+        perror("Failed to empty notification stage");
+      }
+    }
+  }
+  return 0;
+}
+
+void notify_send_all(struct Subscription *subscriptions, size_t count,
+                     const struct Notification *change) {
+  enum NotifyFanout fanout = atomic_load(&notify_fanout);
+  if (fanout == NOTIFY_FANOUT_QUEUE) {
+    for (size_t i = 0; i < count; i++) {
+      notify_send(&subscriptions[i], change);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&stage_lock);
+  // Subscribers on pipes of the layouts below this one already have the
+  // change. Rings take no tee.
+  int framed = 0;
+  // Staging the change only pays off if it is teed at least once.
+  if (fanout == NOTIFY_FANOUT_TEE && count > 1) {
+    for (; framed <= 1; framed++) {
+      if (fan_out(subscriptions, count, change, framed) != 0) {
+        fprintf(stderr, "[ERROR] tee is not supported: notifications are "
+                        "written to each pipe instead\n");
+        atomic_store(&notify_fanout, NOTIFY_FANOUT_WRITE);
+        framed++;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct Subscriber *subscriber = subscriptions[i].subscriber;
+    if (subscriber->framed >= framed || subscriber->ring != NULL) {
+      pthread_mutex_lock(&subscriber->lock);
+      write_directly(&subscriptions[i], change);
+      pthread_mutex_unlock(&subscriber->lock);
+    }
+  }
+  pthread_mutex_unlock(&stage_lock);
+}
+
+int notify_stream(struct Subscriber *subscriber, uint64_t from) {
+  pthread_mutex_lock(&streams_lock);
+  pthread_mutex_lock(&subscriber->lock);
+  int result = 1;
+  if (subscriber->fd != -1 && subscriber->framed) {
+    if (!subscriber->streaming) {
+      subscriber->streaming = 1;
+      subscriber->next_stream = streams;
+      streams = subscriber;
+    }
+    subscriber->stream_next = from;
+    if (!subscriber->armed) {
+      arm(subscriber);
+    }
+    result = 0;
+  }
+  pthread_mutex_unlock(&subscriber->lock);
+  pthread_mutex_unlock(&streams_lock);
+  return result;
+}
+
+void notify_wake_streams(void) {
+  pthread_mutex_lock(&streams_lock);
+  for (struct Subscriber *subscriber = streams; subscriber != NULL;
+       subscriber = subscriber->next_stream) {
+    pthread_mutex_lock(&subscriber->lock);
+    if (subscriber->fd != -1 && !subscriber->armed) {
+      arm(subscriber);
+    }
+    pthread_mutex_unlock(&subscriber->lock);
+  }
+  pthread_mutex_unlock(&streams_lock);
+}
+
+void notify_close(struct Subscriber *subscriber) {
+  pthread_mutex_lock(&streams_lock);
+  if (subscriber->streaming) {
+    struct Subscriber **link = &streams;
+    while (*link != subscriber) {
+      link = &(*link)->next_stream;
+    }
+    *link = subscriber->next_stream;
+    pthread_mutex_lock(&subscriber->lock);
+    subscriber->streaming = 0;
+    pthread_mutex_unlock(&subscriber->lock);
+  }
+  pthread_mutex_unlock(&streams_lock);
+
+  pthread_mutex_lock(&subscriber->lock);
+  if (subscriber->fd != -1) {
+    if (flush(subscriber)) {
+      tally(&subscriber->dropped, &total_dropped, subscriber->len);
+    }
+    close_pipe(subscriber);
+  }
+  pthread_mutex_unlock(&subscriber->lock);
+}
+
+int notify_fd(struct Subscriber *subscriber) {
+  pthread_mutex_lock(&subscriber->lock);
+  int fd = subscriber->fd;
+  pthread_mutex_unlock(&subscriber->lock);
+  return fd;
+}
+
+void notify_report(FILE *stream) {
+  fprintf(stream, "Notifications: %zu delivered, %zu suppressed, %zu "
+                  "dropped\n",
+          atomic_load(&total_sent), atomic_load(&total_suppressed),
+          atomic_load(&total_dropped));
+}
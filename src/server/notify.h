@@ -0,0 +1,235 @@
+#ifndef KVS_NOTIFY_H
+#define KVS_NOTIFY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../common/constants.h"
+#include "../common/ring.h"
+
+#define NOTIFY_DEFAULT_THREADS 1
+#define NOTIFY_DEFAULT_QUEUE 256
+
+// Events taken from epoll per wakeup of a dispatcher thread.
+#define NOTIFY_MAX_EVENTS 64
+
+// Notification of version 1 and 2 sessions: key and value, each
+// space-padded to MAX_STRING_SIZE and NUL-terminated.
+#define NOTIFY_MESSAGE_SIZE (2 * (MAX_STRING_SIZE + 1))
+
+/// A change as it is queued. Its first NOTIFY_MESSAGE_SIZE bytes are the
+/// notification of version 1 and 2 sessions, and the lengths and sequence
+/// number make the frame of version 3 ones.
+struct Notification {
+  char key[MAX_STRING_SIZE + 1];   // Space-padded.
+  char value[MAX_STRING_SIZE + 1]; // Space-padded.
+  uint8_t key_len;
+  uint8_t value_len;
+  uint64_t seq;
+};
+
+_Static_assert(offsetof(struct Notification, value) == MAX_STRING_SIZE + 1,
+               "Notification starts with the padded message");
+
+// What happens to a change sent to a subscriber whose queue is full.
+enum NotifyPolicy {
+  NOTIFY_DROP_OLDEST, // The oldest queued change makes room.
+  NOTIFY_COALESCE,    // Replaces a queued change of the same key if there
+                      // is one, drops the oldest otherwise.
+  NOTIFY_DISCONNECT,  // The subscriber's notification pipe is closed.
+};
+
+// How a change goes out to the subscribers of a key. Subscribers that fall
+// behind get their changes queued whatever the fan-out. A teed change takes
+// a whole buffer of the pipe, of the 16 a pipe has by default, where
+// written ones share them.
+enum NotifyFanout {
+  NOTIFY_FANOUT_TEE,   // Written once to a staging pipe, and duplicated to
+                       // every subscriber's pipe with tee(2).
+  NOTIFY_FANOUT_WRITE, // Written to every subscriber's pipe.
+  NOTIFY_FANOUT_QUEUE, // Queued for the dispatcher threads to write.
+};
+
+// A change of a debounced key, held until its window closes.
+struct HeldChange {
+  struct Notification change;
+  uint64_t deadline_ns; // On CLOCK_MONOTONIC.
+};
+
+/// Where a session's notifications go. Changes are queued by writers, with
+/// the table lock held, and written by the dispatcher threads, which never
+/// wait for a subscriber: its pipe is non-blocking, and is watched until it
+/// has room again. Lives as long as the server, like the session it is part
+/// of, and is reused by the sessions that take its slot.
+struct Subscriber {
+  pthread_mutex_t lock;
+  int fd;     // Write end of the notification pipe, -1 while closed.
+  int armed;  // Queued changes, and fd is watched until it takes them.
+  int registered; // fd was added to the dispatchers' epoll instance.
+  int framed;     // fd takes frames, as version 3 sessions do.
+
+  // Ring of a session in shared memory, NULL otherwise. Notifications are
+  // written to it instead of fd, which is only closed after the last one,
+  // and room_bell is watched instead of fd. Like framed, it only changes
+  // while the subscriber has no subscription.
+  struct Ring *ring;
+  int bell;      // Rung for the client once notifications came.
+  int room_bell; // Rung by the client once the ring has room.
+  struct Notification *queue; // Ring of notify_capacity changes.
+  uint64_t first; // Position of the oldest queued change since fd opened.
+  size_t len;
+
+  // Changes of debounced keys, at most notify_capacity, and the timer that
+  // goes off when the earliest of them is due. The timer is created the
+  // first time it is needed, and kept open with the pipe.
+  struct HeldChange *held;
+  size_t num_held;
+  int timer_fd;
+  int timing; // The timer is set and watched.
+
+  // fd also takes the change log, from stream_next on, and the subscriber
+  // is in the list of streams. Only set with the lock of the list held too.
+  int streaming;
+  uint64_t stream_next;
+  struct Subscriber *next_stream;
+
+  size_t sent;       // Changes written to fd since it was opened.
+  size_t suppressed; // Changes replaced by a later one, as their mode says.
+  size_t dropped;    // Changes lost to the policy since fd was opened.
+};
+
+/// A session's subscription to a key, kept in the key's node. Only touched
+/// with the table lock held for writing.
+struct Subscription {
+  struct Subscriber *subscriber;
+  int mode;           // One of the DELIVERY_ modes of protocol.h.
+  uint32_t window_ms; // Debounce window.
+  // For DELIVERY_LATEST: 1 + the position in the subscriber's queue of the
+  // change not sent yet, 0 if there is none.
+  uint64_t pending;
+};
+
+/// Adds a session's subscription to a list of them, unless the session has
+/// one already. Called with the table lock held for writing.
+/// @param subscriptions List, grown with realloc.
+/// @param count Number of subscriptions in the list.
+/// @param subscriber Where the session's notifications go.
+/// @param mode One of the DELIVERY_ modes.
+/// @param window_ms Debounce window, for DELIVERY_DEBOUNCE.
+/// @return 1 if it was added, 0 if it existed already or memory ran out.
+int notify_subscription_add(struct Subscription **subscriptions,
+                            size_t *count, struct Subscriber *subscriber,
+                            int mode, uint32_t window_ms);
+
+/// Removes a session's subscription from a list, keeping the order of the
+/// rest. Called with the table lock held for writing.
+/// @param subscriptions List. Freed, and set to NULL, once empty.
+/// @param count Number of subscriptions in the list.
+/// @param subscriber Where the session's notifications go.
+/// @return 1 if it was there, 0 otherwise.
+int notify_subscription_remove(struct Subscription **subscriptions,
+                               size_t *count, struct Subscriber *subscriber);
+
+/// Starts the dispatcher threads. Must be called before any subscriber is
+/// opened.
+/// @param threads Number of dispatcher threads, at least 1.
+/// @param queue Changes queued per subscriber, at least 1.
+/// @param policy What to do with changes that do not fit the queue.
+/// @param fanout How changes go out to the subscribers of a key.
+/// @return 0 if the dispatchers were started, 1 otherwise.
+int notify_start(size_t threads, size_t queue, enum NotifyPolicy policy,
+                 enum NotifyFanout fanout);
+
+/// Parses the name of a policy: drop-oldest, coalesce or disconnect.
+/// @param name Name given on the command line.
+/// @param policy Set to the policy named.
+/// @return 0 if the name is known, 1 otherwise.
+int notify_parse_policy(const char *name, enum NotifyPolicy *policy);
+
+/// Parses the name of a fan-out: tee, write or queue.
+/// @param name Name given on the command line.
+/// @param fanout Set to the fan-out named.
+/// @return 0 if the name is known, 1 otherwise.
+int notify_parse_fanout(const char *name, enum NotifyFanout *fanout);
+
+/// Initializes a subscriber, closed. Called once, when its session is
+/// allocated.
+/// @param subscriber Subscriber to initialize.
+void notify_init(struct Subscriber *subscriber);
+
+/// Starts sending notifications to a pipe, which the subscriber owns from
+/// then on.
+/// @param subscriber Closed subscriber.
+/// @param fd Write end of the pipe. Made non-blocking.
+/// @param framed 1 to send frames, as protocol.h describes them for version
+/// 3, 0 to send NOTIFY_MESSAGE_SIZE bytes per change.
+/// @return 0 on success, 1 if the pipe was closed instead.
+int notify_open(struct Subscriber *subscriber, int fd, int framed);
+
+/// Has an open subscriber write its notifications to a ring instead of its
+/// pipe. The subscriber owns the doorbells from now on.
+/// @param subscriber Subscriber, open and not subscribed to anything yet.
+/// @param ring Ring, in memory mapped for as long as the pipe is open.
+/// @param bell Doorbell to ring for the client once notifications came.
+/// @param room_bell Doorbell the client rings once the ring has room.
+void notify_use_ring(struct Subscriber *subscriber, struct Ring *ring,
+                     int bell, int room_bell);
+
+/// Fills in a change.
+/// @param change Change to fill in.
+/// @param key Key that changed.
+/// @param value Its new value, or "DELETED".
+/// @param seq Number of the change among all the server made.
+void notify_prepare(struct Notification *change, const char *key,
+                    const char *value, uint64_t seq);
+
+/// Sends a change to a subscriber as the subscription's mode says, without
+/// ever blocking on its pipe. Does nothing if the subscriber is closed.
+/// @param subscription Subscription to the key that changed.
+/// @param change Change to send.
+void notify_send(struct Subscription *subscription,
+                 const struct Notification *change);
+
+/// Sends a change to every subscription of a key. Subscribers with nothing
+/// queued, and no debounce, get it right away, as the fan-out says; the
+/// rest get it as notify_send sends it. Called with the table lock held,
+/// for writing, so one change goes out at a time.
+/// @param subscriptions Subscriptions to the key that changed.
+/// @param count Number of subscriptions.
+/// @param change Change to send.
+void notify_send_all(struct Subscription *subscriptions, size_t count,
+                     const struct Notification *change);
+
+/// Streams the change log to a subscriber's pipe, from a change on, as
+/// frames: every change the log holds from there, then every change made
+/// after. Changes no longer kept are skipped. Moves the stream to the change
+/// if it was streaming already.
+/// @param subscriber Subscriber that takes frames.
+/// @param from Sequence number of the first change to send.
+/// @return 0 if the log is streamed, 1 if the subscriber is closed or does
+/// not take frames.
+int notify_stream(struct Subscriber *subscriber, uint64_t from);
+
+/// Has the change log streamed to every subscriber streaming it, once a
+/// change was appended to it.
+void notify_wake_streams(void);
+
+/// Writes what is still queued if the pipe has room, then closes it.
+/// Changes still held are dropped. Nothing is sent after this returns.
+/// Does nothing if already closed.
+/// @param subscriber Subscriber to close. Must not be subscribed to any key.
+void notify_close(struct Subscriber *subscriber);
+
+/// Descriptor notifications are written to.
+/// @param subscriber Subscriber to look at.
+/// @return The write end of its pipe, or -1 if it is closed.
+int notify_fd(struct Subscriber *subscriber);
+
+/// Prints the changes delivered, suppressed by delivery modes and dropped
+/// by the policy, over every subscriber since the server started.
+/// @param stream Stream to print to.
+void notify_report(FILE *stream);
+
+#endif // KVS_NOTIFY_H
@@ -7,14 +7,36 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#include "../common/io.h"
 
+#include "cdc.h"
 #include "constants.h"
 #include "io.h"
 #include "kvs.h"
+#include "patterns.h"
 
 static struct HashTable *kvs_table = NULL;
 
+// Changes made to the table so far, which numbers them, counting those of
+// the change log an earlier server left. Only touched with the write lock
+// held.
+static uint64_t change_seq = 0;
+
+// Number of times the calling thread has taken the table lock.
+static _Thread_local size_t lock_acquisitions = 0;
+
+// The table lock arbitrates between the QoS class of each thread: see qos.h.
+static void table_rdlock(void) {
+  qos_rdlock(&kvs_table->tablelock);
+  lock_acquisitions++;
+}
+
+static void table_wrlock(void) {
+  qos_wrlock(&kvs_table->tablelock);
+  lock_acquisitions++;
+}
+
+static void table_unlock(void) { qos_unlock(&kvs_table->tablelock); }
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -29,6 +51,7 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
+  change_seq = cdc_last();
   return kvs_table == NULL;
 }
 
@@ -40,18 +63,13 @@ int kvs_terminate() {
 
   free_table(kvs_table);
   kvs_table = NULL;
+  patterns_free();
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
-    fprintf(stderr, "KVS state must be initialized\n");
-    return 1;
-  }
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
-  
-
+// Writes pairs to the table. The write lock must be held.
+static void write_locked(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                         char values[][MAX_STRING_SIZE]) {
   for (size_t i = 0; i < num_pairs; i++) {
     char *old_value = read_pair(kvs_table, keys[i]);
     if (write_pair(kvs_table, keys[i], values[i]) != 0) {
@@ -65,95 +83,205 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
     }
     free(old_value);
   }
+}
+
+// Deletes pairs from the table, reporting missing keys in out. The write lock
+// must be held.
+static void delete_locked(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                          struct OutBuffer *out) {
+  int aux = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (delete_pair(kvs_table, keys[i]) != 0) {
+      if (!aux) {
+        out_buffer_str(out, "[");
+        aux = 1;
+      }
+      char str[MAX_STRING_SIZE + sizeof("(,KVSMISSING)")];
+      snprintf(str, sizeof(str), "(%s,KVSMISSING)", keys[i]);
+      out_buffer_str(out, str);
+    } 
+  }
+  if (aux) {
+    out_buffer_str(out, "]\n");
+  }
+}
+
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+              char values[][MAX_STRING_SIZE]) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  table_wrlock();
+
+  write_locked(num_pairs, keys, values);
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  table_unlock();
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+             struct OutBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  table_rdlock();
 
-  write_str(fd, "[");
+  out_buffer_str(out, "[");
   for (size_t i = 0; i < num_pairs; i++) {
     char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
+    char aux[2 * MAX_STRING_SIZE + 3];
     if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+      snprintf(aux, sizeof(aux), "(%s,KVSERROR)", keys[i]);
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      snprintf(aux, sizeof(aux), "(%s,%s)", keys[i], result);
     }
-    write_str(fd, aux);
+    out_buffer_str(out, aux);
     free(result);
   }
-  write_str(fd, "]\n");
+  out_buffer_str(out, "]\n");
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  table_unlock();
+  out_buffer_flush_full(out);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+               struct OutBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  table_wrlock();
 
-  int aux = 0;
-  for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write_str(fd, "[");
-        aux = 1;
-      }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
-    } 
+  delete_locked(num_pairs, keys, out);
+
+  table_unlock();
+  out_buffer_flush_full(out);
+  return 0;
+}
+
+int kvs_apply_batch(struct WriteBatch *batch, struct OutBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
-  if (aux) {
-    write_str(fd, "]\n");
+
+  if (batch->num_commands == 0) {
+    return 0;
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  table_wrlock();
+
+  for (size_t i = 0; i < batch->num_commands; i++) {
+    struct BatchCommand *command = &batch->commands[i];
+    if (command->kind == BATCH_WRITE) {
+      write_locked(command->num_pairs, batch->keys + command->first,
+                   batch->values + command->first);
+    } else {
+      delete_locked(command->num_pairs, batch->keys + command->first, out);
+    }
+  }
+
+  table_unlock();
+  out_buffer_flush_full(out);
+
+  batch->num_commands = 0;
+  batch->num_pairs = 0;
   return 0;
 }
 
-void kvs_show(int fd) {
+size_t kvs_lock_acquisitions() { return lock_acquisitions; }
+
+void kvs_qos_report(FILE *stream) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
+  qos_report(&kvs_table->tablelock, stream);
+}
+
+// Where a SHOW stopped between two chunks.
+struct ShowCursor {
+  int bucket;
+  KeyNode *last;           // Last node shown in the bucket, NULL at its start.
+  unsigned long last_seq;  // Its insertion sequence number.
+  unsigned long deletions; // Deletions in the bucket when it was shown.
+};
+
+// Appends the next chunk of pairs to the output under one acquisition of the
+// read lock.
+// @param cursor Position to resume from, advanced past the pairs shown.
+// @param out Output buffer to append to.
+// @return 1 if there are more buckets to show, 0 once the table is done.
+static int show_chunk(struct ShowCursor *cursor, struct OutBuffer *out) {
+  size_t shown = 0;
+
+  table_rdlock();
+  while (cursor->bucket < TABLE_SIZE && shown < SHOW_CHUNK_PAIRS) {
+    KeyNode *keyNode = kvs_table->table[cursor->bucket];
+    if (cursor->last != NULL &&
+        kvs_table->deletions[cursor->bucket] == cursor->deletions) {
+      // Nothing was freed from the list, so the last node is still in it.
+      keyNode = cursor->last->next;
+    } else if (cursor->last != NULL) {
+      // Lists are in decreasing insertion order and new nodes go at the
+      // head: skip to the first node older than the last one shown.
+      while (keyNode != NULL && keyNode->seq >= cursor->last_seq) {
+        keyNode = keyNode->next;
+      }
+    }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+    for (; keyNode != NULL && shown < SHOW_CHUNK_PAIRS; shown++) {
+      out_buffer_str(out, "(");
+      out_buffer_str(out, keyNode->key);
+      out_buffer_str(out, ", ");
+      out_buffer_str(out, keyNode->value);
+      out_buffer_str(out, ")\n");
+      cursor->last = keyNode;
+      cursor->last_seq = keyNode->seq;
+      keyNode = keyNode->next;
+    }
+    cursor->deletions = kvs_table->deletions[cursor->bucket];
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+    if (keyNode == NULL) {
+      cursor->bucket++;
+      cursor->last = NULL;
     }
   }
+  table_unlock();
+
+  return cursor->bucket < TABLE_SIZE;
+}
+
+void kvs_show(struct OutBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  struct ShowCursor cursor = {0, NULL, 0, 0};
+  int more;
+  do {
+    more = show_chunk(&cursor, out);
+    out_buffer_flush_full(out);
+  } while (more);
 }
 
-int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
+int kvs_backup(size_t num_backup, const char *job_filename,
+               char *directory) {
   pid_t pid;
   char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
-           strtok(job_filename, "."), num_backup);
+  // The scheduler still knows the job by its full name, so the extension is
+  // left out of the backup name rather than cut off the job's.
+  snprintf(bck_name, sizeof(bck_name), "%s/%.*s-%ld.bck", directory,
+           (int)strcspn(job_filename, "."), job_filename, num_backup);
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  table_rdlock();
   pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  table_unlock();
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
@@ -190,205 +318,126 @@ void kvs_wait(unsigned int delay_ms) {
   nanosleep(&delay, NULL);
 }
 
-int kvs_subscribe(char key[MAX_STRING_SIZE], const char* notif_pipe_path) {
-    pthread_rwlock_wrlock(&kvs_table->tablelock);
-    KeyNode *keyNode = kvs_table->table[hash(key)];
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            
-            // Check if notif_pipe_path already exists
-            for (int i = 0; i < keyNode->notif_pipe_count; i++) {
-                if (strcmp(keyNode->notif_pipe_paths[i], notif_pipe_path) == 0) {
-                    // Already subscribed
-                    pthread_rwlock_unlock(&kvs_table->tablelock);
-                    return 0;
-                }
-            }
-
-            // Duplicate notif_pipe_path
-            char *notif_pipe = strdup(notif_pipe_path);
-            if (!notif_pipe) {
-                pthread_rwlock_unlock(&kvs_table->tablelock);
-                return 0;
-            }
-
-            // Save old array of pointers
-            char **old_paths = keyNode->notif_pipe_paths;
-
-            // Allocate new array with one extra slot
-            keyNode->notif_pipe_paths = malloc((size_t)(keyNode->notif_pipe_count + 1) * sizeof(char *));
-            if (!keyNode->notif_pipe_paths) {
-                // Restore old pointer and free new string
-                keyNode->notif_pipe_paths = old_paths;
-                free(notif_pipe);
-                pthread_rwlock_unlock(&kvs_table->tablelock);
-                return 0;
-            }
-
-            // Copy old pointers to new array
-            for (int i = 0; i < keyNode->notif_pipe_count; i++) {
-                keyNode->notif_pipe_paths[i] = old_paths[i];
-            }
-
-            // Free the old pointer array (not the strings)
-            if (old_paths) {
-                free(old_paths);
-            }
-
-            // Add the new path
-            keyNode->notif_pipe_paths[keyNode->notif_pipe_count] = notif_pipe;
-            keyNode->notif_pipe_count++;
-
-            pthread_rwlock_unlock(&kvs_table->tablelock);
-            return 1;
-        }
+// Finds the node of a key. Called with the table lock held.
+// @return The node, or NULL if the key does not exist or cannot be stored.
+static KeyNode *find_node(const char *key) {
+    int index = hash(key);
+    if (index < 0) {
+        return NULL;
+    }
+    KeyNode *keyNode = kvs_table->table[index];
+    while (keyNode != NULL && strcmp(keyNode->key, key) != 0) {
         keyNode = keyNode->next;
     }
-    pthread_rwlock_unlock(&kvs_table->tablelock);
-    return 0; // Key not found
+    return keyNode;
 }
 
-int kvs_unsubscribe(char key[MAX_STRING_SIZE], const char* notif_pipe_path) {
-    pthread_rwlock_wrlock(&kvs_table->tablelock);
-    KeyNode *keyNode = kvs_table->table[hash(key)];
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Find the index of the pipe to remove
-            int remove_index = -1;
-            for (int i = 0; i < keyNode->notif_pipe_count; i++) {
-                if (strcmp(keyNode->notif_pipe_paths[i], notif_pipe_path) == 0) {
-                    remove_index = i;
-                    break;
-                }
-            }
-            if (remove_index == -1) {
-                // Pipe not found
-                pthread_rwlock_unlock(&kvs_table->tablelock);
-                return 0;
-            }
-
-            // Free the string for the pipe to be removed
-            free(keyNode->notif_pipe_paths[remove_index]);
-
-            // If only one pipe, free array entirely
-            if (keyNode->notif_pipe_count == 1) {
-                free(keyNode->notif_pipe_paths);
-                keyNode->notif_pipe_paths = NULL;
-                keyNode->notif_pipe_count = 0;
-                pthread_rwlock_unlock(&kvs_table->tablelock);
-                return 1;
+size_t kvs_subscribe(size_t num_keys, const char *const keys[],
+                     struct Subscriber *subscriber, int mode,
+                     uint32_t window_ms, unsigned char *results) {
+    size_t subscribed = 0;
+    table_wrlock();
+    for (size_t i = 0; i < num_keys; i++) {
+        KeyNode *keyNode = find_node(keys[i]);
+        if (keyNode != NULL &&
+            notify_subscription_add(&keyNode->subscriptions,
+                                    &keyNode->subscription_count, subscriber,
+                                    mode, window_ms)) {
+            subscribed++;
+            if (results != NULL) {
+                results[i / 8] |= (unsigned char)(1u << (i % 8));
             }
+        }
+    }
+    table_unlock();
+    return subscribed;
+}
 
-            // Rebuild array without removed element
-            char **old_paths = keyNode->notif_pipe_paths;
-            keyNode->notif_pipe_count--;
-            keyNode->notif_pipe_paths = malloc((size_t)keyNode->notif_pipe_count * sizeof(char*));
-            if (!keyNode->notif_pipe_paths) {
-                // Restore old array in case of failure
-                keyNode->notif_pipe_paths = old_paths;
-                keyNode->notif_pipe_count++;
-                pthread_rwlock_unlock(&kvs_table->tablelock);
-                return 0;
-            }
-            int j = 0;
-            for (int i = 0; i < keyNode->notif_pipe_count + 1; i++) {
-                if (i != remove_index) {
-                    keyNode->notif_pipe_paths[j++] = old_paths[i];
-                }
+size_t kvs_unsubscribe(size_t num_keys, const char *const keys[],
+                       struct Subscriber *subscriber,
+                       unsigned char *results) {
+    size_t removed = 0;
+    table_wrlock();
+    for (size_t i = 0; i < num_keys; i++) {
+        KeyNode *keyNode = find_node(keys[i]);
+        if (keyNode != NULL &&
+            notify_subscription_remove(&keyNode->subscriptions,
+                                       &keyNode->subscription_count,
+                                       subscriber)) {
+            removed++;
+            if (results != NULL) {
+                results[i / 8] |= (unsigned char)(1u << (i % 8));
             }
-            free(old_paths);
-            pthread_rwlock_unlock(&kvs_table->tablelock);
-            return 1;
         }
-        keyNode = keyNode->next;
     }
-    pthread_rwlock_unlock(&kvs_table->tablelock);
-    return 0; // Key not found
+    table_unlock();
+    return removed;
+}
+
+int kvs_psubscribe(const char *pattern, struct Subscriber *subscriber,
+                   int mode, uint32_t window_ms) {
+    table_wrlock();
+    int added = patterns_subscribe(pattern, subscriber, mode, window_ms);
+    table_unlock();
+    return added;
+}
+
+int kvs_punsubscribe(const char *pattern, struct Subscriber *subscriber) {
+    table_wrlock();
+    int removed = patterns_unsubscribe(pattern, subscriber);
+    table_unlock();
+    return removed;
 }
 
 void kvs_print_notif_pipes(const char *key) {
-    pthread_rwlock_rdlock(&kvs_table->tablelock);
+    table_rdlock();
     KeyNode *keyNode = kvs_table->table[hash(key)];
     while (keyNode) {
         if (strcmp(keyNode->key, key) == 0) {
             printf("Notification pipes for key: %s\n", key);
-            for (int i = 0; i < keyNode->notif_pipe_count; i++) {
-                printf("  [%d] %s\n", i, keyNode->notif_pipe_paths[i]);
+            for (size_t i = 0; i < keyNode->subscription_count; i++) {
+                printf("  [%zu] fd %d, mode %d\n", i,
+                       notify_fd(keyNode->subscriptions[i].subscriber),
+                       keyNode->subscriptions[i].mode);
             }
-            pthread_rwlock_unlock(&kvs_table->tablelock);
+            table_unlock();
             return;
         }
         keyNode = keyNode->next;
     }
-    pthread_rwlock_unlock(&kvs_table->tablelock);
+    table_unlock();
     printf("No notification pipes found for key: %s\n", key);
 }
 
-// Consider calling this in your disconnect() function
-void kvs_unsubscribe_all_keys(const char *client_name) {
-    // Acquire a write lock to modify the table
-    pthread_rwlock_wrlock(&kvs_table->tablelock);
-    
+void kvs_unsubscribe_all_keys(struct Subscriber *subscriber) {
+    // Changes are queued with the write lock held, so none is queued for
+    // the session once this returns.
+    table_wrlock();
     for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = kvs_table->table[i];
-
-        while (keyNode) {
-            int j = 0;
-            // Iterate all pipes in this keyNode
-            while (j < keyNode->notif_pipe_count) {
-                // If pipe matches client_name (substring check or exact match)
-                if (strstr(keyNode->notif_pipe_paths[j], client_name)) {
-                    // Free the string
-                    free(keyNode->notif_pipe_paths[j]);
-                    
-                    // Shift the rest left
-                    for (int k = j; k < keyNode->notif_pipe_count - 1; k++) {
-                        keyNode->notif_pipe_paths[k] = keyNode->notif_pipe_paths[k + 1];
-                    }
-                    keyNode->notif_pipe_count--;
-                } else {
-                    j++;
-                }
-            }
-            // If the list is empty, free the array
-            if (keyNode->notif_pipe_count == 0) {
-                free(keyNode->notif_pipe_paths);
-                keyNode->notif_pipe_paths = NULL;
-            }
-            keyNode = keyNode->next;
+        for (KeyNode *keyNode = kvs_table->table[i]; keyNode;
+             keyNode = keyNode->next) {
+            notify_subscription_remove(&keyNode->subscriptions,
+                                       &keyNode->subscription_count,
+                                       subscriber);
         }
     }
-    
-    pthread_rwlock_unlock(&kvs_table->tablelock);
+    patterns_unsubscribe_all(subscriber);
+    table_unlock();
 }
 
 int kvs_notify(const char *key, const char *value) {
-    
-    KeyNode *keyNode = kvs_table->table[hash(key)];
-    while (keyNode) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Create fixed-size notification message
-            char key_buf[41]   = {0};
-            char value_buf[41] = {0};
-            memset(key_buf,   ' ', 40);
-            memset(value_buf, ' ', 40);
-            strncpy(key_buf,   key,   strlen(key));
-            strncpy(value_buf, value, strlen(value));
-
-            for (int i = 0; i < keyNode->notif_pipe_count; i++) {
-                if (keyNode->notif_pipe_paths[i]) {
-                    int fd = open(keyNode->notif_pipe_paths[i], O_WRONLY);
-                    if (fd != -1) {
-                        write_all(fd, key_buf,   41);
-                        write_all(fd, value_buf, 41);
-                        close(fd);
-                    }
-                }
-            }
-            break;
-        }
-        keyNode = keyNode->next;
+    struct Notification change;
+    notify_prepare(&change, key, value, ++change_seq);
+    cdc_append(&change);
+    notify_wake_streams();
+
+    // Never blocks on a pipe: a subscriber that does not read gets the
+    // change queued, for the dispatchers to write, and holds nobody up.
+    KeyNode *keyNode = find_node(key);
+    if (keyNode != NULL) {
+        notify_send_all(keyNode->subscriptions, keyNode->subscription_count,
+                        &change);
     }
-    
+    patterns_notify(key, &change);
     return 0;
-}
\ No newline at end of file
+}
@@ -2,8 +2,37 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "constants.h"
+#include "io.h"
+#include "notify.h"
+
+// Most pairs and commands a batch of coalesced writes can hold.
+#define MAX_BATCH_PAIRS (4 * MAX_WRITE_SIZE)
+#define MAX_BATCH_COMMANDS 256
+
+// Most pairs SHOW copies out of the table per acquisition of the lock.
+#define SHOW_CHUNK_PAIRS 256
+
+enum BatchKind { BATCH_WRITE, BATCH_DELETE };
+
+struct BatchCommand {
+  enum BatchKind kind;
+  size_t first;     // Index of the command's first pair in the batch.
+  size_t num_pairs;
+};
+
+/// Consecutive WRITE and DELETE commands of a job, kept in their original
+/// order so applying them gives the same result as running them one by one.
+struct WriteBatch {
+  struct BatchCommand commands[MAX_BATCH_COMMANDS];
+  size_t num_commands;
+  size_t num_pairs;
+  char keys[MAX_BATCH_PAIRS][MAX_STRING_SIZE];
+  char values[MAX_BATCH_PAIRS][MAX_STRING_SIZE];
+};
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
@@ -21,41 +50,116 @@ int kvs_terminate();
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]);
 
+/// Applies a batch of WRITE and DELETE commands in order, taking the table
+/// lock only once, and empties it.
+/// @param batch Batch to apply.
+/// @param out Output buffer to report missing keys of DELETEs in.
+/// @return 0 if the batch was applied successfully, 1 otherwise.
+int kvs_apply_batch(struct WriteBatch *batch, struct OutBuffer *out);
+
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Output buffer to write the (successful) output. It is only
+/// flushed after the table lock is released.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+             struct OutBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param out Output buffer to report missing keys in.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+               struct OutBuffer *out);
 
-/// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// Writes the state of the KVS. The table is walked in chunks of at most
+/// SHOW_CHUNK_PAIRS pairs, letting go of the lock in between, so pairs
+/// written or deleted during a SHOW may or may not be shown. Every other pair
+/// is shown exactly once.
+/// @param out Output buffer to write the output.
+void kvs_show(struct OutBuffer *out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// backup file, named after the job without its extension.
+/// @param job_filename Name of the job. It is not changed.
 /// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(size_t num_backup, char *job_filename, char *directory);
+int kvs_backup(size_t num_backup, const char *job_filename,
+               char *directory);
 
 /// Waits for the last backup to be called.
 void kvs_wait_backup();
 
+/// Number of times the calling thread has acquired the table lock.
+/// @return Lock acquisitions so far.
+size_t kvs_lock_acquisitions();
+
+/// Prints the table lock waits of each QoS class.
+/// @param stream Stream to print to.
+void kvs_qos_report(FILE *stream);
+
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
 
-int kvs_subscribe(char key[MAX_STRING_SIZE], const char *notif_pipe_path);
-
-int kvs_unsubscribe(char key[MAX_STRING_SIZE], const char* notif_pipe_path);
-
-void kvs_unsubscribe_all_keys(const char *client_name);
-
+/// Subscribes a session to the changes of keys, all under one acquisition
+/// of the table lock.
+/// @param num_keys Number of keys.
+/// @param keys Keys to subscribe to.
+/// @param subscriber Where the session's notifications go.
+/// @param mode How changes are delivered: one of the DELIVERY_ modes.
+/// @param window_ms Debounce window, for DELIVERY_DEBOUNCE.
+/// @param results If not NULL, a bitmap of (num_keys + 7) / 8 zeroed bytes.
+/// Bit i % 8 of byte i / 8 is set if keys[i] exists and the session was
+/// not subscribed to it yet. An existing subscription keeps its mode.
+/// @return Number of keys subscribed to.
+size_t kvs_subscribe(size_t num_keys, const char *const keys[],
+                     struct Subscriber *subscriber, int mode,
+                     uint32_t window_ms, unsigned char *results);
+
+/// Removes a session's subscriptions to keys, all under one acquisition of
+/// the table lock.
+/// @param num_keys Number of keys.
+/// @param keys Keys to unsubscribe from.
+/// @param subscriber Where the session's notifications go.
+/// @param results If not NULL, a bitmap of (num_keys + 7) / 8 zeroed bytes.
+/// Bit i % 8 of byte i / 8 is set if the subscription to keys[i] existed
+/// and was removed.
+/// @return Number of subscriptions removed.
+size_t kvs_unsubscribe(size_t num_keys, const char *const keys[],
+                       struct Subscriber *subscriber,
+                       unsigned char *results);
+
+/// Subscribes a session to the changes of every key matching a pattern,
+/// the keys created later included. See patterns.h.
+/// @param pattern Valid pattern.
+/// @param subscriber Where the session's notifications go.
+/// @param mode How changes are delivered: one of the DELIVERY_ modes.
+/// @param window_ms Debounce window, for DELIVERY_DEBOUNCE.
+/// @return 1 if the session was not subscribed to the pattern yet, 0
+/// otherwise.
+int kvs_psubscribe(const char *pattern, struct Subscriber *subscriber,
+                   int mode, uint32_t window_ms);
+
+/// Removes a session's subscription to a pattern.
+/// @param pattern Pattern to unsubscribe from.
+/// @param subscriber Where the session's notifications go.
+/// @return 1 if the subscription existed and was removed, 0 otherwise.
+int kvs_punsubscribe(const char *pattern, struct Subscriber *subscriber);
+
+/// Removes every subscription of a session, to keys and to patterns. Once
+/// it returns, no change is queued for the session any more.
+/// @param subscriber Where the session's notifications go.
+void kvs_unsubscribe_all_keys(struct Subscriber *subscriber);
+
+/// Numbers a change of a key and appends it to the change log, then sends
+/// it to the key's subscribers, and those of the patterns it matches,
+/// without waiting for any of them. Must be called with the table lock held
+/// for writing.
+/// @param key Key that changed.
+/// @param notif New value, or "DELETED".
+/// @return 0.
 int kvs_notify(const char *key, const char *notif);
 
 void kvs_print_notif_pipes(const char *key);
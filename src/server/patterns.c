@@ -0,0 +1,254 @@
+#include "patterns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/constants.h"
+
+// A node of the trie: the pattern spelled by the edges from the root to it.
+// A node reached through '*' stays matched while the key goes on, and one
+// reached through '?' takes any character.
+struct PatternNode {
+  char c; // Character of the edge from the parent, '\0' for the root.
+  struct PatternNode *parent;
+  struct PatternNode **children;
+  size_t num_children;
+  struct Subscription *subscriptions; // Of the pattern ending here.
+  size_t subscription_count;
+  unsigned long mark; // Last step of a match the node was reached in.
+};
+
+static struct PatternNode root;
+static size_t num_nodes = 1;
+
+// Nodes matched by the key so far, and by one more character of it. Sized
+// for every node of the trie.
+static struct PatternNode **matched;
+static struct PatternNode **matching;
+static size_t match_capacity;
+static unsigned long step;
+
+int patterns_valid(const char *pattern) {
+  size_t len = strnlen(pattern, MAX_STRING_SIZE + 1);
+  return len > 0 && len <= MAX_STRING_SIZE &&
+         strpbrk(pattern, " ,()[]") == NULL;
+}
+
+// Finds the child of a node along an edge.
+// @return The child, or NULL if there is none.
+static struct PatternNode *find_child(const struct PatternNode *node,
+                                      char c) {
+  for (size_t i = 0; i < node->num_children; i++) {
+    if (node->children[i]->c == c) {
+      return node->children[i];
+    }
+  }
+  return NULL;
+}
+
+// Adds a child to a node.
+// @return The child, or NULL if memory ran out.
+static struct PatternNode *add_child(struct PatternNode *node, char c) {
+  struct PatternNode **children =
+      realloc(node->children, (node->num_children + 1) * sizeof(*children));
+  if (children == NULL) {
+    return NULL;
+  }
+  node->children = children;
+  struct PatternNode *child = calloc(1, sizeof(*child));
+  if (child == NULL) {
+    return NULL;
+  }
+  child->c = c;
+  child->parent = node;
+  children[node->num_children++] = child;
+  num_nodes++;
+  return child;
+}
+
+// Frees a node, other than the root, that no pattern needs any more.
+// @return 1 if it was freed, 0 if it is still needed.
+static int prune_node(struct PatternNode *node) {
+  if (node->subscription_count > 0 || node->num_children > 0) {
+    return 0;
+  }
+  struct PatternNode *parent = node->parent;
+  for (size_t i = 0; i < parent->num_children; i++) {
+    if (parent->children[i] == node) {
+      parent->children[i] = parent->children[--parent->num_children];
+      break;
+    }
+  }
+  if (parent->num_children == 0) {
+    free(parent->children);
+    parent->children = NULL;
+  }
+  free(node);
+  num_nodes--;
+  return 1;
+}
+
+// Frees the nodes on the way up from a node that no pattern needs any more.
+static void prune(struct PatternNode *node) {
+  while (node != &root) {
+    struct PatternNode *parent = node->parent;
+    if (!prune_node(node)) {
+      return;
+    }
+    node = parent;
+  }
+}
+
+// Walks the trie along a pattern, adding the nodes missing if asked to.
+// Runs of '*' are the same as one.
+// @return The node of the pattern, or NULL if it is not in the trie, or
+// memory ran out. Nodes added before running out are left to prune.
+static struct PatternNode *walk(const char *pattern, int add,
+                                struct PatternNode **last) {
+  struct PatternNode *node = &root;
+  for (const char *c = pattern; *c != '\0'; c++) {
+    if (*c == '*' && node->c == '*') {
+      continue;
+    }
+    struct PatternNode *child = find_child(node, *c);
+    if (child == NULL && add) {
+      child = add_child(node, *c);
+    }
+    if (child == NULL) {
+      *last = node;
+      return NULL;
+    }
+    node = child;
+  }
+  *last = node;
+  return node;
+}
+
+int patterns_subscribe(const char *pattern, struct Subscriber *subscriber,
+                       int mode, uint32_t window_ms) {
+  struct PatternNode *last;
+  struct PatternNode *node = walk(pattern, 1, &last);
+  if (node == NULL ||
+      !notify_subscription_add(&node->subscriptions,
+                               &node->subscription_count, subscriber, mode,
+                               window_ms)) {
+    prune(last);
+    return 0;
+  }
+  return 1;
+}
+
+int patterns_unsubscribe(const char *pattern, struct Subscriber *subscriber) {
+  struct PatternNode *last;
+  struct PatternNode *node = walk(pattern, 0, &last);
+  if (node == NULL ||
+      !notify_subscription_remove(&node->subscriptions,
+                                  &node->subscription_count, subscriber)) {
+    return 0;
+  }
+  prune(node);
+  return 1;
+}
+
+// Removes a session's subscriptions below a node, and the node itself if
+// nothing is left of it.
+static void unsubscribe_below(struct PatternNode *node,
+                              struct Subscriber *subscriber) {
+  // A child that goes away swaps in the last one, already done.
+  for (size_t i = node->num_children; i > 0; i--) {
+    unsubscribe_below(node->children[i - 1], subscriber);
+  }
+  notify_subscription_remove(&node->subscriptions, &node->subscription_count,
+                             subscriber);
+  if (node != &root) {
+    prune_node(node);
+  }
+}
+
+void patterns_unsubscribe_all(struct Subscriber *subscriber) {
+  unsubscribe_below(&root, subscriber);
+}
+
+// Adds a node to a set of matched nodes, with the node of the '*' that
+// may follow it: a star matches the empty run too.
+static void add_matched(struct PatternNode **set, size_t *len,
+                        struct PatternNode *node) {
+  while (node != NULL && node->mark != step) {
+    node->mark = step;
+    set[(*len)++] = node;
+    node = node->c == '*' ? NULL : find_child(node, '*');
+  }
+}
+
+void patterns_notify(const char *key, const struct Notification *change) {
+  if (root.num_children == 0) {
+    return;
+  }
+  if (match_capacity < num_nodes) {
+    struct PatternNode **grown_matched =
+        realloc(matched, num_nodes * sizeof(*matched));
+    if (grown_matched != NULL) {
+      matched = grown_matched;
+    }
+    struct PatternNode **grown_matching =
+        realloc(matching, num_nodes * sizeof(*matching));
+    if (grown_matching != NULL) {
+      matching = grown_matching;
+    }
+    if (grown_matched == NULL || grown_matching == NULL) {
+      fprintf(stderr, "Failed to match patterns against key: %s\n", key);
+      return;
+    }
+    match_capacity = num_nodes;
+  }
+
+  size_t num_matched = 0;
+  step++;
+  add_matched(matched, &num_matched, &root);
+  for (const char *c = key; *c != '\0' && num_matched > 0; c++) {
+    size_t num_matching = 0;
+    step++;
+    for (size_t i = 0; i < num_matched; i++) {
+      struct PatternNode *node = matched[i];
+      if (node->c == '*') {
+        add_matched(matching, &num_matching, node);
+      }
+      for (size_t j = 0; j < node->num_children; j++) {
+        struct PatternNode *child = node->children[j];
+        if (child->c == *c || child->c == '?') {
+          add_matched(matching, &num_matching, child);
+        }
+      }
+    }
+    struct PatternNode **swap = matched;
+    matched = matching;
+    matching = swap;
+    num_matched = num_matching;
+  }
+
+  for (size_t i = 0; i < num_matched; i++) {
+    notify_send_all(matched[i]->subscriptions, matched[i]->subscription_count,
+                    change);
+  }
+}
+
+// Frees the nodes below a node, and their subscriptions.
+static void free_below(struct PatternNode *node) {
+  for (size_t i = 0; i < node->num_children; i++) {
+    free_below(node->children[i]);
+    free(node->children[i]);
+  }
+  free(node->children);
+  free(node->subscriptions);
+}
+
+void patterns_free(void) {
+  free_below(&root);
+  memset(&root, 0, sizeof(root));
+  num_nodes = 1;
+  free(matched);
+  free(matching);
+  matched = matching = NULL;
+  match_capacity = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef KVS_PATTERNS_H
+#define KVS_PATTERNS_H
+
+#include <stdint.h>
+
+#include "notify.h"
+
+/// Pattern subscriptions, kept in a trie shared by every session. A
+/// pattern is matched against whole keys: '*' stands for any run of
+/// characters, the empty one included, and '?' for exactly one, so
+/// "user:*" subscribes to every key that starts with "user:". Keys that do
+/// not exist yet are matched when they are created.
+///
+/// Like the subscriptions of keys, the trie is only touched with the table
+/// lock held for writing.
+
+/// Checks the characters of a pattern: the ones keys may hold, '*' and '?'.
+/// @param pattern Pattern to check.
+/// @return 1 if it is 1 to MAX_STRING_SIZE characters long, none of
+/// " ,()[]", 0 otherwise.
+int patterns_valid(const char *pattern);
+
+/// Subscribes a session to the keys matching a pattern.
+/// @param pattern Valid pattern.
+/// @param subscriber Where the session's notifications go.
+/// @param mode One of the DELIVERY_ modes.
+/// @param window_ms Debounce window, for DELIVERY_DEBOUNCE.
+/// @return 1 if the session was not subscribed to the pattern yet, 0
+/// otherwise.
+int patterns_subscribe(const char *pattern, struct Subscriber *subscriber,
+                       int mode, uint32_t window_ms);
+
+/// Removes a session's subscription to a pattern.
+/// @param pattern Pattern, as it was subscribed to.
+/// @param subscriber Where the session's notifications go.
+/// @return 1 if the subscription existed and was removed, 0 otherwise.
+int patterns_unsubscribe(const char *pattern, struct Subscriber *subscriber);
+
+/// Removes every pattern subscription of a session.
+/// @param subscriber Where the session's notifications go.
+void patterns_unsubscribe_all(struct Subscriber *subscriber);
+
+/// Sends a change to the subscriptions of every pattern the key matches,
+/// once each. Walks the trie a character of the key at a time, so the work
+/// depends on the key and the patterns that match its prefixes, not on the
+/// number of patterns.
+/// @param key Key that changed.
+/// @param change Change to send.
+void patterns_notify(const char *key, const struct Notification *change);
+
+/// Frees the trie, and every subscription left in it.
+void patterns_free(void);
+
+#endif // KVS_PATTERNS_H
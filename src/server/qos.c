@@ -0,0 +1,186 @@
+#include "qos.h"
+
+#include <time.h>
+
+static _Thread_local enum QosClass thread_class = QOS_BATCH;
+
+static unsigned int default_weights[QOS_NUM_CLASSES] = {
+    [QOS_INTERACTIVE] = QOS_DEFAULT_INTERACTIVE_WEIGHT,
+    [QOS_BATCH] = QOS_DEFAULT_BATCH_WEIGHT,
+};
+
+static const char *class_names[QOS_NUM_CLASSES] = {
+    [QOS_INTERACTIVE] = "interactive",
+    [QOS_BATCH] = "batch",
+};
+
+void qos_set_class(enum QosClass qos_class) { thread_class = qos_class; }
+
+int qos_set_weights(unsigned int interactive, unsigned int batch) {
+  if (interactive == 0 || batch == 0) {
+    return 1;
+  }
+  default_weights[QOS_INTERACTIVE] = interactive;
+  default_weights[QOS_BATCH] = batch;
+  return 0;
+}
+
+void qos_lock_init(struct QosLock *lock) {
+  pthread_mutex_init(&lock->mutex, NULL);
+  lock->readers = 0;
+  lock->writer = 0;
+  lock->turn = QOS_INTERACTIVE;
+  for (int c = 0; c < QOS_NUM_CLASSES; c++) {
+    pthread_cond_init(&lock->turn_cond[c], NULL);
+    lock->waiting[c] = 0;
+    lock->writers_waiting[c] = 0;
+    lock->weights[c] = default_weights[c];
+    lock->credits[c] = default_weights[c];
+    lock->stats[c] = (struct QosStats){0};
+  }
+}
+
+void qos_lock_destroy(struct QosLock *lock) {
+  pthread_mutex_destroy(&lock->mutex);
+  for (int c = 0; c < QOS_NUM_CLASSES; c++) {
+    pthread_cond_destroy(&lock->turn_cond[c]);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Whether it is the class's turn. Called with the mutex held.
+static int has_turn(const struct QosLock *lock, enum QosClass c) {
+  enum QosClass other = c == QOS_INTERACTIVE ? QOS_BATCH : QOS_INTERACTIVE;
+  return lock->waiting[other] == 0 || lock->turn == c;
+}
+
+// Books a grant to a class and passes the turn on once its credits run out.
+// Called with the mutex held.
+static void grant(struct QosLock *lock, enum QosClass c, uint64_t started) {
+  enum QosClass other = c == QOS_INTERACTIVE ? QOS_BATCH : QOS_INTERACTIVE;
+  lock->waiting[c]--;
+  if (lock->waiting[other] > 0 &&
+      (lock->waiting[c] == 0 || --lock->credits[c] == 0)) {
+    // Out of credits, or nobody left to use them: the other class is up.
+    lock->credits[c] = lock->weights[c];
+    lock->turn = other;
+    pthread_cond_broadcast(&lock->turn_cond[other]);
+  }
+
+  uint64_t waited = now_ns() - started;
+  struct QosStats *stats = &lock->stats[c];
+  stats->acquisitions++;
+  stats->total_wait_ns += waited;
+  if (waited > stats->max_wait_ns) {
+    stats->max_wait_ns = waited;
+  }
+
+  size_t bucket = 0;
+  for (uint64_t us = waited / 1000; us > 0; us >>= 1) {
+    if (bucket + 1 < QOS_HISTOGRAM_BUCKETS) {
+      bucket++;
+    }
+  }
+  stats->histogram[bucket]++;
+}
+
+void qos_rdlock(struct QosLock *lock) {
+  enum QosClass c = thread_class;
+  uint64_t started = now_ns();
+
+  pthread_mutex_lock(&lock->mutex);
+  lock->waiting[c]++;
+  // Writers of the same class go first, so readers cannot starve them.
+  while (lock->writer || lock->writers_waiting[c] > 0 ||
+         !has_turn(lock, c)) {
+    pthread_cond_wait(&lock->turn_cond[c], &lock->mutex);
+  }
+  lock->readers++;
+  grant(lock, c, started);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+void qos_wrlock(struct QosLock *lock) {
+  enum QosClass c = thread_class;
+  uint64_t started = now_ns();
+
+  pthread_mutex_lock(&lock->mutex);
+  lock->waiting[c]++;
+  lock->writers_waiting[c]++;
+  while (lock->writer || lock->readers > 0 || !has_turn(lock, c)) {
+    pthread_cond_wait(&lock->turn_cond[c], &lock->mutex);
+  }
+  lock->writers_waiting[c]--;
+  lock->writer = 1;
+  grant(lock, c, started);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+void qos_unlock(struct QosLock *lock) {
+  pthread_mutex_lock(&lock->mutex);
+  if (lock->writer) {
+    lock->writer = 0;
+  } else {
+    lock->readers--;
+  }
+
+  if (!lock->writer && lock->readers == 0) {
+    // Wake the class whose turn it is first, then the other: it may be the
+    // only one waiting.
+    enum QosClass first = lock->turn;
+    enum QosClass second =
+        first == QOS_INTERACTIVE ? QOS_BATCH : QOS_INTERACTIVE;
+    pthread_cond_broadcast(&lock->turn_cond[first]);
+    pthread_cond_broadcast(&lock->turn_cond[second]);
+  }
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+// Estimates a percentile of the waits from the histogram.
+// @return Upper bound of the bucket the percentile falls in, in microseconds.
+static uint64_t percentile_us(const struct QosStats *stats, double fraction) {
+  if (stats->acquisitions == 0) {
+    return 0;
+  }
+  size_t target = (size_t)((double)stats->acquisitions * fraction);
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket < QOS_HISTOGRAM_BUCKETS; bucket++) {
+    seen += stats->histogram[bucket];
+    if (seen > target) {
+      return (uint64_t)1 << bucket;
+    }
+  }
+  return (uint64_t)1 << (QOS_HISTOGRAM_BUCKETS - 1);
+}
+
+void qos_report(struct QosLock *lock, FILE *stream) {
+  pthread_mutex_lock(&lock->mutex);
+  struct QosStats stats[QOS_NUM_CLASSES];
+  for (int c = 0; c < QOS_NUM_CLASSES; c++) {
+    stats[c] = lock->stats[c];
+  }
+  unsigned int weights[QOS_NUM_CLASSES] = {lock->weights[QOS_INTERACTIVE],
+                                           lock->weights[QOS_BATCH]};
+  pthread_mutex_unlock(&lock->mutex);
+
+  fprintf(stream, "Table lock waits (weights %u:%u):\n",
+          weights[QOS_INTERACTIVE], weights[QOS_BATCH]);
+  for (int c = 0; c < QOS_NUM_CLASSES; c++) {
+    double avg_us = stats[c].acquisitions == 0
+                        ? 0.0
+                        : (double)stats[c].total_wait_ns /
+                              (double)stats[c].acquisitions / 1000.0;
+    fprintf(stream,
+            "  %s: %zu acquisitions, avg %.1f us, p99 <%llu us, "
+            "max %.1f us\n",
+            class_names[c], stats[c].acquisitions, avg_us,
+            (unsigned long long)percentile_us(&stats[c], 0.99),
+            (double)stats[c].max_wait_ns / 1000.0);
+  }
+  fflush(stream);
+}
@@ -0,0 +1,81 @@
+#ifndef KVS_QOS_H
+#define KVS_QOS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Lock waits are bucketed by powers of two of microseconds.
+#define QOS_HISTOGRAM_BUCKETS 32
+
+#define QOS_DEFAULT_INTERACTIVE_WEIGHT 8
+#define QOS_DEFAULT_BATCH_WEIGHT 1
+
+enum QosClass {
+  QOS_INTERACTIVE, // Client sessions, waiting on a reply.
+  QOS_BATCH,       // Job threads.
+  QOS_NUM_CLASSES
+};
+
+struct QosStats {
+  size_t acquisitions;
+  uint64_t total_wait_ns;
+  uint64_t max_wait_ns;
+  size_t histogram[QOS_HISTOGRAM_BUCKETS];
+};
+
+/// Readers-writer lock that arbitrates between classes of threads. While
+/// both classes are waiting, the lock is handed to them in weighted round
+/// robin: weights[c] grants in a row to class c before the other gets its
+/// turn. A class with nobody waiting never holds the other one back.
+struct QosLock {
+  pthread_mutex_t mutex;
+  pthread_cond_t turn_cond[QOS_NUM_CLASSES];
+  size_t readers;
+  int writer;
+  size_t waiting[QOS_NUM_CLASSES];
+  size_t writers_waiting[QOS_NUM_CLASSES];
+  enum QosClass turn;
+  unsigned int weights[QOS_NUM_CLASSES];
+  unsigned int credits[QOS_NUM_CLASSES];
+  struct QosStats stats[QOS_NUM_CLASSES];
+};
+
+/// Sets the class of the calling thread. Threads start as QOS_BATCH.
+/// @param qos_class Class of the locks the thread takes from now on.
+void qos_set_class(enum QosClass qos_class);
+
+/// Sets the weights used by locks initialized from now on.
+/// @param interactive Grants in a row for interactive threads.
+/// @param batch Grants in a row for batch threads.
+/// @return 0 if the weights were set, 1 if any of them is 0.
+int qos_set_weights(unsigned int interactive, unsigned int batch);
+
+/// Initializes a lock with the current weights.
+/// @param lock Lock to initialize.
+void qos_lock_init(struct QosLock *lock);
+
+/// Destroys a lock. It must not be held.
+/// @param lock Lock to destroy.
+void qos_lock_destroy(struct QosLock *lock);
+
+/// Takes the lock shared, as the calling thread's class.
+/// @param lock Lock to take.
+void qos_rdlock(struct QosLock *lock);
+
+/// Takes the lock exclusively, as the calling thread's class.
+/// @param lock Lock to take.
+void qos_wrlock(struct QosLock *lock);
+
+/// Releases the lock, whichever way it was taken.
+/// @param lock Lock to release.
+void qos_unlock(struct QosLock *lock);
+
+/// Prints the number of acquisitions and the average, 99th percentile and
+/// maximum wait for the lock of each class.
+/// @param lock Lock to report on.
+/// @param stream Stream to print to.
+void qos_report(struct QosLock *lock, FILE *stream);
+
+#endif // KVS_QOS_H
@@ -0,0 +1,129 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+int reader_init(struct Reader *reader, int fd) {
+  reader->fd = fd;
+  reader->start = 0;
+  reader->end = 0;
+  reader->eof = 0;
+  reader->window = malloc(READER_WINDOW_SIZE);
+  return reader->window == NULL;
+}
+
+void reader_destroy(struct Reader *reader) {
+  free(reader->window);
+  reader->window = NULL;
+}
+
+// Moves the unconsumed bytes to the front of the window and fills the rest of
+// it from the file descriptor.
+// @param reader Reader to refill.
+// @return Number of bytes added to the window.
+static size_t refill(struct Reader *reader) {
+  if (reader->eof) {
+    return 0;
+  }
+
+  if (reader->start > 0) {
+    memmove(reader->window, reader->window + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+
+  if (reader->end == READER_WINDOW_SIZE) {
+    return 0;
+  }
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(reader->fd, reader->window + reader->end,
+                      READER_WINDOW_SIZE - reader->end);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  if (bytes_read <= 0) {
+    reader->eof = 1;
+    return 0;
+  }
+
+  reader->end += (size_t)bytes_read;
+  return (size_t)bytes_read;
+}
+
+// Makes sure at least n bytes are available in the window, unless the file
+// ends first.
+// @param reader Reader to fill.
+// @param n Number of bytes wanted, at most READER_WINDOW_SIZE.
+// @return Number of bytes available.
+static size_t fill(struct Reader *reader, size_t n) {
+  while (reader->end - reader->start < n && refill(reader) > 0)
+    ;
+  return reader->end - reader->start;
+}
+
+int reader_getc(struct Reader *reader, char *ch) {
+  if (fill(reader, 1) == 0) {
+    return 0;
+  }
+
+  *ch = reader->window[reader->start++];
+  return 1;
+}
+
+size_t reader_read(struct Reader *reader, char *dest, size_t n) {
+  size_t copied = 0;
+
+  while (copied < n) {
+    size_t available = fill(reader, 1);
+    if (available == 0) {
+      break;
+    }
+
+    size_t chunk = n - copied < available ? n - copied : available;
+    memcpy(dest + copied, reader->window + reader->start, chunk);
+    reader->start += chunk;
+    copied += chunk;
+  }
+
+  return copied;
+}
+
+char reader_span(struct Reader *reader, const char *delims, size_t max,
+                 const char **token, size_t *len) {
+  size_t available = fill(reader, max);
+  size_t limit = available < max ? available : max;
+  const char *begin = reader->window + reader->start;
+
+  size_t i = scan_delims(begin, limit, delims);
+  if (i < limit) {
+    *token = begin;
+    *len = i;
+    reader->start += i + 1;
+    return begin[i];
+  }
+
+  *token = begin;
+  *len = limit;
+  reader->start += limit;
+  return '\0';
+}
+
+void reader_skip_line(struct Reader *reader) {
+  while (fill(reader, 1) > 0) {
+    const char *begin = reader->window + reader->start;
+    const char *newline = memchr(begin, '\n', reader->end - reader->start);
+
+    if (newline != NULL) {
+      reader->start += (size_t)(newline - begin) + 1;
+      return;
+    }
+
+    reader->start = reader->end;
+  }
+}
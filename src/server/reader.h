@@ -0,0 +1,59 @@
+#ifndef KVS_READER_H
+#define KVS_READER_H
+
+#include <stddef.h>
+
+#define READER_WINDOW_SIZE 65536
+
+/// Buffered input over a job file. Bytes are pulled from the file descriptor
+/// in large chunks into a window, and tokens are handed out as pointers into
+/// that window instead of being copied out one byte at a time.
+struct Reader {
+  int fd;
+  char *window;
+  size_t start; // First byte not yet consumed.
+  size_t end;   // One past the last valid byte in the window.
+  int eof;
+};
+
+/// Initializes a reader over the given file descriptor.
+/// @param reader Reader to initialize.
+/// @param fd File descriptor to read from.
+/// @return 0 if the reader was initialized successfully, 1 otherwise.
+int reader_init(struct Reader *reader, int fd);
+
+/// Frees the window of a reader. Does not close its file descriptor.
+/// @param reader Reader to destroy.
+void reader_destroy(struct Reader *reader);
+
+/// Reads a single character.
+/// @param reader Reader to read from.
+/// @param ch Pointer to store the character in.
+/// @return 1 if a character was read, 0 on end of file.
+int reader_getc(struct Reader *reader, char *ch);
+
+/// Reads up to n bytes. Returns fewer than n only on end of file.
+/// @param reader Reader to read from.
+/// @param dest Buffer to copy the bytes into.
+/// @param n Number of bytes to read.
+/// @return Number of bytes read.
+size_t reader_read(struct Reader *reader, char *dest, size_t n);
+
+/// Finds the next token ending in one of the given delimiters, looking at no
+/// more than max bytes. The token is not copied: it points into the window and
+/// is only valid until the next call on the reader. The token and its
+/// delimiter are consumed, or max bytes are consumed if no delimiter is found.
+/// @param reader Reader to read from.
+/// @param delims Delimiter characters to stop at.
+/// @param max Maximum number of bytes to look at.
+/// @param token Pointer to store the start of the token in.
+/// @param len Pointer to store the length of the token in.
+/// @return The delimiter found, or '\0' if none was found within max bytes.
+char reader_span(struct Reader *reader, const char *delims, size_t max,
+                 const char **token, size_t *len);
+
+/// Skips input up to and including the next newline.
+/// @param reader Reader to read from.
+void reader_skip_line(struct Reader *reader);
+
+#endif // KVS_READER_H
@@ -0,0 +1,103 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+typedef size_t (*scan_fn)(const char *buf, size_t len, const char *delims,
+                          size_t num_delims);
+
+static size_t scan_scalar(const char *buf, size_t len, const char *delims,
+                          size_t num_delims) {
+  for (size_t i = 0; i < len; i++) {
+    if (memchr(delims, buf[i], num_delims) != NULL) {
+      return i;
+    }
+  }
+  return len;
+}
+
+#if SCAN_X86
+__attribute__((target("sse2"))) static size_t
+scan_sse2(const char *buf, size_t len, const char *delims, size_t num_delims) {
+  __m128i wanted[SCAN_MAX_DELIMS];
+  for (size_t d = 0; d < num_delims; d++) {
+    wanted[d] = _mm_set1_epi8(delims[d]);
+  }
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(buf + i));
+    __m128i hits = _mm_setzero_si128();
+    for (size_t d = 0; d < num_delims; d++) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, wanted[d]));
+    }
+
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+
+  return i + scan_scalar(buf + i, len - i, delims, num_delims);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const char *buf, size_t len, const char *delims, size_t num_delims) {
+  __m256i wanted[SCAN_MAX_DELIMS];
+  for (size_t d = 0; d < num_delims; d++) {
+    wanted[d] = _mm256_set1_epi8(delims[d]);
+  }
+
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(buf + i));
+    __m256i hits = _mm256_setzero_si256();
+    for (size_t d = 0; d < num_delims; d++) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, wanted[d]));
+    }
+
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+
+  return i + scan_sse2(buf + i, len - i, delims, num_delims);
+}
+#endif
+
+static scan_fn scan_impl = scan_scalar;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void scan_select(void) {
+#if SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_impl = scan_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    scan_impl = scan_sse2;
+  }
+#endif
+}
+
+size_t scan_delims(const char *buf, size_t len, const char *delims) {
+  size_t num_delims = strlen(delims);
+  if (num_delims == 0) {
+    return len;
+  }
+
+  if (num_delims > SCAN_MAX_DELIMS) {
+    return scan_scalar(buf, len, delims, num_delims);
+  }
+
+  pthread_once(&scan_once, scan_select);
+  return scan_impl(buf, len, delims, num_delims);
+}
@@ -0,0 +1,18 @@
+#ifndef KVS_SCAN_H
+#define KVS_SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_MAX_DELIMS 4
+
+/// Finds the first delimiter in a buffer. On x86 the buffer is compared 32
+/// (AVX2) or 16 (SSE2) bytes at a time, picked once at runtime from what the
+/// CPU supports; elsewhere, or with more than SCAN_MAX_DELIMS delimiters, it
+/// is scanned one byte at a time.
+/// @param buf Buffer to scan.
+/// @param len Number of bytes to scan.
+/// @param delims Delimiter characters to look for.
+/// @return Index of the first delimiter, or len if there is none.
+size_t scan_delims(const char *buf, size_t len, const char *delims);
+
+#endif // KVS_SCAN_H
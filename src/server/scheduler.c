@@ -0,0 +1,568 @@
+#include "scheduler.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int job_entry_init(const char *dir, const char *name, struct JobEntry *job) {
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name || strlen(dot) != 4 || strcmp(dot, ".job")) {
+    return 1;
+  }
+
+  if (strlen(name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, name);
+    return 1;
+  }
+
+  strcpy(job->name, name);
+
+  strcpy(job->in_path, dir);
+  strcat(job->in_path, "/");
+  strcat(job->in_path, name);
+
+  strcpy(job->out_path, job->in_path);
+  strcpy(strrchr(job->out_path, '.'), ".out");
+
+  strcpy(job->done_path, job->in_path);
+  strcpy(strrchr(job->done_path, '.'), ".done");
+
+  job->task = NULL;
+  job->started = 0;
+  job->rerun = 0;
+  job->next_live = NULL;
+  return 0;
+}
+
+// Checks whether a job finished after its file was last written.
+// @param job Job to check.
+// @param job_st Status of the job file.
+// @return 1 if the job has an up to date .done marker, 0 otherwise.
+static int job_is_done(const struct JobEntry *job, const struct stat *job_st) {
+  struct stat done_st;
+  if (stat(job->done_path, &done_st) == -1) {
+    return 0;
+  }
+
+  if (done_st.st_mtim.tv_sec != job_st->st_mtim.tv_sec) {
+    return done_st.st_mtim.tv_sec > job_st->st_mtim.tv_sec;
+  }
+  return done_st.st_mtim.tv_nsec >= job_st->st_mtim.tv_nsec;
+}
+
+static double elapsed_seconds(const struct timespec *from,
+                              const struct timespec *to) {
+  return (double)(to->tv_sec - from->tv_sec) +
+         (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int wakes_before(const struct JobEntry *a, const struct JobEntry *b) {
+  if (a->wake.tv_sec != b->wake.tv_sec) {
+    return a->wake.tv_sec < b->wake.tv_sec;
+  }
+  return a->wake.tv_nsec < b->wake.tv_nsec;
+}
+
+// Adds a parked job to the timer heap. Called with work_lock held.
+static int timer_push(struct Scheduler *sched, struct JobEntry *job) {
+  if (sched->num_timers == sched->timers_capacity) {
+    size_t capacity =
+        sched->timers_capacity ? sched->timers_capacity * 2 : 16;
+    struct JobEntry **grown =
+        realloc(sched->timers, capacity * sizeof(struct JobEntry *));
+    if (grown == NULL) {
+      return 1;
+    }
+    sched->timers = grown;
+    sched->timers_capacity = capacity;
+  }
+
+  size_t i = sched->num_timers++;
+  while (i > 0 && wakes_before(job, sched->timers[(i - 1) / 2])) {
+    sched->timers[i] = sched->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  sched->timers[i] = job;
+  return 0;
+}
+
+// Removes the parked job that wakes first if its wake time has passed.
+// Called with work_lock held.
+static struct JobEntry *timer_pop_expired(struct Scheduler *sched) {
+  if (sched->num_timers == 0) {
+    return NULL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct JobEntry *job = sched->timers[0];
+  if (job->wake.tv_sec > now.tv_sec ||
+      (job->wake.tv_sec == now.tv_sec && job->wake.tv_nsec > now.tv_nsec)) {
+    return NULL;
+  }
+
+  struct JobEntry *last = sched->timers[--sched->num_timers];
+  size_t i = 0;
+  while (2 * i + 1 < sched->num_timers) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < sched->num_timers &&
+        wakes_before(sched->timers[child + 1], sched->timers[child])) {
+      child++;
+    }
+    if (!wakes_before(sched->timers[child], last)) {
+      break;
+    }
+    sched->timers[i] = sched->timers[child];
+    i = child;
+  }
+  sched->timers[i] = last;
+  return job;
+}
+
+static int deque_push_back(struct JobDeque *deque, struct JobEntry *job) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->capacity) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : 16;
+    struct JobEntry **jobs = malloc(capacity * sizeof(struct JobEntry *));
+    if (jobs == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      return 1;
+    }
+    for (size_t i = 0; i < deque->count; i++) {
+      jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+    }
+    free(deque->jobs);
+    deque->jobs = jobs;
+    deque->head = 0;
+    deque->capacity = capacity;
+  }
+
+  deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+static struct JobEntry *deque_pop_front(struct JobDeque *deque) {
+  struct JobEntry *job = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    job = deque->jobs[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static struct JobEntry *deque_pop_back(struct JobDeque *deque) {
+  struct JobEntry *job = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static int compare_size_desc(const void *a, const void *b) {
+  const struct JobEntry *job_a = *(struct JobEntry *const *)a;
+  const struct JobEntry *job_b = *(struct JobEntry *const *)b;
+  return (job_a->size < job_b->size) - (job_a->size > job_b->size);
+}
+
+// Reads every .job file in the directory, sorts them largest-first and deals
+// them round-robin into the workers' deques.
+// @param sched Scheduler to fill.
+// @return 0 if successful, 1 otherwise.
+static int enumerate_jobs(struct Scheduler *sched) {
+  struct JobEntry **jobs = NULL;
+  size_t num_jobs = 0, capacity = 0;
+  struct dirent *entry;
+  struct JobEntry candidate;
+
+  while ((entry = readdir(sched->dir)) != NULL) {
+    if (job_entry_init(sched->dir_name, entry->d_name, &candidate)) {
+      continue;
+    }
+
+    struct stat st;
+    if (stat(candidate.in_path, &st) == -1) {
+      fprintf(stderr, "Failed to stat job file: %s\n", candidate.in_path);
+      continue;
+    }
+    candidate.size = st.st_size;
+
+    if (sched->watching && job_is_done(&candidate, &st)) {
+      continue;
+    }
+
+    if (num_jobs == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct JobEntry **grown = realloc(jobs, capacity * sizeof(*jobs));
+      if (grown == NULL) {
+        break;
+      }
+      jobs = grown;
+    }
+
+    jobs[num_jobs] = malloc(sizeof(struct JobEntry));
+    if (jobs[num_jobs] == NULL) {
+      break;
+    }
+    *jobs[num_jobs++] = candidate;
+  }
+
+  qsort(jobs, num_jobs, sizeof(*jobs), compare_size_desc);
+
+  int result = 0;
+  for (size_t i = 0; i < num_jobs; i++) {
+    if (result ||
+        deque_push_back(&sched->deques[i % sched->num_workers], jobs[i])) {
+      free(jobs[i]);
+      result = 1;
+    }
+  }
+
+  free(jobs);
+  return result;
+}
+
+int scheduler_init(struct Scheduler *sched, enum SchedulerMode mode, DIR *dir,
+                   const char *dir_name, size_t num_workers, int watching) {
+  sched->mode = mode;
+  sched->num_workers = num_workers;
+  sched->dir = dir;
+  sched->dir_name = dir_name;
+  sched->watching = watching;
+  sched->submitted = 0;
+  sched->live = NULL;
+  sched->timers = NULL;
+  sched->num_timers = 0;
+  sched->timers_capacity = 0;
+  sched->active = 0;
+  sched->deques = calloc(num_workers, sizeof(struct JobDeque));
+  sched->stats = calloc(num_workers, sizeof(struct WorkerStats));
+  if (sched->deques == NULL || sched->stats == NULL) {
+    free(sched->deques);
+    free(sched->stats);
+    return 1;
+  }
+
+  pthread_mutex_init(&sched->dir_lock, NULL);
+  pthread_mutex_init(&sched->work_lock, NULL);
+
+  // Parked jobs wake on CLOCK_MONOTONIC deadlines.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sched->work_available, &attr);
+  pthread_condattr_destroy(&attr);
+  for (size_t i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&sched->deques[i].lock, NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &sched->started);
+
+  if (mode == SCHED_STEAL && enumerate_jobs(sched)) {
+    fprintf(stderr, "Failed to enumerate all jobs\n");
+  }
+
+  return 0;
+}
+
+// Takes the next job in readdir order from the shared directory stream.
+static struct JobEntry *next_from_dir(struct Scheduler *sched) {
+  struct JobEntry *job = malloc(sizeof(struct JobEntry));
+  if (job == NULL) {
+    return NULL;
+  }
+
+  if (pthread_mutex_lock(&sched->dir_lock) != 0) {
+    fprintf(stderr, "Thread failed to lock directory_mutex\n");
+    free(job);
+    return NULL;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(sched->dir)) != NULL) {
+    if (job_entry_init(sched->dir_name, entry->d_name, job) == 0) {
+      break;
+    }
+  }
+
+  if (pthread_mutex_unlock(&sched->dir_lock) != 0) {
+    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
+  }
+
+  if (entry == NULL) {
+    free(job);
+    return NULL;
+  }
+  return job;
+}
+
+// Finds the job of a file handed to the scheduler and not done yet. Called
+// with work_lock held.
+static struct JobEntry *find_live(struct Scheduler *sched, const char *name) {
+  for (struct JobEntry *job = sched->live; job != NULL; job = job->next_live) {
+    if (strcmp(job->name, name) == 0) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+// Adds a job that has not started yet to the live ones, while watching.
+// Called with work_lock held.
+// @return 0 if the job may run, 1 if another job of its file is queued or
+// running: that one picks the file up, running again once done if it had
+// started already.
+static int track_job(struct Scheduler *sched, struct JobEntry *job) {
+  if (!sched->watching || job->task != NULL) {
+    return 0;
+  }
+  struct JobEntry *live = find_live(sched, job->name);
+  if (live == job) {
+    return 0;
+  }
+  if (live != NULL) {
+    live->rerun |= live->started;
+    return 1;
+  }
+  job->next_live = sched->live;
+  sched->live = job;
+  return 0;
+}
+
+// Removes a job from the live ones, if it is there. Called with work_lock
+// held.
+static void untrack_job(struct Scheduler *sched, struct JobEntry *job) {
+  for (struct JobEntry **link = &sched->live; *link != NULL;
+       link = &(*link)->next_live) {
+    if (*link == job) {
+      *link = job->next_live;
+      return;
+    }
+  }
+}
+
+// Takes a job from the worker's own deque, or steals one from another worker.
+static struct JobEntry *take_job(struct Scheduler *sched, size_t worker) {
+  struct JobEntry *job = deque_pop_front(&sched->deques[worker]);
+  for (size_t i = 1; job == NULL && i < sched->num_workers; i++) {
+    job = deque_pop_back(&sched->deques[(worker + i) % sched->num_workers]);
+    if (job != NULL) {
+      sched->stats[worker].jobs_stolen++;
+    }
+  }
+  return job;
+}
+
+struct JobEntry *scheduler_next(struct Scheduler *sched, size_t worker) {
+  struct JobEntry *job = NULL;
+
+  pthread_mutex_lock(&sched->work_lock);
+  while ((job = timer_pop_expired(sched)) == NULL) {
+    size_t seen = sched->submitted;
+    pthread_mutex_unlock(&sched->work_lock);
+    if (sched->mode == SCHED_READDIR) {
+      job = next_from_dir(sched);
+    }
+    if (job == NULL) {
+      job = take_job(sched, worker);
+    }
+    pthread_mutex_lock(&sched->work_lock);
+
+    if (job != NULL && track_job(sched, job)) {
+      free(job);
+      continue;
+    }
+    if (job != NULL) {
+      job->started = 1;
+      sched->active++;
+      break;
+    }
+    if (seen != sched->submitted) {
+      continue;
+    }
+    if (!sched->watching && sched->active == 0) {
+      break;
+    }
+
+    if (sched->num_timers > 0) {
+      pthread_cond_timedwait(&sched->work_available, &sched->work_lock,
+                             &sched->timers[0]->wake);
+    } else {
+      pthread_cond_wait(&sched->work_available, &sched->work_lock);
+    }
+  }
+  pthread_mutex_unlock(&sched->work_lock);
+
+  if (job != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &sched->stats[worker].job_started);
+  }
+  return job;
+}
+
+int scheduler_park(struct Scheduler *sched, size_t worker,
+                   struct JobEntry *job, unsigned int delay_ms) {
+  struct WorkerStats *stats = &sched->stats[worker];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  stats->busy_seconds += elapsed_seconds(&stats->job_started, &now);
+
+  job->wake.tv_sec = now.tv_sec + delay_ms / 1000;
+  job->wake.tv_nsec = now.tv_nsec + (long)(delay_ms % 1000) * 1000000L;
+  if (job->wake.tv_nsec >= 1000000000L) {
+    job->wake.tv_sec++;
+    job->wake.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&sched->work_lock);
+  int result = timer_push(sched, job);
+  // Waiters may be sleeping until a later deadline.
+  pthread_cond_signal(&sched->work_available);
+  pthread_mutex_unlock(&sched->work_lock);
+  return result;
+}
+
+// Queues a job on the next worker's deque, and wakes a worker for it.
+// @return 0 if the job was queued, 1 otherwise.
+static int queue_job(struct Scheduler *sched, struct JobEntry *job) {
+  pthread_mutex_lock(&sched->work_lock);
+  size_t target = sched->submitted % sched->num_workers;
+  pthread_mutex_unlock(&sched->work_lock);
+
+  if (deque_push_back(&sched->deques[target], job)) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&sched->work_lock);
+  sched->submitted++;
+  pthread_cond_signal(&sched->work_available);
+  pthread_mutex_unlock(&sched->work_lock);
+  return 0;
+}
+
+void scheduler_done(struct Scheduler *sched, size_t worker,
+                    struct JobEntry *job, int completed) {
+  struct WorkerStats *stats = &sched->stats[worker];
+
+  clock_gettime(CLOCK_MONOTONIC, &stats->last_finished);
+  stats->busy_seconds +=
+      elapsed_seconds(&stats->job_started, &stats->last_finished);
+  stats->jobs_run++;
+
+  pthread_mutex_lock(&sched->work_lock);
+  int rerun = job->rerun;
+  if (rerun) {
+    job->task = NULL;
+    job->started = 0;
+    job->rerun = 0;
+  } else {
+    untrack_job(sched, job);
+  }
+  pthread_mutex_unlock(&sched->work_lock);
+
+  // Queued before the job counts as done, so no worker returns meanwhile.
+  if (rerun && queue_job(sched, job)) {
+    fprintf(stderr, "Failed to run job again: %s\n", job->in_path);
+    pthread_mutex_lock(&sched->work_lock);
+    untrack_job(sched, job);
+    pthread_mutex_unlock(&sched->work_lock);
+    rerun = 0;
+  }
+  if (!rerun) {
+    if (sched->watching && completed) {
+      int fd = open(job->done_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1) {
+        fprintf(stderr, "Failed to create done marker: %s\n",
+                job->done_path);
+      } else {
+        close(fd);
+      }
+    }
+    free(job);
+  }
+
+  pthread_mutex_lock(&sched->work_lock);
+  if (--sched->active == 0) {
+    // Workers waiting on other jobs may now have nothing left to wait for.
+    pthread_cond_broadcast(&sched->work_available);
+  }
+  pthread_mutex_unlock(&sched->work_lock);
+}
+
+int scheduler_submit(struct Scheduler *sched, struct JobEntry *job) {
+  pthread_mutex_lock(&sched->work_lock);
+  int duplicate = track_job(sched, job);
+  pthread_mutex_unlock(&sched->work_lock);
+  if (duplicate) {
+    free(job);
+    return 0;
+  }
+
+  if (queue_job(sched, job)) {
+    pthread_mutex_lock(&sched->work_lock);
+    untrack_job(sched, job);
+    pthread_mutex_unlock(&sched->work_lock);
+    return 1;
+  }
+  return 0;
+}
+
+void scheduler_close(struct Scheduler *sched) {
+  pthread_mutex_lock(&sched->work_lock);
+  sched->watching = 0;
+  pthread_cond_broadcast(&sched->work_available);
+  pthread_mutex_unlock(&sched->work_lock);
+}
+
+void scheduler_report(struct Scheduler *sched) {
+  double makespan = 0;
+  for (size_t i = 0; i < sched->num_workers; i++) {
+    if (sched->stats[i].jobs_run == 0) {
+      continue;
+    }
+    double finished =
+        elapsed_seconds(&sched->started, &sched->stats[i].last_finished);
+    if (finished > makespan) {
+      makespan = finished;
+    }
+  }
+
+  printf("Jobs makespan: %.3f s\n", makespan);
+  for (size_t i = 0; i < sched->num_workers; i++) {
+    struct WorkerStats *stats = &sched->stats[i];
+    printf("  worker %zu: %zu jobs (%zu stolen), busy %.3f s, "
+           "%.1f%% utilized\n",
+           i, stats->jobs_run, stats->jobs_stolen, stats->busy_seconds,
+           makespan > 0 ? 100.0 * stats->busy_seconds / makespan : 0.0);
+  }
+  fflush(stdout);
+}
+
+void scheduler_destroy(struct Scheduler *sched) {
+  for (size_t i = 0; i < sched->num_workers; i++) {
+    struct JobEntry *job;
+    while ((job = deque_pop_front(&sched->deques[i])) != NULL) {
+      free(job);
+    }
+    free(sched->deques[i].jobs);
+    pthread_mutex_destroy(&sched->deques[i].lock);
+  }
+  for (size_t i = 0; i < sched->num_timers; i++) {
+    free(sched->timers[i]);
+  }
+  free(sched->timers);
+  pthread_mutex_destroy(&sched->dir_lock);
+  pthread_mutex_destroy(&sched->work_lock);
+  pthread_cond_destroy(&sched->work_available);
+  free(sched->deques);
+  free(sched->stats);
+}
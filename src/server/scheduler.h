@@ -0,0 +1,153 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "constants.h"
+
+enum SchedulerMode {
+  SCHED_READDIR, // Jobs are taken from the shared DIR* in readdir order.
+  SCHED_STEAL    // Jobs are sorted largest-first into per-worker deques.
+};
+
+struct JobEntry {
+  char name[MAX_JOB_FILE_NAME_SIZE];
+  char in_path[MAX_JOB_FILE_NAME_SIZE];
+  char out_path[MAX_JOB_FILE_NAME_SIZE];
+  char done_path[MAX_JOB_FILE_NAME_SIZE];
+  off_t size;
+
+  // State of a job that was started and is parked on a WAIT, NULL before it
+  // first runs. Owned by whoever runs the job.
+  void *task;
+  struct timespec wake; // When a parked job becomes runnable again.
+
+  // While watching, jobs handed to the scheduler and not done yet are
+  // linked through next_live, so a file is never run by two workers at
+  // once. A job whose file changes while it runs is run again once done.
+  int started;
+  int rerun;
+  struct JobEntry *next_live;
+};
+
+/// Double-ended queue of jobs owned by one worker. The owner takes jobs from
+/// the front, other workers steal from the back.
+struct JobDeque {
+  struct JobEntry **jobs;
+  size_t head;
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+};
+
+struct WorkerStats {
+  struct timespec job_started;
+  struct timespec last_finished;
+  double busy_seconds;
+  size_t jobs_run;
+  size_t jobs_stolen;
+};
+
+struct Scheduler {
+  enum SchedulerMode mode;
+  size_t num_workers;
+  struct JobDeque *deques;
+  struct WorkerStats *stats;
+  DIR *dir;
+  const char *dir_name;
+  pthread_mutex_t dir_lock;
+  struct timespec started;
+
+  // Jobs submitted after startup (watch mode). While watching, workers wait
+  // for more work instead of returning when every deque is empty.
+  int watching;
+  size_t submitted;
+  struct JobEntry *live;
+  pthread_mutex_t work_lock;
+  pthread_cond_t work_available;
+
+  // Min-heap of parked jobs ordered by wake time, and the number of jobs
+  // started but not done. Workers keep waiting while any job is active, as
+  // running jobs may still park and parked ones will need resuming.
+  struct JobEntry **timers;
+  size_t num_timers;
+  size_t timers_capacity;
+  size_t active;
+};
+
+/// Fills in the paths of a job from the name of a file in the jobs directory.
+/// @param dir_name Path of the jobs directory.
+/// @param name Name of the file.
+/// @param job Job to fill in.
+/// @return 0 if the file is a .job file, 1 otherwise.
+int job_entry_init(const char *dir_name, const char *name,
+                   struct JobEntry *job);
+
+/// Sets up the scheduler for a jobs directory. In SCHED_STEAL mode every job
+/// in the directory is enumerated and stat'ed here, sorted by size and dealt
+/// round-robin to the workers' deques.
+/// @param sched Scheduler to initialize.
+/// @param mode Scheduling policy.
+/// @param dir Open jobs directory.
+/// @param dir_name Path of the jobs directory.
+/// @param num_workers Number of job threads that will pull from it.
+/// @param watching Whether jobs will keep being submitted after startup. Jobs
+/// already marked as done are then skipped, and finished jobs get a marker.
+/// @return 0 if the scheduler was initialized successfully, 1 otherwise.
+int scheduler_init(struct Scheduler *sched, enum SchedulerMode mode, DIR *dir,
+                   const char *dir_name, size_t num_workers, int watching);
+
+/// Hands a new job to the workers. If the job's file is queued already,
+/// the queued job runs it; if it is running, it runs again once done.
+/// @param sched Scheduler to submit to.
+/// @param job Job to run, allocated with malloc. Owned by the scheduler.
+/// @return 0 if the job was queued, 1 otherwise.
+int scheduler_submit(struct Scheduler *sched, struct JobEntry *job);
+
+/// Stops waiting for submissions. Workers return once the queued jobs run out.
+/// @param sched Scheduler to close.
+void scheduler_close(struct Scheduler *sched);
+
+/// Picks the next job for a worker. Parked jobs whose wake time has passed
+/// come first, then the worker's own deque, then jobs stolen from other
+/// workers. Blocks while jobs are parked or still running elsewhere, and
+/// while watching until a job is submitted.
+/// @param sched Scheduler to pull from.
+/// @param worker Index of the calling worker.
+/// @return The job to run, or NULL when there is no more work.
+struct JobEntry *scheduler_next(struct Scheduler *sched, size_t worker);
+
+/// Parks a job returned by scheduler_next until a delay has passed, freeing
+/// the worker for other jobs. The job is handed out again by scheduler_next
+/// once it wakes up, with its task still set.
+/// @param sched Scheduler the job came from.
+/// @param worker Index of the calling worker.
+/// @param job Job to park.
+/// @param delay_ms Delay in milliseconds.
+/// @return 0 if the job was parked, 1 otherwise.
+int scheduler_park(struct Scheduler *sched, size_t worker,
+                   struct JobEntry *job, unsigned int delay_ms);
+
+/// Marks a job returned by scheduler_next as finished and frees it. While
+/// watching, also creates the job's .done marker if it ran to completion,
+/// unless its file changed meanwhile: it is then queued to run again.
+/// @param sched Scheduler the job came from.
+/// @param worker Index of the calling worker.
+/// @param job Finished job.
+/// @param completed Whether the job ran, as opposed to failing to start.
+void scheduler_done(struct Scheduler *sched, size_t worker,
+                    struct JobEntry *job, int completed);
+
+/// Prints per-worker utilization and the makespan of the jobs run so far.
+/// @param sched Scheduler to report on.
+void scheduler_report(struct Scheduler *sched);
+
+/// Frees the scheduler. Does not close the jobs directory.
+/// @param sched Scheduler to destroy.
+void scheduler_destroy(struct Scheduler *sched);
+
+#endif // KVS_SCHEDULER_H
@@ -0,0 +1,117 @@
+#include "sessions.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+// Descriptors each session keeps open: request, response, notification and
+// the timer of debounced subscriptions.
+#define FDS_PER_SESSION 4
+// Descriptors left over for job files, backups and the registry FIFO.
+#define RESERVED_FDS 64
+
+// Sessions allocated so far, indexed by slot. A session keeps its slot, and
+// its memory, for the lifetime of the server and is reused once released.
+static struct Client **slots = NULL;
+static size_t num_slots = 0;
+static size_t capacity = 0;
+static size_t max_slots = MAX_SESSION_COUNT;
+
+// Stack of released slots, most recently released on top.
+static size_t *free_slots = NULL;
+static size_t num_free = 0;
+
+// Only taken to connect and release sessions: requests go straight to their
+// session.
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int sessions_init(size_t max_sessions) {
+  if (max_sessions == 0) {
+    return 1;
+  }
+  max_slots = max_sessions;
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 0;
+  }
+  rlim_t needed = (rlim_t)(max_sessions * FDS_PER_SESSION + RESERVED_FDS);
+  if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed) {
+    return 0;
+  }
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+    limit.rlim_cur = limit.rlim_max;
+  } else {
+    limit.rlim_cur = needed;
+  }
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < needed) {
+    fprintf(stderr, "Open file limit only fits %zu sessions\n",
+            limit.rlim_cur > RESERVED_FDS
+                ? (size_t)(limit.rlim_cur - RESERVED_FDS) / FDS_PER_SESSION
+                : 0);
+  }
+  return 0;
+}
+
+// Doubles the room for slots, up to the maximum. Called with the lock held.
+// @return 0 if the table grew, 1 otherwise.
+static int grow(void) {
+  size_t new_capacity =
+      capacity == 0 ? SESSIONS_INITIAL_CAPACITY : capacity * 2;
+  if (new_capacity > max_slots) {
+    new_capacity = max_slots;
+  }
+
+  struct Client **new_slots = realloc(slots, new_capacity * sizeof(*slots));
+  if (new_slots == NULL) {
+    return 1;
+  }
+  slots = new_slots;
+  size_t *new_free = realloc(free_slots, new_capacity * sizeof(*free_slots));
+  if (new_free == NULL) {
+    return 1;
+  }
+  free_slots = new_free;
+  capacity = new_capacity;
+  return 0;
+}
+
+struct Client *session_acquire(void) {
+  struct Client *client = NULL;
+
+  pthread_mutex_lock(&sessions_lock);
+  if (num_free > 0) {
+    client = slots[free_slots[--num_free]];
+  } else if (num_slots < max_slots &&
+             (num_slots < capacity || grow() == 0)) {
+    client = calloc(1, sizeof(*client));
+    if (client != NULL) {
+      pthread_mutex_init(&client->lock, NULL);
+      pthread_mutex_init(&client->write_lock, NULL);
+      notify_init(&client->notifier);
+      client->slot = num_slots;
+      slots[num_slots++] = client;
+    }
+  }
+  if (client != NULL) {
+    client->active = 1;
+  }
+  pthread_mutex_unlock(&sessions_lock);
+
+  return client;
+}
+
+void session_release(struct Client *client) {
+  pthread_mutex_lock(&sessions_lock);
+  client->active = 0;
+  free_slots[num_free++] = client->slot;
+  pthread_mutex_unlock(&sessions_lock);
+}
+
+size_t sessions_active(void) {
+  pthread_mutex_lock(&sessions_lock);
+  size_t active = num_slots - num_free;
+  pthread_mutex_unlock(&sessions_lock);
+  return active;
+}
@@ -0,0 +1,31 @@
+#ifndef KVS_SESSIONS_H
+#define KVS_SESSIONS_H
+
+#include <stddef.h>
+
+#include "api.h"
+
+// The table grows by doubling, starting with room for this many sessions.
+#define SESSIONS_INITIAL_CAPACITY 64
+
+/// Sets the maximum number of concurrent sessions and raises the limit on
+/// open files to fit their FIFOs, if allowed. Must be called before any
+/// session is acquired.
+/// @param max_sessions Maximum number of concurrent sessions, at least 1.
+/// @return 0 if the table was set up, 1 otherwise.
+int sessions_init(size_t max_sessions);
+
+/// Takes a free session, reusing the most recently released one first.
+/// @return The session, marked active, or NULL if the limit is reached or
+/// memory runs out.
+struct Client *session_acquire(void);
+
+/// Puts a session back on the free list. The session must not be used after.
+/// @param client Session returned by session_acquire.
+void session_release(struct Client *client);
+
+/// Number of sessions currently in use.
+/// @return Sessions acquired and not yet released.
+size_t sessions_active(void);
+
+#endif // KVS_SESSIONS_H
@@ -0,0 +1,185 @@
+#include "watch.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct PendingJob {
+  char name[MAX_JOB_FILE_NAME_SIZE];
+  struct timespec deadline;
+  off_t size;
+};
+
+struct Watcher {
+  struct Scheduler *sched;
+  int fd;
+  struct PendingJob pending[WATCH_MAX_PENDING];
+  size_t num_pending;
+};
+
+static long ms_until(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+            (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  return ms > 0 ? ms : 0;
+}
+
+// (Re)arms the debounce timer of a job file that was just written.
+// @param watcher Watcher that got the event.
+// @param name Name of the file in the jobs directory.
+static void touch_pending(struct Watcher *watcher, const char *name) {
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || strcmp(dot, ".job") != 0 ||
+      strlen(name) >= MAX_JOB_FILE_NAME_SIZE) {
+    return;
+  }
+
+  struct PendingJob *pending = NULL;
+  for (size_t i = 0; i < watcher->num_pending; i++) {
+    if (strcmp(watcher->pending[i].name, name) == 0) {
+      pending = &watcher->pending[i];
+      break;
+    }
+  }
+
+  if (pending == NULL) {
+    if (watcher->num_pending == WATCH_MAX_PENDING) {
+      fprintf(stderr, "Too many pending jobs, ignoring %s\n", name);
+      return;
+    }
+    pending = &watcher->pending[watcher->num_pending++];
+    strcpy(pending->name, name);
+    pending->size = -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &pending->deadline);
+  pending->deadline.tv_nsec += (WATCH_DEBOUNCE_MS % 1000) * 1000000L;
+  pending->deadline.tv_sec += WATCH_DEBOUNCE_MS / 1000 +
+                              pending->deadline.tv_nsec / 1000000000L;
+  pending->deadline.tv_nsec %= 1000000000L;
+}
+
+// Submits the pending jobs whose debounce timer expired and whose size did
+// not change since the last check.
+// @param watcher Watcher to flush.
+static void flush_pending(struct Watcher *watcher) {
+  size_t i = 0;
+  while (i < watcher->num_pending) {
+    struct PendingJob *pending = &watcher->pending[i];
+    if (ms_until(&pending->deadline) > 0) {
+      i++;
+      continue;
+    }
+
+    struct JobEntry *job = malloc(sizeof(struct JobEntry));
+    struct stat st;
+    if (job == NULL ||
+        job_entry_init(watcher->sched->dir_name, pending->name, job) ||
+        stat(job->in_path, &st) == -1) {
+      free(job);
+      *pending = watcher->pending[--watcher->num_pending];
+      continue;
+    }
+
+    if (st.st_size != pending->size) {
+      // Still growing, or never checked: look again after another window.
+      free(job);
+      touch_pending(watcher, pending->name);
+      pending->size = st.st_size;
+      i++;
+      continue;
+    }
+
+    job->size = st.st_size;
+    if (scheduler_submit(watcher->sched, job)) {
+      fprintf(stderr, "Failed to submit job: %s\n", job->in_path);
+      free(job);
+    }
+    *pending = watcher->pending[--watcher->num_pending];
+  }
+}
+
+static void *watch_loop(void *arg) {
+  struct Watcher *watcher = (struct Watcher *)arg;
+  char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    long timeout = -1;
+    for (size_t i = 0; i < watcher->num_pending; i++) {
+      long ms = ms_until(&watcher->pending[i].deadline);
+      if (timeout == -1 || ms < timeout) {
+        timeout = ms;
+      }
+    }
+
+    struct pollfd pfd = {watcher->fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, (int)timeout);
+    if (ready == -1 && errno != EINTR) {
+      perror("Failed to poll jobs directory");
+      break;
+    }
+
+    if (ready > 0) {
+      ssize_t len = read(watcher->fd, events, sizeof(events));
+      if (len <= 0 && errno != EINTR) {
+        perror("Failed to read inotify events");
+        break;
+      }
+
+      for (ssize_t off = 0; off < len;) {
+        const struct inotify_event *event =
+            (const struct inotify_event *)(const void *)(events + off);
+        if (event->len > 0) {
+          touch_pending(watcher, event->name);
+        }
+        off += (ssize_t)(sizeof(struct inotify_event) + event->len);
+      }
+    }
+
+    flush_pending(watcher);
+  }
+
+  close(watcher->fd);
+  free(watcher);
+  return NULL;
+}
+
+int watch_start(struct Scheduler *sched, pthread_t *thread) {
+  struct Watcher *watcher = malloc(sizeof(struct Watcher));
+  if (watcher == NULL) {
+    return 1;
+  }
+
+  watcher->sched = sched;
+  watcher->num_pending = 0;
+  watcher->fd = inotify_init1(IN_CLOEXEC);
+  if (watcher->fd == -1) {
+    perror("Failed to initialize inotify");
+    free(watcher);
+    return 1;
+  }
+
+  if (inotify_add_watch(watcher->fd, sched->dir_name,
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY) == -1) {
+    perror("Failed to watch jobs directory");
+    close(watcher->fd);
+    free(watcher);
+    return 1;
+  }
+
+  if (pthread_create(thread, NULL, watch_loop, watcher) != 0) {
+    close(watcher->fd);
+    free(watcher);
+    return 1;
+  }
+
+  return 0;
+}
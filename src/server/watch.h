@@ -0,0 +1,20 @@
+#ifndef KVS_WATCH_H
+#define KVS_WATCH_H
+
+#include <pthread.h>
+
+#include "scheduler.h"
+
+// A .job file is only submitted once it has gone this long without being
+// written to, so jobs copied in several writes are not picked up half done.
+#define WATCH_DEBOUNCE_MS 200
+#define WATCH_MAX_PENDING 256
+
+/// Starts a thread that watches the scheduler's jobs directory with inotify
+/// and submits every .job file that is closed after writing or moved in.
+/// @param sched Scheduler to submit the jobs to. Must be watching.
+/// @param thread Pointer to store the watcher thread in.
+/// @return 0 if the watcher was started successfully, 1 otherwise.
+int watch_start(struct Scheduler *sched, pthread_t *thread);
+
+#endif // KVS_WATCH_H